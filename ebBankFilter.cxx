@@ -0,0 +1,240 @@
+/*****************************************************************************/
+/**
+\file ebBankFilter.cxx
+
+\section contents Contents
+Bank include/exclude lists, per fragment and per trigger class
+
+\subsection notes Notes about this class
+Main (assembly) thread only.  Select() only reads the bank headers (and the
+record directory for "Drop W2 with ZL"): the data of the banks kept is
+touched once, by the copy into the event or by bm_send_event_sg().
+ *****************************************************************************/
+
+#include "ebBankFilter.hxx"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "ebRecord.hxx"
+#include "ebDecoder.hxx"
+
+//---------------------------------------------------------------------------------
+EBBankFilter::EBBankFilter()
+: enabled_(FALSE), w2_with_zl_(FALSE), nclass_(0)
+  , banks_dropped_(0), bytes_dropped_(0), bytes_kept_(0)
+{
+  for (int i = 0; i < EBBANKSEL_NCLASS; i++) class_bits_[i] = 0;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Read and compile the global and trigger class lists (BOR)
+ *
+ * \param   [in]  hDB    ODB handle
+ * \param   [in]  hKey   bank selection settings key
+ */
+void EBBankFilter::Configure(HNDLE hDB, HNDLE hKey)
+{
+  int size;
+
+  size = sizeof(enabled_);
+  db_get_value(hDB, hKey, "Enable", &enabled_, &size, TID_BOOL, TRUE);
+  ReadRules(hDB, hKey, "", global_);
+  size = sizeof(w2_with_zl_);
+  db_get_value(hDB, hKey, "Drop W2 with ZL", &w2_with_zl_, &size, TID_BOOL, TRUE);
+
+  nclass_ = 0;
+  for (int i = 0; i < EBBANKSEL_NCLASS; i++) {
+    char key[64];
+    INT bits = 0;
+    sprintf(key, "Class %d/Trigger bits", i + 1);
+    size = sizeof(bits);
+    db_get_value(hDB, hKey, key, &bits, &size, TID_INT, TRUE);
+    sprintf(key, "Class %d/", i + 1);
+    ReadRules(hDB, hKey, key, class_[i]);
+    class_bits_[i] = bits;
+    if (bits && !class_[i].IsEmpty()) nclass_++;
+  }
+
+  frag_.clear();
+  banks_dropped_ = 0;
+  bytes_dropped_ = 0;
+  bytes_kept_ = 0;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Read and compile the lists of one fragment (BOR)
+ *
+ * \param   [in]  frag   fragment ID
+ * \param   [in]  name   fragment equipment name, the key under "Fragments"
+ */
+void EBBankFilter::ConfigureFragment(HNDLE hDB, HNDLE hKey, int frag, const char *name)
+{
+  char path[NAME_LENGTH + 16];
+  sprintf(path, "Fragments/%s/", name);
+  if ((int)frag_.size() <= frag) frag_.resize(frag + 1);
+  ReadRules(hDB, hKey, path, frag_[frag]);
+}
+
+//---------------------------------------------------------------------------------
+/// Include and Exclude keys under path ("" or ending with '/')
+void EBBankFilter::ReadRules(HNDLE hDB, HNDLE hKey, const char *path, Rules_t &rules)
+{
+  char key[NAME_LENGTH + 32];
+  char text[256];
+  int size;
+
+  text[0] = 0;
+  sprintf(key, "%sInclude", path);
+  size = sizeof(text);
+  db_get_value(hDB, hKey, key, text, &size, TID_STRING, TRUE);
+  Compile(text, rules.include);
+
+  text[0] = 0;
+  sprintf(key, "%sExclude", path);
+  size = sizeof(text);
+  db_get_value(hDB, hKey, key, text, &size, TID_STRING, TRUE);
+  Compile(text, rules.exclude);
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Bank names separated by spaces or commas into a sorted FourCC table
+ *
+ * "ABCD": one bank, "AB" or "AB*": prefix, "*": all.  Anything else is
+ * reported and ignored.
+ */
+void EBBankFilter::Compile(const char *text, List_t &list)
+{
+  list = List_t();
+
+  const char *sep = " ,;\t";
+  const char *p = text;
+  while (*p) {
+    p += strspn(p, sep);
+    int n = strcspn(p, sep);
+    if (n == 0) break;
+
+    char name[4] = { 0, 0, 0, 0 };
+    DWORD fourcc;
+    if (n == 1 && p[0] == '*') {
+      list.all = true;
+    } else if (n == 2 || (n == 3 && p[2] == '*')) {
+      memcpy(name, p, 2);
+      memcpy(&fourcc, name, 4);
+      list.prefixes.push_back(fourcc);
+    } else if (n == 4 && !memchr(p, '*', 4)) {
+      memcpy(name, p, 4);
+      memcpy(&fourcc, name, 4);
+      list.names.push_back(fourcc);
+    } else {
+      cm_msg(MERROR, "EBBankFilter", "Bank name \"%.*s\" ignored: 4 characters, or 2 for a prefix", n, p);
+    }
+    p += n;
+  }
+
+  std::sort(list.names.begin(), list.names.end());
+  std::sort(list.prefixes.begin(), list.prefixes.end());
+}
+
+//---------------------------------------------------------------------------------
+bool EBBankFilter::List_t::Match(DWORD fourcc) const
+{
+  if (all) return true;
+  if (!names.empty() && std::binary_search(names.begin(), names.end(), fourcc)) return true;
+  return !prefixes.empty() && std::binary_search(prefixes.begin(), prefixes.end(), fourcc & EB_PREFIX_MASK);
+}
+
+//---------------------------------------------------------------------------------
+bool EBBankFilter::Keep(const Rules_t &rules, DWORD fourcc)
+{
+  if (!rules.include.IsEmpty() && !rules.include.Match(fourcc)) return false;
+  return !rules.exclude.Match(fourcc);
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Trigger class of an event
+ *
+ * \param   [in]  trigger   DTM trigger bits, 0xFFFFFFFF if unknown
+ * \return  first class with one of these bits and a list, -1 if none
+ */
+int EBBankFilter::Class(DWORD trigger) const
+{
+  if (trigger == 0xFFFFFFFF) return -1;
+  for (int i = 0; i < EBBANKSEL_NCLASS; i++)
+    if ((trigger & class_bits_[i]) && !class_[i].IsEmpty()) return i;
+  return -1;
+}
+
+//---------------------------------------------------------------------------------
+bool EBBankFilter::Applies(int frag, int cls) const
+{
+  if (!enabled_) return false;
+  if (w2_with_zl_ || !global_.IsEmpty()) return true;
+  if (frag < (int)frag_.size() && !frag_[frag].IsEmpty()) return true;
+  return cls >= 0 && !class_[cls].IsEmpty();
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Banks kept of a fragment record, as runs of consecutive banks
+ *
+ * The runs point into the record (bank headers included) and are valid
+ * until the next Select() or until the record is released.
+ *
+ * \param   [in]  prec   record (EVENT_HEADER) in the ring buffer, bank32
+ * \param   [in]  frag   fragment ID
+ * \param   [in]  cls    trigger class, Class()
+ * \return  number of runs
+ */
+int EBBankFilter::Select(char *prec, int frag, int cls)
+{
+  ptr_.clear();
+  len_.clear();
+
+  BANK_HEADER *pbh = (BANK_HEADER *)((EVENT_HEADER *)prec + 1);
+  const Rules_t *fr = (frag < (int)frag_.size() && !frag_[frag].IsEmpty()) ? &frag_[frag] : NULL;
+  const Rules_t *cr = (cls >= 0) ? &class_[cls] : NULL;
+
+  char *p = (char *)(pbh + 1);
+  char *end = p + pbh->data_size;
+  char *run = NULL;
+  while (p < end) {
+    BANK32 *pbk = (BANK32 *)p;
+    char *next = (char *)(pbk + 1) + ALIGN8(pbk->data_size);
+    DWORD fourcc = EBBankFourCC(pbk);
+
+    bool keep = Keep(global_, fourcc) && (!fr || Keep(*fr, fourcc)) && (!cr || Keep(*cr, fourcc));
+    if (keep && w2_with_zl_ && (fourcc & EB_PREFIX_MASK) == EB_FOURCC('W','2',0,0)) {
+      // Raw waveforms of a module already zero-suppressed (by the digitizer or the fragment thread)
+      DWORD *pzl = NULL;
+      EBRecordFindBank(prec, (fourcc & ~EB_PREFIX_MASK) | EB_FOURCC('Z','L',0,0), &pzl);
+      keep = (pzl == NULL);
+    }
+
+    if (keep) {
+      if (!run) run = p;
+    } else {
+      if (run) {
+        ptr_.push_back(run);
+        len_.push_back(p - run);
+        bytes_kept_ += p - run;
+        run = NULL;
+      }
+      banks_dropped_++;
+      bytes_dropped_ += next - p;
+    }
+    p = next;
+  }
+  if (run) {
+    ptr_.push_back(run);
+    len_.push_back(end - run);
+    bytes_kept_ += end - run;
+  }
+
+  return ptr_.size();
+}
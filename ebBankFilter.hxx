@@ -0,0 +1,99 @@
+/*****************************************************************************/
+/**
+\file ebBankFilter.hxx
+
+## Contents
+
+Bank selection at build time: fragment banks that downstream never uses are
+left out of the built event.  Settings under Settings/Bank selection:
+
+    Enable                        FALSE: every bank is kept
+    Include                       bank names kept, "" for all of them
+    Exclude                       bank names dropped
+    Drop W2 with ZL               W2xx dropped when the same record has ZLxx
+    Fragments/<name>/Include      the same, for the banks of one fragment
+    Fragments/<name>/Exclude
+    Class n/Trigger bits          DTM trigger bits (DTRG trigger word, bits 16-23)
+    Class n/Include               the same, for the events of that class
+    Class n/Exclude
+
+A list is made of names separated by spaces or commas: "DBG0" is one bank,
+"W2" or "W2*" all the banks starting with W2, "*" all of them.  A bank is
+kept if it is in all the non-empty include lists and in none of the exclude
+lists that apply (global, its fragment, the first class matching the event
+trigger bits).  The lists are compiled at BOR into sorted FourCC tables;
+the selection walks the bank headers of the record in the ring buffer and
+gives back the runs of banks kept, for one memcpy or one scatter-gather
+piece each.
+ *****************************************************************************/
+
+#ifndef EBBANKFILTER_HXX_INCLUDE
+#define EBBANKFILTER_HXX_INCLUDE
+
+#include <stdint.h>
+#include <vector>
+
+#include "midas.h"
+
+#define EBBANKSEL_NCLASS   4     //!< Trigger classes with their own lists
+
+class EBBankFilter
+{
+
+public:
+
+  EBBankFilter();
+
+  void Configure(HNDLE hDB, HNDLE hKey);                  //!< BOR, keys under hKey ("Bank selection")
+  void ConfigureFragment(HNDLE hDB, HNDLE hKey, int frag, const char *name);   //!< BOR, after Configure()
+  bool IsEnabled() const { return enabled_; }
+  bool UsesTrigger() const { return nclass_ > 0; }        //!< Class lists: DTM trigger bits needed
+
+  int Class(DWORD trigger) const;                         //!< Class of the event trigger bits, -1: none
+  bool Applies(int frag, int cls) const;                  //!< Some banks of this fragment may be dropped
+
+  /// Runs of banks kept of a fragment record (EVENT_HEADER, bank32), see GetPtr()/GetLen()
+  int Select(char *prec, int frag, int cls);
+  const char *const *GetPtr() const { return ptr_.data(); }
+  const size_t *GetLen() const { return len_.data(); }
+
+  uint64_t GetBanksDropped() const { return banks_dropped_; }
+  uint64_t GetBytesDropped() const { return bytes_dropped_; }   //!< Bank headers included
+  uint64_t GetBytesKept() const { return bytes_kept_; }         //!< Of the fragments selected
+
+private:
+
+  /// Compiled list: full names and two-character prefixes, sorted
+  struct List_t {
+    std::vector<DWORD> names;
+    std::vector<DWORD> prefixes;
+    bool all;
+    List_t() : all(false) {}
+    bool IsEmpty() const { return !all && names.empty() && prefixes.empty(); }
+    bool Match(DWORD fourcc) const;
+  };
+  struct Rules_t {
+    List_t include;
+    List_t exclude;
+    bool IsEmpty() const { return include.IsEmpty() && exclude.IsEmpty(); }
+  };
+
+  static void Compile(const char *text, List_t &list);
+  static void ReadRules(HNDLE hDB, HNDLE hKey, const char *path, Rules_t &rules);
+  static bool Keep(const Rules_t &rules, DWORD fourcc);
+
+  BOOL enabled_;
+  BOOL w2_with_zl_;
+  Rules_t global_;
+  std::vector<Rules_t> frag_;                   //!< By fragment ID
+  Rules_t class_[EBBANKSEL_NCLASS];
+  DWORD class_bits_[EBBANKSEL_NCLASS];
+  int nclass_;                                  //!< Classes with trigger bits and a list
+  std::vector<const char *> ptr_;               //!< Runs of the last Select()
+  std::vector<size_t> len_;
+  uint64_t banks_dropped_;
+  uint64_t bytes_dropped_;
+  uint64_t bytes_kept_;
+};
+
+#endif // EBBANKFILTER_HXX_INCLUDE
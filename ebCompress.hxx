@@ -0,0 +1,191 @@
+/*****************************************************************************/
+/**
+\file ebCompress.hxx
+
+## Contents
+
+Waveform bank compression format, and the functions to compress and restore
+a built event.  Header only; the analyzers need zlib (-lz), nothing else.
+
+A compressed bank keeps its name and has EB_BANK_ZLIB added to its type:
+
+    DWORD  original data size in bytes
+    BYTE   zlib (deflate) stream of the original data
+
+Only W2xx/W4xx banks of at least "min bytes" are compressed, and only when
+that makes them smaller; all the other banks are copied as they are.
+
+    if (EBIsCompressed(pevent))
+      EBDecompressEvent(pevent, buffer, sizeof(buffer));
+ *****************************************************************************/
+
+#ifndef EBCOMPRESS_HXX_INCLUDE
+#define EBCOMPRESS_HXX_INCLUDE
+
+#include <string.h>
+#include <algorithm>
+#include <zlib.h>
+
+#include "midas.h"
+
+#define EB_BANK_ZLIB   0x10000    //!< Bank type flag: payload is [size][zlib stream]
+
+//---------------------------------------------------------------------------------
+static inline bool EBCompressibleBank(const BANK32 *pbk)
+{
+  return pbk->name[0] == 'W' && (pbk->name[1] == '2' || pbk->name[1] == '4')
+         && !(pbk->type & EB_BANK_ZLIB);
+}
+
+static inline DWORD EBAlign8(DWORD size)
+{
+  return (size + 7) & ~7;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Copy an event, compressing its waveform banks
+ *
+ * \param   [in]  src        built event
+ * \param   [out] dst        compressed event
+ * \param   [in]  dst_size   room at dst
+ * \param   [in]  level      zlib compression level (1 fast ... 9 small)
+ * \param   [in]  min_bytes  smallest bank worth compressing
+ * \return  size of the dst event (header included), -1 if it doesn't fit
+ */
+static inline int EBCompressEvent(const EVENT_HEADER *src, EVENT_HEADER *dst, int dst_size
+                                  , int level, DWORD min_bytes)
+{
+  const BANK_HEADER *sbh = (const BANK_HEADER *)(src + 1);
+  BANK_HEADER *dbh = (BANK_HEADER *)(dst + 1);
+  DWORD size = sizeof(EVENT_HEADER) + src->data_size;
+
+  if (sbh->flags != (BANK_FORMAT_VERSION | BANK_FORMAT_32BIT)) {
+    // Not bank32: as it is
+    if (size > (DWORD)dst_size) return -1;
+    memcpy(dst, src, size);
+    return size;
+  }
+
+  memcpy(dst, src, sizeof(EVENT_HEADER) + sizeof(BANK_HEADER));
+  const char *p = (const char *)(sbh + 1);
+  const char *end = p + sbh->data_size;
+  char *q = (char *)(dbh + 1);
+  char *qend = (char *)dst + dst_size;
+
+  while (p < end) {
+    const BANK32 *sbk = (const BANK32 *)p;
+    BANK32 *dbk = (BANK32 *)q;
+    const char *sdata = (const char *)(sbk + 1);
+    char *ddata = (char *)(dbk + 1);
+    DWORD bksize = sbk->data_size;
+    if (ddata > qend) return -1;
+    memcpy(dbk, sbk, sizeof(BANK32));
+
+    bool packed = false;
+    if (bksize >= min_bytes && EBCompressibleBank(sbk) && ddata + sizeof(DWORD) < qend) {
+      uLongf zlen = std::min((uLongf)(qend - ddata - sizeof(DWORD)), (uLongf)bksize);
+      if (compress2((Bytef *)(ddata + sizeof(DWORD)), &zlen, (const Bytef *)sdata, bksize, level) == Z_OK
+          && zlen + sizeof(DWORD) < bksize) {
+        *(DWORD *)ddata = bksize;
+        dbk->type |= EB_BANK_ZLIB;
+        dbk->data_size = zlen + sizeof(DWORD);
+        packed = true;
+      }
+    }
+    if (!packed) {
+      if (ddata + bksize > qend) return -1;
+      memcpy(ddata, sdata, bksize);
+    }
+
+    // Zero the alignment padding
+    DWORD dsize = dbk->data_size;
+    if (ddata + EBAlign8(dsize) > qend) return -1;
+    memset(ddata + dsize, 0, EBAlign8(dsize) - dsize);
+
+    p = sdata + EBAlign8(bksize);
+    q = ddata + EBAlign8(dsize);
+  }
+
+  dbh->data_size = q - (char *)(dbh + 1);
+  dst->data_size = sizeof(BANK_HEADER) + dbh->data_size;
+  return sizeof(EVENT_HEADER) + dst->data_size;
+}
+
+//---------------------------------------------------------------------------------
+/// true if the event has at least one compressed bank
+static inline bool EBIsCompressed(const EVENT_HEADER *pevent)
+{
+  const BANK_HEADER *pbh = (const BANK_HEADER *)(pevent + 1);
+  if (pbh->flags != (BANK_FORMAT_VERSION | BANK_FORMAT_32BIT)) return false;
+  const char *p = (const char *)(pbh + 1);
+  const char *end = p + pbh->data_size;
+  while (p < end) {
+    const BANK32 *pbk = (const BANK32 *)p;
+    if (pbk->type & EB_BANK_ZLIB) return true;
+    p = (const char *)(pbk + 1) + EBAlign8(pbk->data_size);
+  }
+  return false;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Restore the original event from a compressed one
+ *
+ * \param   [in]  src        event from the event builder
+ * \param   [out] dst        original event
+ * \param   [in]  dst_size   room at dst
+ * \return  size of the dst event (header included), -1 on error
+ */
+static inline int EBDecompressEvent(const EVENT_HEADER *src, EVENT_HEADER *dst, int dst_size)
+{
+  const BANK_HEADER *sbh = (const BANK_HEADER *)(src + 1);
+  BANK_HEADER *dbh = (BANK_HEADER *)(dst + 1);
+  DWORD size = sizeof(EVENT_HEADER) + src->data_size;
+
+  if (sbh->flags != (BANK_FORMAT_VERSION | BANK_FORMAT_32BIT)) {
+    if (size > (DWORD)dst_size) return -1;
+    memcpy(dst, src, size);
+    return size;
+  }
+
+  memcpy(dst, src, sizeof(EVENT_HEADER) + sizeof(BANK_HEADER));
+  const char *p = (const char *)(sbh + 1);
+  const char *end = p + sbh->data_size;
+  char *q = (char *)(dbh + 1);
+  char *qend = (char *)dst + dst_size;
+
+  while (p < end) {
+    const BANK32 *sbk = (const BANK32 *)p;
+    BANK32 *dbk = (BANK32 *)q;
+    const char *sdata = (const char *)(sbk + 1);
+    char *ddata = (char *)(dbk + 1);
+    if (ddata > qend) return -1;
+    memcpy(dbk, sbk, sizeof(BANK32));
+
+    if (sbk->type & EB_BANK_ZLIB) {
+      if (sbk->data_size < sizeof(DWORD)) return -1;   // no room for the uncompressed size
+      uLongf len = *(const DWORD *)sdata;
+      if (ddata + EBAlign8(len) > qend) return -1;
+      if (uncompress((Bytef *)ddata, &len, (const Bytef *)(sdata + sizeof(DWORD)), sbk->data_size - sizeof(DWORD)) != Z_OK
+          || len != *(const DWORD *)sdata)
+        return -1;
+      dbk->type &= ~EB_BANK_ZLIB;
+      dbk->data_size = len;
+    } else {
+      if (ddata + EBAlign8(sbk->data_size) > qend) return -1;
+      memcpy(ddata, sdata, sbk->data_size);
+    }
+
+    DWORD dsize = dbk->data_size;
+    memset(ddata + dsize, 0, EBAlign8(dsize) - dsize);
+    p = sdata + EBAlign8(sbk->data_size);
+    q = ddata + EBAlign8(dsize);
+  }
+
+  dbh->data_size = q - (char *)(dbh + 1);
+  dst->data_size = sizeof(BANK_HEADER) + dbh->data_size;
+  return sizeof(EVENT_HEADER) + dst->data_size;
+}
+
+#endif // EBCOMPRESS_HXX_INCLUDE
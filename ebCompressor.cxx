@@ -0,0 +1,192 @@
+/*****************************************************************************/
+/**
+\file ebCompressor.cxx
+
+\section contents Contents
+Compression worker pool with a reorder buffer
+
+\subsection notes Notes about this class
+The pipeline holds 2 events per worker.  Slot seq % size holds event seq;
+Submit() copies the event in (so the output ring space is free again at
+once), the workers take the oldest queued slot, and Next() hands back slot
+head_ only, so the events leave in the order they came in whatever the
+compression time of each one.
+ *****************************************************************************/
+
+#include "ebCompressor.hxx"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ebCompress.hxx"
+
+//---------------------------------------------------------------------------------
+EBCompressor::EBCompressor()
+: head_(0), tail_(0), stop_(false), level_(1), min_bytes_(0), bytes_in_(0), bytes_out_(0)
+{
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&work_cond_, NULL);
+  pthread_cond_init(&done_cond_, NULL);
+}
+
+//---------------------------------------------------------------------------------
+EBCompressor::~EBCompressor()
+{
+  Stop();
+  pthread_cond_destroy(&done_cond_);
+  pthread_cond_destroy(&work_cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Allocate the pipeline and start the workers
+ *
+ * \param   [in]  nworkers   compression threads
+ * \param   [in]  level      zlib level
+ * \param   [in]  min_bytes  smallest W2xx/W4xx bank compressed
+ * \param   [in]  max_event  largest event
+ * \return  true if at least one worker runs
+ */
+bool EBCompressor::Start(int nworkers, int level, int min_bytes, int max_event)
+{
+  Stop();
+
+  level_ = level;
+  min_bytes_ = min_bytes;
+  head_ = tail_ = 0;
+  stop_ = false;
+  bytes_in_ = 0;
+  bytes_out_ = 0;
+
+  slots_.resize(2 * nworkers);
+  for (unsigned int i = 0; i < slots_.size(); i++) {
+    slots_[i].in.resize(max_event);
+    slots_[i].out.resize(max_event);
+    slots_[i].state = kFree;
+  }
+
+  workers_.reserve(nworkers);
+  for (int i = 0; i < nworkers; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, &WorkerThread, this)) {
+      cm_msg(MERROR, "EBCompressor", "Cannot start compression worker %d", i);
+      break;
+    }
+    workers_.push_back(tid);
+  }
+  if (workers_.empty()) slots_.clear();
+  return !workers_.empty();
+}
+
+//---------------------------------------------------------------------------------
+void EBCompressor::Stop()
+{
+  if (workers_.empty()) return;
+
+  pthread_mutex_lock(&mutex_);
+  stop_ = true;
+  pthread_cond_broadcast(&work_cond_);
+  pthread_mutex_unlock(&mutex_);
+
+  for (unsigned int i = 0; i < workers_.size(); i++)
+    pthread_join(workers_[i], NULL);
+  workers_.clear();
+  slots_.clear();
+  head_ = tail_ = 0;
+}
+
+//---------------------------------------------------------------------------------
+bool EBCompressor::Fits(const EVENT_HEADER *pevent) const
+{
+  return !slots_.empty() && sizeof(EVENT_HEADER) + pevent->data_size <= slots_[0].in.size();
+}
+
+//---------------------------------------------------------------------------------
+bool EBCompressor::Submit(const EVENT_HEADER *pevent)
+{
+  if (tail_ - head_ == slots_.size() || !Fits(pevent)) return false;
+
+  Slot &slot = slots_[tail_ % slots_.size()];
+  memcpy(&slot.in[0], pevent, sizeof(EVENT_HEADER) + pevent->data_size);
+
+  pthread_mutex_lock(&mutex_);
+  slot.state = kQueued;
+  tail_++;
+  pthread_cond_signal(&work_cond_);
+  pthread_mutex_unlock(&mutex_);
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+EVENT_HEADER *EBCompressor::Next(int timeout_ms)
+{
+  if (head_ == tail_) return NULL;
+
+  Slot &slot = slots_[head_ % slots_.size()];
+  pthread_mutex_lock(&mutex_);
+  if (slot.state != kDone && timeout_ms > 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += timeout_ms * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    while (slot.state != kDone)
+      if (pthread_cond_timedwait(&done_cond_, &mutex_, &ts)) break;
+  }
+  bool done = (slot.state == kDone);
+  pthread_mutex_unlock(&mutex_);
+
+  return done ? (EVENT_HEADER *)&slot.out[0] : NULL;
+}
+
+//---------------------------------------------------------------------------------
+void EBCompressor::Release()
+{
+  pthread_mutex_lock(&mutex_);
+  slots_[head_ % slots_.size()].state = kFree;
+  head_++;
+  pthread_mutex_unlock(&mutex_);
+}
+
+//---------------------------------------------------------------------------------
+void *EBCompressor::WorkerThread(void *arg)
+{
+  EBCompressor *c = (EBCompressor *)arg;
+
+  pthread_mutex_lock(&c->mutex_);
+  for (;;) {
+    // Oldest queued event first
+    Slot *slot = NULL;
+    for (uint64_t seq = c->head_; seq < c->tail_ && !slot; seq++) {
+      Slot &s = c->slots_[seq % c->slots_.size()];
+      if (s.state == kQueued) slot = &s;
+    }
+    if (!slot) {
+      if (c->stop_) break;
+      pthread_cond_wait(&c->work_cond_, &c->mutex_);
+      continue;
+    }
+    slot->state = kBusy;
+    pthread_mutex_unlock(&c->mutex_);
+
+    EVENT_HEADER *src = (EVENT_HEADER *)&slot->in[0];
+    EVENT_HEADER *dst = (EVENT_HEADER *)&slot->out[0];
+    int size = EBCompressEvent(src, dst, slot->out.size(), c->level_, c->min_bytes_);
+    if (size < 0) {
+      // Cannot happen (never larger than the input); send it as it came
+      size = sizeof(EVENT_HEADER) + src->data_size;
+      memcpy(dst, src, size);
+    }
+    c->bytes_in_ += sizeof(EVENT_HEADER) + src->data_size;
+    c->bytes_out_ += size;
+
+    pthread_mutex_lock(&c->mutex_);
+    slot->state = kDone;
+    pthread_cond_broadcast(&c->done_cond_);
+  }
+  pthread_mutex_unlock(&c->mutex_);
+
+  return NULL;
+}
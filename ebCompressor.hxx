@@ -0,0 +1,75 @@
+/*****************************************************************************/
+/**
+\file ebCompressor.hxx
+
+## Contents
+
+Compression stage of the output: a pool of worker threads compresses the
+waveform banks of the built events (ebCompress.hxx) while the sender gets
+them back in the order they were submitted.
+ *****************************************************************************/
+
+#ifndef EBCOMPRESSOR_HXX_INCLUDE
+#define EBCOMPRESSOR_HXX_INCLUDE
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+#include "midas.h"
+
+class EBCompressor
+{
+
+public:
+
+  EBCompressor();
+  ~EBCompressor();
+
+  bool Start(int nworkers, int level, int min_bytes, int max_event);
+  void Stop();
+  bool IsRunning() const { return !workers_.empty(); }
+
+  /* Sender thread only */
+  bool Fits(const EVENT_HEADER *pevent) const;  //!< The event fits in a pipeline slot
+  bool Submit(const EVENT_HEADER *pevent);   //!< Copy in the next event, false if the pipeline is full or it doesn't fit
+  EVENT_HEADER *Next(int timeout_ms);        //!< Oldest event once compressed, NULL if not ready yet
+  void Release();                            //!< Done with the Next() event
+  int GetPending() const { return (int)(tail_ - head_); }
+
+  uint64_t GetBytesIn() const { return bytes_in_.load(); }
+  uint64_t GetBytesOut() const { return bytes_out_.load(); }
+
+private:
+
+  enum SlotState { kFree, kQueued, kBusy, kDone };
+
+  /// One event in the pipeline, slot seq % size
+  struct Slot {
+    std::vector<char> in;
+    std::vector<char> out;
+    SlotState state;
+  };
+
+  EBCompressor(const EBCompressor&);
+  EBCompressor& operator=(const EBCompressor&);
+
+  static void *WorkerThread(void *arg);
+
+  std::vector<Slot> slots_;
+  std::vector<pthread_t> workers_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t work_cond_;                 //!< Slot queued, or stop
+  pthread_cond_t done_cond_;                 //!< Slot done
+  uint64_t head_;                            //!< Next event to hand back (under mutex_ for the workers)
+  uint64_t tail_;                            //!< Next event to submit
+  bool stop_;
+  int level_;                                //!< zlib level
+  int min_bytes_;                            //!< Smallest bank compressed
+
+  std::atomic<uint64_t> bytes_in_;           //!< Event bytes before compression
+  std::atomic<uint64_t> bytes_out_;          //!< Event bytes after compression
+};
+
+#endif // EBCOMPRESSOR_HXX_INCLUDE
@@ -0,0 +1,203 @@
+/*****************************************************************************/
+/**
+\file ebDecoder.hxx
+
+## Contents
+
+Fragment bank decoders used by EBFragment::ReadFragment().
+
+The fragment type is known at BOR from its trigger mask, so one decoder is
+chosen then (EBFragment::SelectDecoder()) and the bank loop is instantiated
+per decoder: no string work and no branching on the fragment kind per bank.
+Bank names are compared as FourCC integers.
+ *****************************************************************************/
+
+#ifndef EBDECODER_HXX_INCLUDE
+#define EBDECODER_HXX_INCLUDE
+
+#include <string.h>
+#include <vector>
+
+#include "midas.h"
+#include "ebRecord.hxx"
+
+#define TS2_IDX             1    //!< Time Stamp V1720 copy to QT bank
+#define N_DWORD_IDX         2    //!< Number of 32-bit words from the QT bank
+#define QCH_IDX             0    //!< Channel/bases index        (triplet)
+#define BASE_IDX            1    //!< 1st, basebefore, baseafter (triplet)
+#define QINTEGRAL_IDX       2    //!< Integral                   (triplet)
+#define TS_IDX              3    //!< Time Stamp from the V1720/V1740/Veto bank
+
+#define EB_PREFIX_MASK      0x0000FFFF   //!< First two characters of a FourCC
+
+static inline DWORD EBBankFourCC(const BANK32 *pbh)
+{
+  DWORD fourcc;
+  memcpy(&fourcc, pbh->name, sizeof(fourcc));
+  return fourcc;
+}
+
+/// Module number from the two last (decimal) characters of "ZL07", "QT12", ...
+static inline int EBBankModule(DWORD fourcc)
+{
+  return (int)(((fourcc >> 16) & 0xFF) - '0') * 10 + (int)((fourcc >> 24) - '0');
+}
+
+/// Scan results and parameters, shared by all the decoders
+struct EBSCAN_STATE {
+  DWORD tsmin;                 //!< Earliest bank timestamp
+  DWORD tsmax;                 //!< Latest bank timestamp
+  DWORD first_ts;              //!< Timestamp of the first module of the group (0 if not seen)
+  int nbank;                   //!< Number of timestamped banks
+  bool v1720;                  //!< 8ns timestamps, QT summary stored
+  int first_module;            //!< First module number of this V1720 group, -1 if not a group
+  int rebin;                   //!< QT summary rebin factor (>= 1)
+  std::vector<DWORD> *q;       //!< QT summary charge per rebinned time bin
+  std::vector<DWORD> *n;       //!< QT summary number of pulses per rebinned time bin
+  std::vector<const DWORD *> *qtbanks; //!< QT banks left for the worker pool (EBDecoderV1720Pool)
+  EBBANK_DIR *dir;             //!< Bank directory being filled (EB_MAX_DIR entries)
+  DWORD ndir;                  //!< Number of banks seen (may exceed EB_MAX_DIR)
+};
+
+//---------------------------------------------------------------------------------
+/// Accumulate the pulses of one QT bank in the summary histogram
+static inline void EBAccumulateQT(EBSCAN_STATE &st, const DWORD *pdata_b)
+{
+  int ndwords = pdata_b[N_DWORD_IDX];
+  std::vector<DWORD> &qvect = *st.q;
+  std::vector<DWORD> &nvect = *st.n;
+
+  // Loop over qt values.
+  for (int i = QINTEGRAL_IDX+1 ; i < QINTEGRAL_IDX+ndwords+1; i+=4) {
+    int min_bin = ((pdata_b[i+3] >> 16) & 0xFFFF);
+    DWORD integral = (pdata_b[i+2] & 0xFFFFFF);
+
+    // Rebin the time base.
+    unsigned int bin = min_bin / st.rebin;
+
+    // Ensure the vectors are long enough
+    if (bin >= qvect.size()) {
+      qvect.resize(bin+1, 0);
+      nvect.resize(bin+1, 0);
+    }
+
+    // Saturate the charge at 4e9
+    DWORD charge = qvect[bin];
+    if (charge > 4000000000u - integral) charge = 4000000000u;
+    else                                 charge += integral;
+    qvect[bin] = charge;
+    nvect[bin]++;
+  }
+}
+
+static inline void EBMinMaxTS(EBSCAN_STATE &st, DWORD ts)
+{
+  if (ts > st.tsmax) st.tsmax = ts;
+  if (ts < st.tsmin) st.tsmin = ts;
+}
+
+//---------------------------------------------------------------------------------
+/// DTM (trigger) fragment: DTRG bank only, nothing to summarize
+struct EBDecoderDTM {
+  static inline void Bank(EBSCAN_STATE &, DWORD, const DWORD *) {}
+};
+
+/// V1720 group: ZLxx, QTxx, W2xx banks; first module from the precomputed table
+struct EBDecoderV1720 {
+  static inline void Bank(EBSCAN_STATE &st, DWORD fourcc, const DWORD *pdata_b) {
+    switch (fourcc & EB_PREFIX_MASK) {
+    case EB_FOURCC('Z','L',0,0):
+    case EB_FOURCC('W','2',0,0):
+      if (EBBankModule(fourcc) == st.first_module) st.first_ts = pdata_b[TS_IDX];
+      break;
+    case EB_FOURCC('Q','T',0,0):
+      if (EBBankModule(fourcc) == st.first_module) st.first_ts = pdata_b[TS2_IDX];
+      EBMinMaxTS(st, pdata_b[TS2_IDX]);
+      EBAccumulateQT(st, pdata_b);
+      st.nbank++;
+      st.v1720 = true;
+      break;
+    }
+  }
+};
+
+/// V1720 group with a QT worker pool: as EBDecoderV1720, QT banks only collected
+struct EBDecoderV1720Pool {
+  static inline void Bank(EBSCAN_STATE &st, DWORD fourcc, const DWORD *pdata_b) {
+    switch (fourcc & EB_PREFIX_MASK) {
+    case EB_FOURCC('Z','L',0,0):
+    case EB_FOURCC('W','2',0,0):
+      if (EBBankModule(fourcc) == st.first_module) st.first_ts = pdata_b[TS_IDX];
+      break;
+    case EB_FOURCC('Q','T',0,0):
+      if (EBBankModule(fourcc) == st.first_module) st.first_ts = pdata_b[TS2_IDX];
+      EBMinMaxTS(st, pdata_b[TS2_IDX]);
+      st.qtbanks->push_back(pdata_b);
+      st.nbank++;
+      st.v1720 = true;
+      break;
+    }
+  }
+};
+
+/// V1720 group without QT summary: timestamps only
+struct EBDecoderV1720TS {
+  static inline void Bank(EBSCAN_STATE &st, DWORD fourcc, const DWORD *pdata_b) {
+    switch (fourcc & EB_PREFIX_MASK) {
+    case EB_FOURCC('Z','L',0,0):
+    case EB_FOURCC('W','2',0,0):
+      if (EBBankModule(fourcc) == st.first_module) st.first_ts = pdata_b[TS_IDX];
+      break;
+    case EB_FOURCC('Q','T',0,0):
+      if (EBBankModule(fourcc) == st.first_module) st.first_ts = pdata_b[TS2_IDX];
+      EBMinMaxTS(st, pdata_b[TS2_IDX]);
+      st.nbank++;
+      st.v1720 = true;
+      break;
+    }
+  }
+};
+
+/// V1740: W4xx banks, module 0 gives the reference timestamp
+struct EBDecoderV1740 {
+  static inline void Bank(EBSCAN_STATE &st, DWORD fourcc, const DWORD *pdata_b) {
+    if ((fourcc & EB_PREFIX_MASK) == EB_FOURCC('W','4',0,0)) {
+      EBMinMaxTS(st, pdata_b[TS_IDX]);
+      st.nbank++;
+      if (EBBankModule(fourcc) == 0) st.first_ts = pdata_b[TS_IDX];
+    }
+  }
+};
+
+/// Veto V1740: VETO bank
+struct EBDecoderVETO {
+  static inline void Bank(EBSCAN_STATE &st, DWORD fourcc, const DWORD *pdata_b) {
+    if (fourcc == EB_FOURCC('V','E','T','O')) {
+      EBMinMaxTS(st, pdata_b[TS_IDX]);
+      st.nbank++;
+    }
+  }
+};
+
+/// Calibration V1720: CALI bank, 8ns timestamps
+struct EBDecoderCALI {
+  static inline void Bank(EBSCAN_STATE &st, DWORD fourcc, const DWORD *pdata_b) {
+    if (fourcc == EB_FOURCC('C','A','L','I')) {
+      EBMinMaxTS(st, pdata_b[TS_IDX]);
+      st.nbank++;
+      st.v1720 = true;
+    }
+  }
+};
+
+/// Unknown trigger mask: try every bank type, as the original decoding did
+struct EBDecoderGeneric {
+  static inline void Bank(EBSCAN_STATE &st, DWORD fourcc, const DWORD *pdata_b) {
+    EBDecoderV1720::Bank(st, fourcc, pdata_b);
+    EBDecoderV1740::Bank(st, fourcc, pdata_b);
+    EBDecoderVETO::Bank(st, fourcc, pdata_b);
+    EBDecoderCALI::Bank(st, fourcc, pdata_b);
+  }
+};
+
+#endif // EBDECODER_HXX_INCLUDE
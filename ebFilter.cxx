@@ -0,0 +1,144 @@
+/*****************************************************************************/
+/**
+\file ebFilter.cxx
+
+\section contents Contents
+Level-2 software filter, evaluated by the assembly before the bank merging
+
+\subsection notes Notes about this class
+Main (assembly) thread only.  The QT summaries of the fragments are merged
+once per event by the assembly (EBQTSummary), the filters only read them.
+ *****************************************************************************/
+
+#include "ebFilter.hxx"
+
+#include <strings.h>
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Filter from its ODB name
+ *
+ * \param   [in]  type   "QT"; "" for no filter
+ * \return  new filter, NULL if none (error message for an unknown type)
+ */
+EBL2Filter *EBL2Filter::Create(const char *type)
+{
+  if (!type || !type[0]) return NULL;
+  if (!strcasecmp(type, "QT")) return new EBL2FilterQT;
+
+  cm_msg(MERROR, "EBL2Filter", "Unknown L2 filter type \"%s\", no filter", type);
+  return NULL;
+}
+
+//---------------------------------------------------------------------------------
+EBL2Filter::EBL2Filter()
+: prescale_(0), failed_(0), accepted_(0), rejected_(0), prescaled_(0)
+{
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Decision for one event
+ *
+ * \param   [in]  qt       merged QT summary of the records
+ * \param   [in]  records  ring buffer record of each enabled fragment
+ * \param   [in]  nrec     number of records
+ * \return  kAccept, kPrescaled (failed the cuts, kept by the prescale) or kReject
+ */
+EBL2Filter::Decision EBL2Filter::Decide(const EBQTSummary &qt, char *const *records, int nrec)
+{
+  if (Pass(qt, records, nrec)) {
+    accepted_++;
+    return kAccept;
+  }
+  if (prescale_ > 0 && (failed_++ % prescale_) == 0) {
+    prescaled_++;
+    return kPrescaled;
+  }
+  rejected_++;
+  return kReject;
+}
+
+//---------------------------------------------------------------------------------
+EBL2FilterQT::EBL2FilterQT()
+: rebin_(1), prompt_start_(9600.), prompt_end_(10400.), min_charge_(0.), max_charge_(0.)
+  , min_fprompt_(0.), max_fprompt_(1.), min_pulses_(0), charge_(0.), fprompt_(0.), npulses_(0)
+{
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Read the cuts (BOR)
+ *
+ * \param   [in]  hDB    ODB handle
+ * \param   [in]  hKey   L2 filter settings key
+ * \param   [in]  rebin  QT summary rebin factor of the fragments
+ */
+void EBL2FilterQT::Configure(HNDLE hDB, HNDLE hKey, int rebin)
+{
+  int size;
+
+  rebin_ = (rebin > 0) ? rebin : 1;
+  size = sizeof(prompt_start_);
+  db_get_value(hDB, hKey, "QT/Prompt start (ns)", &prompt_start_, &size, TID_DOUBLE, TRUE);
+  size = sizeof(prompt_end_);
+  db_get_value(hDB, hKey, "QT/Prompt end (ns)", &prompt_end_, &size, TID_DOUBLE, TRUE);
+  size = sizeof(min_charge_);
+  db_get_value(hDB, hKey, "QT/Min charge", &min_charge_, &size, TID_DOUBLE, TRUE);
+  size = sizeof(max_charge_);
+  db_get_value(hDB, hKey, "QT/Max charge", &max_charge_, &size, TID_DOUBLE, TRUE);
+  size = sizeof(min_fprompt_);
+  db_get_value(hDB, hKey, "QT/Min prompt fraction", &min_fprompt_, &size, TID_DOUBLE, TRUE);
+  size = sizeof(max_fprompt_);
+  db_get_value(hDB, hKey, "QT/Max prompt fraction", &max_fprompt_, &size, TID_DOUBLE, TRUE);
+  size = sizeof(min_pulses_);
+  db_get_value(hDB, hKey, "QT/Min pulses", &min_pulses_, &size, TID_INT, TRUE);
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Apply the cuts to the merged QT summary
+ *
+ * Events without any QT summary (no V1720 fragment, or no pulse) are
+ * accepted: the filter only judges what it can see.
+ */
+bool EBL2FilterQT::Pass(const EBQTSummary &qt, char *const *, int)
+{
+  const std::vector<uint64_t> &qsum = qt.GetQ();
+  const std::vector<DWORD> &nsum = qt.GetN();
+
+  charge_ = 0.;
+  fprompt_ = 0.;
+  npulses_ = 0;
+  if (qsum.empty()) return true;
+
+  // Prompt window in summary bins (4ns x rebin)
+  double binwidth = 4. * rebin_;
+  unsigned int pstart = (prompt_start_ > 0) ? (unsigned int)(prompt_start_ / binwidth) : 0;
+  unsigned int pend = (prompt_end_ > 0) ? (unsigned int)(prompt_end_ / binwidth) : 0;
+
+  uint64_t total = 0, prompt = 0;
+  for (unsigned int i = 0; i < qsum.size(); i++) {
+    total += qsum[i];
+    if (i >= pstart && i < pend) prompt += qsum[i];
+    npulses_ += nsum[i];
+  }
+  charge_ = (double)total;
+  fprompt_ = total ? (double)prompt / total : 0.;
+
+  if (charge_ < min_charge_) return false;
+  if (max_charge_ > 0 && charge_ > max_charge_) return false;
+  if (fprompt_ < min_fprompt_ || fprompt_ > max_fprompt_) return false;
+  if ((INT)npulses_ < min_pulses_) return false;
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+/// Total charge, prompt fraction, number of pulses
+int EBL2FilterQT::GetValues(float *v) const
+{
+  v[0] = (float)charge_;
+  v[1] = (float)fprompt_;
+  v[2] = (float)npulses_;
+  return 3;
+}
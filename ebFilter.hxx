@@ -0,0 +1,101 @@
+/*****************************************************************************/
+/**
+\file ebFilter.hxx
+
+## Contents
+
+Level-2 software filter of the assembly.  Once every fragment of an event
+is in its ring buffer, and before any bank is merged, the filter looks at
+the ring buffer records (ebRecord.hxx) and their merged QT summary
+(ebQTSummary.hxx), and decides whether the event is built.  Events failing
+the cuts are dropped, or kept one in "Prescale" and flagged as such.
+
+Filters derive from EBL2Filter and are chosen by name at BOR
+(Settings/L2 filter/Type, "" for none):
+
+  - "QT"  merged V1720 QT summary: total charge, prompt fraction, pulses
+
+The decision goes into a L2DC bank of each built event (TID_FLOAT):
+
+    [0]  EBL2Filter::kAccept or kPrescaled
+    [1]  ...  values of the filter (GetValues())
+ *****************************************************************************/
+
+#ifndef EBFILTER_HXX_INCLUDE
+#define EBFILTER_HXX_INCLUDE
+
+#include <stdint.h>
+
+#include "midas.h"
+#include "ebQTSummary.hxx"
+
+#define EBL2_MAX_VALUES   8     //!< Max filter values in the L2DC bank
+
+class EBL2Filter
+{
+
+public:
+
+  enum Decision { kReject = 0, kAccept = 1, kPrescaled = 2 };
+
+  static EBL2Filter *Create(const char *type);   //!< NULL if type is empty or unknown
+
+  EBL2Filter();
+  virtual ~EBL2Filter() {}
+
+  virtual const char *GetType() const = 0;
+  virtual void Configure(HNDLE hDB, HNDLE hKey, int rebin) = 0;   //!< BOR, keys under hKey
+  virtual bool Pass(const EBQTSummary &qt, char *const *records, int nrec) = 0;  //!< true if the event passes the cuts
+  virtual int GetValues(float *v) const = 0;                      //!< Quantities of the last Pass()
+
+  Decision Decide(const EBQTSummary &qt, char *const *records, int nrec);  //!< Pass() with the prescale and counters
+
+  void SetPrescale(int prescale) { prescale_ = prescale; }   //!< Keep 1 in prescale rejected events, 0: none
+  void ResetCounters() { accepted_ = rejected_ = prescaled_ = 0; }
+  uint64_t GetAccepted() const { return accepted_; }
+  uint64_t GetRejected() const { return rejected_; }
+  uint64_t GetPrescaled() const { return prescaled_; }
+
+private:
+
+  int prescale_;
+  uint64_t failed_;      //!< Events failing the cuts, for the prescale
+  uint64_t accepted_;
+  uint64_t rejected_;
+  uint64_t prescaled_;
+};
+
+/**
+ * QT summary filter.  Prompt charge is the merged QT summary charge in
+ * [prompt start, prompt end) ns.  Cuts: total charge, prompt fraction,
+ * number of pulses.
+ */
+class EBL2FilterQT : public EBL2Filter
+{
+
+public:
+
+  EBL2FilterQT();
+
+  const char *GetType() const { return "QT"; }
+  void Configure(HNDLE hDB, HNDLE hKey, int rebin);
+  bool Pass(const EBQTSummary &qt, char *const *records, int nrec);
+  int GetValues(float *v) const;
+
+private:
+
+  int rebin_;                 //!< QT summary bin width, 4ns units
+  double prompt_start_;       //!< ns
+  double prompt_end_;         //!< ns
+  double min_charge_;
+  double max_charge_;         //!< <= 0: no upper cut
+  double min_fprompt_;
+  double max_fprompt_;
+  INT min_pulses_;
+
+  double charge_;             //!< Results of the last Pass()
+  double fprompt_;
+  DWORD npulses_;
+};
+
+#endif // EBFILTER_HXX_INCLUDE
@@ -16,7 +16,14 @@ none for now
  *****************************************************************************/
 
 #include "ebFragment.hxx"
+#include "ebTrace.hxx"
+#include "ebMessage.hxx"
+#include "ebDecoder.hxx"
+#include "ebRecord.hxx"
+#include "ebQTPool.hxx"
+#include "ebBankFilter.hxx"
 #include <execinfo.h>
+#include <strings.h> // ffs()
 
 #define UNUSED(x) ((void)(x)) //!< Suppress compiler warnings
 
@@ -30,6 +37,7 @@ const char * EBFragment::config_str_fragment[] = {\
 };
 
 const char EBFragment::history_settings[][NAME_LENGTH] = { "rb_level" };
+std::atomic<uint64_t> EBFragment::fReadyMask(0);
 //---------------------------------------------------------------------------------
 /**
  * \brief   Constructor for the module object
@@ -55,10 +63,21 @@ EBFragment::EBFragment(HNDLE hDB)
   rb_handle_ = -1;
   requestID_=-1;
   fragmentID_=-1;
+  ready_bit_ = 0;
   verbosity_ = 0;
 	thread_status_ = 0;
 	fTimeStampErrors = 0;
 	fRebinFactor = 0;
+	memset(&fSim, 0, sizeof(fSim));
+	fSimSerial = 0;
+	fSimNextTime = 0;
+	fSimSeed = 0;
+	fSimSwapped = 0;
+	fFirstModule = -1;
+	fScanBanks = &EBFragment::ScanBanks<EBDecoderGeneric>;
+	fQTPoolMinBanks = 0;
+	fQTSummary = true;
+	fCompactQT = true;
 }
 
 //---------------------------------------------------------------------------------
@@ -86,9 +105,23 @@ EBFragment::EBFragment(EBFragment&& other) noexcept
 	thread_status_= std::move(other.thread_status_);
   requestID_ = std::move(other.requestID_);
   fragmentID_ = std::move(other.fragmentID_);
+  ready_bit_ = std::move(other.ready_bit_);
   config = std::move(other.config);
 	fTimeStampErrors = std::move(other.fTimeStampErrors);
 	fRebinFactor = std::move(other.fRebinFactor);
+	fSim = std::move(other.fSim);
+	fSimSerial = std::move(other.fSimSerial);
+	fSimNextTime = std::move(other.fSimNextTime);
+	fSimSeed = std::move(other.fSimSeed);
+	fSimSwapped = std::move(other.fSimSwapped);
+	fFirstModule = std::move(other.fFirstModule);
+	fScanBanks = std::move(other.fScanBanks);
+	fQTPool = std::move(other.fQTPool);
+	fQTPoolMinBanks = std::move(other.fQTPoolMinBanks);
+	fQTSummary = std::move(other.fQTSummary);
+	fCompactQT = std::move(other.fCompactQT);
+	fZS = std::move(other.fZS);
+	fReorder = std::move(other.fReorder);
 }
 
 //---------------------------------------------------------------------------------
@@ -112,9 +145,25 @@ EBFragment& EBFragment::operator=(EBFragment&& other) noexcept
     rb_handle_ = std::move(other.rb_handle_);
     verbosity_ = std::move(other.verbosity_);
     thread_status_ = std::move(other.thread_status_);
+    requestID_ = std::move(other.requestID_);
+    fragmentID_ = std::move(other.fragmentID_);
+    ready_bit_ = std::move(other.ready_bit_);
     config = std::move(other.config);
 		fTimeStampErrors = std::move(other.fTimeStampErrors);
 	  fRebinFactor = std::move(other.fRebinFactor);
+	  fSim = std::move(other.fSim);
+	  fSimSerial = std::move(other.fSimSerial);
+	  fSimNextTime = std::move(other.fSimNextTime);
+	  fSimSeed = std::move(other.fSimSeed);
+	  fSimSwapped = std::move(other.fSimSwapped);
+	  fFirstModule = std::move(other.fFirstModule);
+	  fScanBanks = std::move(other.fScanBanks);
+	  fQTPool = std::move(other.fQTPool);
+	  fQTPoolMinBanks = std::move(other.fQTPoolMinBanks);
+	  fQTSummary = std::move(other.fQTSummary);
+	  fCompactQT = std::move(other.fCompactQT);
+	  fZS = std::move(other.fZS);
+	  fReorder = std::move(other.fReorder);
   }
   return *this;
 }
@@ -123,7 +172,7 @@ EBFragment& EBFragment::operator=(EBFragment&& other) noexcept
 /**
  * \brief   Destructor for the module object
  *
- * Nothing to do.
+ * Stops the QT workers, if any (unique_ptr).
  */
 EBFragment::~EBFragment()
 {
@@ -214,20 +263,140 @@ int EBFragment::GetBMBufferLevel(int hBuf)
 	return level;
 }
 
-#define TS2_IDX             1    //!< Time Stamp V1720 copy to QT bank
-#define N_DWORD_IDX         2    //!< Number of 32-bit words from the QT bank
-#define QCH_IDX             0    //!< Channel/bases index        (triplet)
-#define BASE_IDX            1    //!< 1st, basebefore, baseafter (triplet)
-#define QINTEGRAL_IDX       2    //!< Integral                   (triplet)
-#define TS_IDX              3    //!< Time Stamp from the V1720/V1740/Veto bank
 static const int gTimeStampMask = 0x3fffffff;
 
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Choose the bank decoder for this fragment from its trigger mask
+ *
+ * Called at BOR, once the trigger mask is known.
+ *  - 0x1            DTM
+ *  - 0x2 ... 0x10   V1720 group, first module 0, 8, 16, 24
+ *  - 0x20           V1740
+ *  - 0x40           VETO
+ *  - 0x80           CALI
+ *  - otherwise      generic (all bank types)
+ *
+ * V1720 groups with a QT pool (StartQTPool()) only collect their QT banks
+ * during the bank loop; the summary is done by the pool.  Without QT
+ * summary (SetQTSummary()), only the timestamps are taken.
+ */
+void EBFragment::SelectDecoder()
+{
+	fFirstModule = -1;
+	switch (tmsk_) {
+	case 0x1:
+		fScanBanks = &EBFragment::ScanBanks<EBDecoderDTM>;
+		break;
+	case 0x2: case 0x4: case 0x8: case 0x10:
+		fFirstModule = 8 * (ffs(tmsk_) - 2);
+		if (!fQTSummary)
+			fScanBanks = &EBFragment::ScanBanks<EBDecoderV1720TS>;
+		else if (fQTPool)
+			fScanBanks = &EBFragment::ScanBanks<EBDecoderV1720Pool>;
+		else
+			fScanBanks = &EBFragment::ScanBanks<EBDecoderV1720>;
+		break;
+	case 0x20:
+		fScanBanks = &EBFragment::ScanBanks<EBDecoderV1740>;
+		break;
+	case 0x40:
+		fScanBanks = &EBFragment::ScanBanks<EBDecoderVETO>;
+		break;
+	case 0x80:
+		fScanBanks = &EBFragment::ScanBanks<EBDecoderCALI>;
+		break;
+	default:
+		fScanBanks = &EBFragment::ScanBanks<EBDecoderGeneric>;
+		break;
+	}
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Start the QT summary worker pool of a V1720 group fragment
+ *
+ * The QT banks of one event are shared between the fragment thread and
+ * nworkers helper threads.  Events with fewer than minbanks QT banks are
+ * summarized by the fragment thread alone.  Other fragment types and
+ * nworkers <= 0 leave the pool off.  Call SelectDecoder() afterwards.
+ *
+ * \param   [in]  nworkers  number of helper threads
+ * \param   [in]  minbanks  smallest number of QT banks worth sharing
+ * \return  true if the pool is running
+ */
+bool EBFragment::StartQTPool(int nworkers, int minbanks)
+{
+	StopQTPool();
+	if (nworkers <= 0 || !fQTSummary) return false;
+	if (tmsk_ < 0x2 || tmsk_ > 0x10 || (tmsk_ & (tmsk_ - 1))) return false;
+
+	fQTPool.reset(new EBQTPool);
+	if (!fQTPool->Start(nworkers, eqp_name_.c_str())) {
+		fQTPool.reset();
+		return false;
+	}
+	fQTPoolMinBanks = (minbanks > 0) ? minbanks : 0;
+	return true;
+}
+
+//---------------------------------------------------------------------------------
+void EBFragment::StopQTPool()
+{
+	fQTPool.reset();
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Set the zero suppression of the raw W2 banks of a V1720 group fragment
+ *
+ * Other fragment types, or no module threshold set, leave it off.
+ *
+ * \param   [in]  zs     thresholds and pre/post samples from the ODB
+ * \return  true if the W2 banks of this fragment are suppressed
+ */
+bool EBFragment::SetZeroSuppression(const EBZS_SETTINGS &zs)
+{
+	EBZS_SETTINGS off;
+	memset(&off, 0, sizeof(off));
+	bool group = (tmsk_ >= 0x2 && tmsk_ <= 0x10 && !(tmsk_ & (tmsk_ - 1)));
+	fZS.Configure(group ? zs : off);
+	return fZS.IsEnabled();
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Bank loop, one instance per decoder type
+ */
+template<class Decoder>
+void EBFragment::ScanBanks(EVENT_HEADER *pevent, EBSCAN_STATE &st)
+{
+	BANK32 *pbh = NULL;
+	DWORD *pdata_b = NULL;
+	INT bksize;
+
+	st.ndir = 0;
+	while ((bksize = bk_iterate32((BANK_HEADER *) (pevent + 1), &pbh, &pdata_b))) {
+		DWORD fourcc = EBBankFourCC(pbh);
+		Decoder::Bank(st, fourcc, pdata_b);
+
+		// Bank directory for the consumers of the ring buffer record
+		if (st.ndir < EB_MAX_DIR) {
+			st.dir[st.ndir].fourcc = fourcc;
+			st.dir[st.ndir].offset = (char *)pdata_b - (char *)pevent;
+			st.dir[st.ndir].size = bksize;
+		}
+		st.ndir++;
+	}
+}
+
 
 //---------------------------------------------------------------------------------
 /**
  * \brief   Read event fragment from this buffer, place it at wp in the rb
  *
- * Read one event from this Midas buffer and place it in the ringBuffer.
+ * Read one event from this Midas buffer and place it in the ringBuffer,
+ * in serial number order if the reorder window is on (ebReorder.hxx).
  * 
  * Also, loop over the actual banks and come up with a summed QvsT histogram.
  * Also, save the earliest and latest timestamps for this fragment.
@@ -240,198 +409,93 @@ extern INT max_event_size;
 bool EBFragment::ReadFragment(void *wp)
 {
 	char *pdata = (char *)wp;
-	int status, size;
-	int diff;
-	
-	size = max_event_size;
-	status = bm_receive_event(this->buffer_handle_, pdata, &size, BM_NO_WAIT);
-	switch (status) {
-	case BM_SUCCESS:      /* event received */
-		break;
-	case BM_ASYNC_RETURN: /* timeout */
-
-	 
-		// Do timeout handling
-
-		// Do a check of when we last received an event...
-		// Print error if it seems like we haven't gotten an event in a while...
-		diff = ss_time() -fLastTimeReadEvent;
-			if(fLastTimeReadEvent != 0 && diff > 40 && !fLastTimeReadEventWarn){
-			cm_msg(MERROR,"ReadFragment", "Haven't seen a new event from fragment %s (ID=%d) for more than 40 seconds.", this->GetEqpName().c_str(), this->GetFragmentID());
-			fLastTimeReadEventWarn = true;
-		}
 
-		if(fLastTimeReadEvent != 0 && diff > 50 && !fLastTimeReadEventError){
-			cm_msg(MERROR,"ReadFragment", "Haven't seen a new event from fragment %s (ID=%d) for more than 50 seconds.  Front-end probably died; event builder will freeze; run is probably dead.", this->GetEqpName().c_str(), this->GetFragmentID());
-			fLastTimeReadEventError = true;
+	if (fReorder.IsEnabled()) {
+		// Next event in serial number order: parked in the window, or read now
+		bool idle = false;
+		while (!fReorder.Pop(pdata, idle)) {
+			if (idle) return false;
+			if (ReceiveEvent(pdata) != BM_SUCCESS) idle = true;
+			else if (fReorder.Offer(pdata)) break;
 		}
-
-		// If we haven't read an event yet, then set the LastTimeReadEvent to current time.
-		// This allows us to catch cases where a front-end never produces fragments.
-		if(fLastTimeReadEvent == 0)  fLastTimeReadEvent = ss_time();
-
-
+	} else if (ReceiveEvent(pdata) != BM_SUCCESS) {
 		return false;
-		break;
-	default:              /* Error */
-		cm_msg(MERROR, "source_scan", "bm_receive_event error %d", status);
-		return false;
-		break;
 	}
 
-	// Remember the last time we got event...
-	fLastTimeReadEvent = ss_time();
-
 	/* Loop over all the banks
 	 * QT banks have a V1720 TS copy, for the ZL or ?W2? banks.
 	 * For the other fragment, retrieve the TS from the banks themselves (W4, VE)
 	 * Banks W4, VE are mutually exclusive!
+	 * The decoder for this fragment type has been chosen at BOR (SelectDecoder).
 	 */
-	// Reset the rb area containing the min/maxTS and the 250 bins of Q-histo
-	BANK32 *pbh = NULL;
-	DWORD *pdata_b = NULL;
-  // char *pdata;
-	INT bksize;
 	EVENT_HEADER *pevent;
 	
 	// Top of the fragment event
 	pevent = (EVENT_HEADER *)pdata;
 
-	// Min/Max TimeStamp extraction
-	DWORD tsmax = 0, tsmin = 0xFFFFFFFF;
-	// Also, store the timestamp for the first module of each group.
-	DWORD first_module_timestamp = 0;
-	int nbank = 0;
-
-	// Figure out if this event has V1720 data (specifically QT banks).
-	bool bV1720 = false;
+	// Raw W2 banks zero suppressed into ZL banks before anything looks at the event
+	if (fZS.IsEnabled()) fZS.SuppressEvent(pevent);
 
 	/// Use size from event header, instead of from bm_receive_event; seems more reliable.
 	int event_size = ((EVENT_HEADER *) pdata)->data_size + sizeof(EVENT_HEADER);
 
-	// pointer to qvst histogram
-	// (after the 2 DWORD for Tmin/Tmax and 1 DWORD for number time bins) and 1 for control word
-	DWORD *qt_list = (DWORD*)pdata + event_size/sizeof(DWORD);
-	DWORD *qhisto = (DWORD*)qt_list + 4;
-	//DWORD *qhisto = (DWORD*)wp + 4;
+	// Record trailer and qvst histogram right after the event (see ebRecord.hxx)
+	EBRECORD_TRAILER *trailer = (EBRECORD_TRAILER *)(pdata + event_size);
+	DWORD *qhisto = (DWORD *)(trailer + 1);
  
-	// Create vectors for saving QT summary histograms.
-	std::vector<int> qvect;
-	std::vector<int> nvect;
-
-	// Iterate through all the QT banks found in this fragment
-	if(1)
-		do {
-		bksize = bk_iterate32((BANK_HEADER *) (pevent + 1), &pbh, &pdata_b);
-		//std::cout << "Bank name " << bksize << std::endl;
-		if(bksize){
-      if (strncmp(pbh->name, "ZL", 2) == 0) { // Handle ZL banks
-        // Get the module number
-        std::string sname(pbh->name);
-        std::string smodule = sname.substr(2, 2);
-        int module = atoi(smodule.c_str());
-        // Save timestamp if this is first module in a group.
-        if((module == 0 && GetTmask() == 0x2) ||
-           (module == 8 && GetTmask() == 0x4) ||
-           (module == 16 && GetTmask() == 0x8) ||
-           (module == 24 && GetTmask() == 0x10)){
-          first_module_timestamp = pdata_b[TS_IDX];
-        }
-      }
-			if (strncmp(pbh->name, "QT", 2) == 0) { // Handle QT banks
-				// Get the module number
-				std::string sname(pbh->name);
-				std::string smodule = sname.substr(2, 2);
-				int module = atoi(smodule.c_str());
-				// Save timestamp if this is first module in a group.
-				if((module == 0 && GetTmask() == 0x2) || 
-					 (module == 8 && GetTmask() == 0x4) ||
-					 (module == 16 && GetTmask() == 0x8) ||
-					 (module == 24 && GetTmask() == 0x10)){
-					first_module_timestamp = pdata_b[TS2_IDX];
-				}
-
-				int ndwords = pdata_b[N_DWORD_IDX];
-				// Save timestamps.
-				if(pdata_b[TS2_IDX] > tsmax) tsmax = pdata_b[TS2_IDX];
-				if(pdata_b[TS2_IDX] < tsmin) tsmin = pdata_b[TS2_IDX];
-
-				// Loop over qt values.
-				for (int i = QINTEGRAL_IDX+1 ; i < QINTEGRAL_IDX+ndwords+1; i+=4) {
-
-					int min_bin = ((pdata_b[i+3] >> 16) & 0xFFFF);
-					int integral = (pdata_b[i+2] & 0xFFFFFF);
-
-					// Rebin the time base.
-					int bin = min_bin / fRebinFactor;
-
-					// Ensure the vectors are long enough
-					if (bin >= (int)qvect.size()) {
-            qvect.resize(bin+1, 0);
-            nvect.resize(bin+1, 0);
-					}
-
-					// Get the original value for this bin
-					unsigned long int charge = qvect[bin];
-					if(charge > 4000000000 - integral) {
-					  charge = 4000000000;
-					} else {
-					  charge += (unsigned long int)integral;
-					}
-					qvect[bin] = charge;
-					nvect[bin]++;
-				}
-				nbank++;
-				bV1720 = true;
-			}
-			if (strncmp(pbh->name, "W2", 2) == 0) { // Handle W2XX raw V1720 banks
-				// Get the module number
-				std::string sname(pbh->name);
-				std::string smodule = sname.substr(2, 2);
-				int module = atoi(smodule.c_str());
-				// Save timestamp if this is first module in a group.
-				if((module == 0 && GetTmask() == 0x2) || 
-					 (module == 8 && GetTmask() == 0x4) ||
-					 (module == 16 && GetTmask() == 0x8) ||
-					 (module == 24 && GetTmask() == 0x10)){
-					first_module_timestamp = pdata_b[TS_IDX];
-				}
-			}
-			if (strncmp(pbh->name, "W4", 2) == 0) {
-				if(pdata_b[TS_IDX] > tsmax) tsmax = pdata_b[TS_IDX];
-				if(pdata_b[TS_IDX] < tsmin) tsmin = pdata_b[TS_IDX];
-				nbank++;
-				std::string sname(pbh->name);
-				std::string smodule = sname.substr(2, 2);
-				int module = atoi(smodule.c_str());
-				if(module == 0)
-					 first_module_timestamp = pdata_b[TS_IDX];
-
-			}
-			if (strncmp(pbh->name, "VETO", 4) == 0) {
-				if(pdata_b[TS_IDX] > tsmax) tsmax = pdata_b[TS_IDX];
-				if(pdata_b[TS_IDX] < tsmin) tsmin = pdata_b[TS_IDX];
-				nbank++;
-			}
-			if (strncmp(pbh->name, "CALI", 4) == 0) {
-				if(pdata_b[TS_IDX] > tsmax) tsmax = pdata_b[TS_IDX];
-				if(pdata_b[TS_IDX] < tsmin) tsmin = pdata_b[TS_IDX];
-				nbank++;
-				bV1720 = true;
-			}
+	// QT summary histograms, reused from event to event
+	fQvect.clear();
+	fNvect.clear();
+
+	EBSCAN_STATE st;
+	st.tsmax = 0;              // Min/Max TimeStamp extraction
+	st.tsmin = 0xFFFFFFFF;
+	st.first_ts = 0;           // Also, store the timestamp for the first module of each group.
+	st.nbank = 0;
+	st.v1720 = false;          // Figure out if this event has V1720 data (specifically QT banks).
+	st.first_module = fFirstModule;
+	st.rebin = (fRebinFactor > 0) ? fRebinFactor : 1;
+	st.q = &fQvect;
+	st.n = &fNvect;
+	st.dir = fDir;
+	fQTBanks.clear();
+	st.qtbanks = &fQTBanks;
+
+	(this->*fScanBanks)(pevent, st);
+
+	// Pool mode: QT summary of the collected banks, shared if the event is large
+	if (!fQTBanks.empty()) {
+		if (fQTBanks.size() >= fQTPoolMinBanks) {
+			fQTPool->Accumulate(fQTBanks, st.rebin, fQvect, fNvect);
+		} else {
+			for (unsigned int i = 0; i < fQTBanks.size(); i++)
+				EBAccumulateQT(st, fQTBanks[i]);
 		}
-		} while (bksize);
+	}
+
+	DWORD tsmax = st.tsmax, tsmin = st.tsmin;
+	DWORD first_module_timestamp = st.first_ts;
+	bool bV1720 = st.v1720;
 	
-	// Convert the Q and N vectors into arrays for saving in the bank.
-	// Q and N are both the same size, and 1 DWORD is 4 bytes.
-	// We store the two arrays consecutively.
-	int noffset = qvect.size();
-	int nqtbins = qvect.size() * 2;
-  memset ((char *) qhisto, 0, 4*nqtbins);
-  for (unsigned int i = 0; i < qvect.size(); i++) {
-    qhisto[i] = qvect[i];
-    qhisto[i + noffset] = nvect[i];
-  }
+	// Convert the Q and N vectors into arrays for saving after the trailer.
+	// Compact: the bins with pulses only (see ebRecord.hxx).
+	// Otherwise Q and N are both the same size and stored consecutively.
+	// Left out if it could go past the ring buffer slot (directory room kept).
+	int noffset = fQvect.size();
+	int nqtbins = 0;
+	char *pend = pdata + max_event_size;
+	if ((char *)(qhisto + 2 * noffset) + EB_MAX_DIR * sizeof(EBBANK_DIR) > pend) {
+		EB_POST(EBMessage::kOther, MT_ERROR, "ReadFragment", "Fragment %s: event of %d bytes, no room for the QT summary (%d bins)"
+		                , this->GetEqpName().c_str(), event_size, noffset);
+		noffset = 0;
+	}
+	if (noffset && fCompactQT) {
+		nqtbins = EBQTEncodeSparse(&fQvect[0], &fNvect[0], noffset, qhisto);
+	} else if (noffset) {
+		nqtbins = noffset * 2;
+		memcpy(qhisto, &fQvect[0], noffset*sizeof(DWORD));
+		memcpy(qhisto + noffset, &fNvect[0], noffset*sizeof(DWORD));
+	}
 
 	// If we have a timestamp from the first module, then save it.
 	// Otherwise use the lowest timestamp.
@@ -447,32 +511,249 @@ bool EBFragment::ReadFragment(void *wp)
 	// the 16ns counter values, for 30 bits.
 	if (bV1720){ // V1720 seems to be 8ns counter; down-convert.
 
-		qt_list[0]     = (DWORD(best_timestamp >>1) & gTimeStampMask);
-		qt_list[1] = (DWORD(tsmax >>1) & gTimeStampMask);
+		trailer->ts_best = (DWORD(best_timestamp >>1) & gTimeStampMask);
+		trailer->ts_max  = (DWORD(tsmax >>1) & gTimeStampMask);
 	}else{//V1740 counters seem to be 32 ns counter.
-		qt_list[0]     = ((best_timestamp >> 1) & gTimeStampMask);
-		qt_list[1] = ((tsmax >> 1) & gTimeStampMask);
+		trailer->ts_best = ((best_timestamp >> 1) & gTimeStampMask);
+		trailer->ts_max  = ((tsmax >> 1) & gTimeStampMask);
 	}
 
-	// Store control word
-	qt_list[3] = 0xdeadbeef;
+	// QT summary only kept for V1720 fragments
+	trailer->nqtbins = bV1720 ? nqtbins : 0;
+	trailer->nbins = bV1720 ? noffset : 0;
+
+	// Bank directory after the QT summary, cut to what is left of the slot
+	EBBANK_DIR *dir = (EBBANK_DIR *)(qhisto + trailer->nqtbins);
+	DWORD maxdir = ((char *)dir < pend) ? (pend - (char *)dir) / sizeof(EBBANK_DIR) : 0;
+	trailer->ndir = std::min(st.ndir, std::min(maxdir, (DWORD)EB_MAX_DIR));
+	memcpy(dir, fDir, trailer->ndir * sizeof(EBBANK_DIR));
+	trailer->flags = (st.ndir <= trailer->ndir) ? EB_TRAILER_DIR_COMPLETE : 0;
+	if (st.nbank > 0) trailer->flags |= EB_TRAILER_TS_VALID;
+	if (fCompactQT) trailer->flags |= EB_TRAILER_QT_SPARSE;
+	trailer->size = sizeof(EBRECORD_TRAILER) + trailer->nqtbins*sizeof(DWORD)
+	                + trailer->ndir*sizeof(EBBANK_DIR);
 
+	// Store control word
+	trailer->control = EB_CONTROL_WORD;
 			
 	// Increment wp pointer to next available location
-	if (bV1720){		
-		qt_list[2] = nqtbins;
-		event_size += (4+nqtbins)*sizeof(DWORD);
-		rb_increment_wp(this->GetRingBufferHandle(), event_size);
-	}	else {		
-		qt_list[2] = 0;
-		event_size += 4*sizeof(DWORD);
-		rb_increment_wp(this->GetRingBufferHandle(), event_size);
-	}
+	rb_increment_wp(this->GetRingBufferHandle(), event_size + trailer->size);
 	
 	//this->IncrementNumEventsInRB(); //atomic
 	return true;
 }
 
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Next event from the Midas buffer, in the order it comes
+ *
+ * Also the read timeout warnings (front-end died).  SIMULATION build: the
+ * event is generated.
+ *
+ * \param   [out] pdata  destination (ring buffer wp)
+ * \return  BM_SUCCESS if an event was received
+ */
+int EBFragment::ReceiveEvent(char *pdata)
+{
+	int status, size;
+	int diff;
+	
+	// Room left in the ring buffer slot for the record trailer
+	size = max_event_size - EB_RECORD_RESERVE;
+#if SIMULATION
+	status = SimulateFragment(pdata, &size);
+#else
+	status = bm_receive_event(this->buffer_handle_, pdata, &size, BM_NO_WAIT);
+#endif
+	switch (status) {
+	case BM_SUCCESS:      /* event received */
+		break;
+	case BM_ASYNC_RETURN: /* timeout */
+
+	 
+		// Do timeout handling
+
+		// Do a check of when we last received an event...
+		// Print error if it seems like we haven't gotten an event in a while...
+		diff = ss_time() -fLastTimeReadEvent;
+			if(fLastTimeReadEvent != 0 && diff > 40 && !fLastTimeReadEventWarn){
+			EB_POST(EBMessage::kReadTimeout, MT_ERROR, "ReadFragment", "Haven't seen a new event from fragment %s (ID=%d) for more than 40 seconds.", this->GetEqpName().c_str(), this->GetFragmentID());
+			fLastTimeReadEventWarn = true;
+		}
+
+		if(fLastTimeReadEvent != 0 && diff > 50 && !fLastTimeReadEventError){
+			EB_POST(EBMessage::kReadTimeout, MT_ERROR, "ReadFragment", "Haven't seen a new event from fragment %s (ID=%d) for more than 50 seconds.  Front-end probably died; events wait for it unless it is quarantined (Settings/Quarantine timeout).", this->GetEqpName().c_str(), this->GetFragmentID());
+			fLastTimeReadEventError = true;
+		}
+
+		// If we haven't read an event yet, then set the LastTimeReadEvent to current time.
+		// This allows us to catch cases where a front-end never produces fragments.
+		if(fLastTimeReadEvent == 0)  fLastTimeReadEvent = ss_time();
+
+
+		return status;
+		break;
+	default:              /* Error */
+		EB_POST(EBMessage::kReceiveError, MT_ERROR, "source_scan", "bm_receive_event error %d", status);
+		return status;
+		break;
+	}
+
+	// Remember the last time we got event...
+	fLastTimeReadEvent = ss_time();
+	EBTrace::Record(fragmentID_, EBTrace::kReceive, ((EVENT_HEADER *)pdata)->serial_number);
+	return BM_SUCCESS;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Set the event generator parameters
+ *
+ * Called at BOR.  Restart the serial number at 0 so that all the simulated
+ * fragments stay in step for the SN assembly.
+ *
+ * \param   [in]  sim    generator settings from the ODB
+ */
+void EBFragment::SetSimulation(const EBSIMULATION_SETTINGS &sim)
+{
+	fSim = sim;
+	fSimSerial = 0;
+	fSimSwapped = 0;
+	fSimNextTime = 0;
+	fSimSeed = (unsigned int) time(NULL) ^ (tmsk_ << 16);
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Generate a synthetic fragment event in place of bm_receive_event()
+ *
+ * Only used in the SIMULATION build.  The bank layout follows what the real
+ * front-ends produce, as far as ReadFragment() and the assembly care:
+ *  - DTM       (Tmask 0x1)      : DTRG bank, timestamp in [0], trigger used in [2] bits 16-23
+ *  - V1720     (Tmask 0x2-0x10) : ZLxx and QTxx bank per module, module = 8*group + n
+ *  - V1740     (Tmask 0x20)     : W4xx bank per module
+ *  - VETO      (Tmask 0x40)     : VETO bank
+ *  - otherwise                  : CALI bank
+ * Timestamps (8ns counter) are derived from the serial number so that all
+ * fragments of the same event agree.
+ *
+ * \param   [in]  pdata  destination (ring buffer wp)
+ * \param   [out] size   event size in bytes
+ * \return  BM_SUCCESS if an event was generated, BM_ASYNC_RETURN if none is due yet
+ */
+int EBFragment::SimulateFragment(char *pdata, int *size)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	double now = tv.tv_sec + 1e-6 * tv.tv_usec;
+
+	// Pace the generator; after a long throttle don't try to catch up more than 1s
+	double rate = (fSim.rate > 0) ? fSim.rate : 1000.;
+	if (fSim.rate > 0) {
+		if (fSimNextTime == 0 || now - fSimNextTime > 1.0) fSimNextTime = now;
+		if (now < fSimNextTime) return BM_ASYNC_RETURN;
+		fSimNextTime += 1.0 / fSim.rate;
+	}
+
+	// Serial number: in order, or the next two swapped, or one lost (reorder window tests)
+	DWORD serial;
+	if (fSimSwapped) {
+		serial = fSimSwapped;
+		fSimSwapped = 0;
+	} else {
+		if (fSim.lost > 0 && rand_r(&fSimSeed) < fSim.lost * RAND_MAX) fSimSerial++;
+		if (fSimSerial > 0 && fSim.swapped > 0 && rand_r(&fSimSeed) < fSim.swapped * RAND_MAX) {
+			serial = fSimSerial + 1;
+			fSimSwapped = fSimSerial;
+			fSimSerial += 2;
+		} else {
+			serial = fSimSerial++;
+		}
+	}
+
+	EVENT_HEADER *pevent = (EVENT_HEADER *)pdata;
+	char *pbh = (char *)(pevent + 1);
+	DWORD *pbk;
+	char bkname[5];
+	DWORD ts = (DWORD)((uint64_t)((double)serial * 125.e6 / rate) & EB_TS_MASK);
+	// Keep away from the end of the ring buffer slot (bank headers + QT trailer)
+	char *plimit = pdata + max_event_size - 64*1024;
+
+	bk_init32(pbh);
+
+	if (tmsk_ == 0x1) {
+		// Pick one of the allowed DTM trigger bits
+		int nbits = 0, bits[8];
+		for (int i = 0; i < 8; i++)
+			if (fSim.dtmtrigger & (1 << i)) bits[nbits++] = i;
+		int trigger = nbits ? (1 << bits[rand_r(&fSimSeed) % nbits]) : 0x4;
+
+		bk_create(pbh, "DTRG", TID_DWORD, (void **)&pbk);
+		*pbk++ = ts;
+		*pbk++ = serial;
+		*pbk++ = (trigger & 0xFF) << 16;
+		*pbk++ = 0;
+		bk_close(pbh, pbk);
+
+	} else if (tmsk_ >= 0x2 && tmsk_ <= 0x10) {
+		int first = 8 * (ffs(tmsk_) - 2);
+		for (int m = 0; m < fSim.nmodules; m++) {
+			int module = first + m;
+
+			snprintf(bkname, sizeof(bkname), "ZL%02u", (unsigned)module % 100);
+			bk_create(pbh, bkname, TID_DWORD, (void **)&pbk);
+			int nzl = fSim.zlwords ? rand_r(&fSimSeed) % (2 * fSim.zlwords) : 0;
+			if ((char *)(pbk + 4 + nzl) > plimit) nzl = 0;
+			*pbk++ = 0xA0000000 | (4 + nzl);
+			*pbk++ = 0xFF | (module << 27);
+			*pbk++ = serial & 0xFFFFFF;
+			*pbk++ = ts;
+			for (int i = 0; i < nzl; i++) *pbk++ = rand_r(&fSimSeed) & 0x0FFF0FFF;
+			bk_close(pbh, pbk);
+
+			snprintf(bkname, sizeof(bkname), "QT%02u", (unsigned)module % 100);
+			bk_create(pbh, bkname, TID_DWORD, (void **)&pbk);
+			int npulse = fSim.npulses ? rand_r(&fSimSeed) % (2 * fSim.npulses + 1) : 0;
+			if ((char *)(pbk + 3 + 4*npulse) > plimit) npulse = 0;
+			*pbk++ = module;
+			*pbk++ = ts;
+			*pbk++ = 4 * npulse;
+			for (int i = 0; i < npulse; i++) {
+				// 70% prompt light around bin 2500, the rest spread over the 16us window
+				int tbin = (rand_r(&fSimSeed) % 10 < 7) ? 2400 + rand_r(&fSimSeed) % 200
+				                                        : rand_r(&fSimSeed) % 4000;
+				*pbk++ = rand_r(&fSimSeed) % 8;
+				*pbk++ = 3800 + rand_r(&fSimSeed) % 16;
+				*pbk++ = 100 + rand_r(&fSimSeed) % 2000;
+				*pbk++ = (tbin & 0xFFFF) << 16;
+			}
+			bk_close(pbh, pbk);
+		}
+
+	} else {
+		int nmod = (tmsk_ == 0x20) ? fSim.nmodules : 1;
+		for (int m = 0; m < nmod; m++) {
+			if (tmsk_ == 0x20)      snprintf(bkname, sizeof(bkname), "W4%02u", (unsigned)m % 100);
+			else if (tmsk_ == 0x40) sprintf(bkname, "VETO");
+			else                    sprintf(bkname, "CALI");
+			bk_create(pbh, bkname, TID_DWORD, (void **)&pbk);
+			int nw = fSim.zlwords ? rand_r(&fSimSeed) % (2 * fSim.zlwords) : 0;
+			if ((char *)(pbk + 4 + nw) > plimit) nw = 0;
+			*pbk++ = 0xA0000000 | (4 + nw);
+			*pbk++ = m;
+			*pbk++ = serial & 0xFFFFFF;
+			*pbk++ = ts;
+			for (int i = 0; i < nw; i++) *pbk++ = rand_r(&fSimSeed) & 0x0FFF0FFF;
+			bk_close(pbh, pbk);
+		}
+	}
+
+	bm_compose_event(pevent, evid_, tmsk_, bk_size(pbh), serial);
+	*size = pevent->data_size + sizeof(EVENT_HEADER);
+
+	return BM_SUCCESS;
+}
+
 //---------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------
 /**
@@ -515,7 +796,8 @@ DWORD EBFragment::GetSNFragment(void)
 	// the src is in the rb and contains a full Midas event
 	int status = rb_get_rp(this->GetRingBufferHandle(), (void**)&src, 5000);
 	if (status == DB_TIMEOUT) {
-		cm_msg(MERROR,"GetSNFragment", "Got rp timeout for fragmentID %s (%d)", this->GetEqpName().c_str(), this->GetFragmentID());
+		EB_POST(EBMessage::kRpTimeout, MT_ERROR, "GetSNFragment", "Got rp timeout for fragmentID %s (%d)", this->GetEqpName().c_str(), this->GetFragmentID());
+		EBMessage::Flush();
 		exit(0);
 		return false;
 	}
@@ -538,33 +820,29 @@ DWORD EBFragment::GetSNFragment(void)
  */
 bool EBFragment::CheckControlWord(char *rbp){
 
-	DWORD tevsize = ((EVENT_HEADER *)rbp)->data_size + sizeof(EVENT_HEADER);// + 4;
-	DWORD *qt_list = (DWORD*)rbp + tevsize/sizeof(DWORD);
-	unsigned int control = qt_list[3]; // control word, should be deadbeef
-	if(control != 0xdeadbeef){
-		std::cout << "Fail! " << std::endl;
+	EBRECORD_TRAILER *trailer = EBRecordTrailer(rbp);
+	unsigned int control = trailer->control; // control word, should be deadbeef
+	if(control != EB_CONTROL_WORD){
 		unsigned int initial = control;
 		bool success = false;
 		int i;
 		for(i = 0; i < 1000000; i++){
 			usleep(1);
-			control = qt_list[3];
-			if(control == 0xdeadbeef){
+			control = ((volatile EBRECORD_TRAILER *)trailer)->control;
+			if(control == EB_CONTROL_WORD){
 				success = true;
 				break;
 			}
 		}
 		
+		EBTrace::Record(EBTrace::kAssembly, EBTrace::kControlRetry, i+1);
 		if(success){
-			if(i >= 0){
-				std::cout << "\nControl word not correct; delay. " << initial << std::endl;
-				std::cout << "Got the right control word after " << (i+1) << " us." << std::endl;
-				std::cout << "Number events in ring buffer: " << this->GetNumEventsInRB() << std::endl;
-				return true;
-			}
+			EB_POST(EBMessage::kControlWord, EBMSG_STDOUT, "CheckControlWord", "Control word not correct (0x%x); got the right control word after %d us. Number events in ring buffer: %d"
+			                , initial, i+1, this->GetNumEventsInRB());
 			return true;
 		}else{
-			cm_msg(MERROR,"EBFragment::CheckControlWord", "Control word not correct after 10 seconds"); 
+			EB_POST(EBMessage::kControlWord, MT_ERROR, "EBFragment::CheckControlWord", "Control word not correct after 10 seconds"); 
+			EBTrace::Dump("control word");
 			return false;
 		}
 	}
@@ -574,47 +852,163 @@ bool EBFragment::CheckControlWord(char *rbp){
 
 //---------------------------------------------------------------------------------
 /**
- * \brief   Compose the final event with all the fragments from the Rbs
+ * \brief   Banks of the next fragment record, left in place in the ring buffer
  *
- * \param   [in/out]  Final event pointer
+ * The record stays valid until ReleaseRecord().
  *
- * \return  true if ok 
+ * \param   [out]  pbanks  first bank (after the fragment BANK_HEADER)
+ * \param   [out]  size    size of all the banks in bytes, 0 if they can't be used
+ * \return  false on rp timeout (nothing to release)
  */
-bool EBFragment::AddBanksToEvent(char * pevent)
+bool EBFragment::PeekBanks(char **pbanks, DWORD *size)
 {
-  
-  
-  /*
-   * pevent: points after the EVENT_HEADER (header alread composed in mfe
-   * and initialized by the caller (bk_init32(pevent))
-   *
-   * src   : points at the EVENT_HEADER (full event)
-   *         event size = pevent->data_size + sizeof(EVENT_HEADER)
-   */
   char *src;
   // the src is in the rb and contains a full Midas event
   int status = rb_get_rp(this->GetRingBufferHandle(), (void**)&src, 1000);
   if (status == DB_TIMEOUT) {
-    cm_msg(MERROR,"AddBanksToEvent", "Got rp timeout for fragmentID %s %d", this->GetName().c_str(),this->GetFragmentID());
-    printf("### num events: %d\n", this->GetNumEventsInRB());
+    EB_POST(EBMessage::kRpTimeout, MT_ERROR, "AddBanksToEvent", "Got rp timeout for fragmentID %s %d (num events: %d)", this->GetName().c_str(),this->GetFragmentID(), this->GetNumEventsInRB());
     return false;
   }
   
-  // Check that control word looks ok; currently just error message if bad.
-  bool controlCheck = CheckControlWord(src);
-  
-  
+  BANK_HEADER *pbh = (BANK_HEADER *)((EVENT_HEADER *)src + 1);
+  *pbanks = (char *)(pbh + 1);
+
+  // Record not to be trusted (as in PeekRecord()): released without its banks
+  if (!CheckControlWord(src)) {
+    EB_POST(EBMessage::kControlWord, MT_ERROR, "AddBanksToEvent", "Fragment %s: bad control word, banks of S/N %u dropped"
+                    , this->GetEqpName().c_str(), ((EVENT_HEADER *)src)->serial_number);
+    *size = 0;
+    return true;
+  }
+  *size = pbh->data_size;
+
+  // Banks are appended as they are: the fragment has to be in the output format
+  if (pbh->flags != (BANK_FORMAT_VERSION | BANK_FORMAT_32BIT)) {
+    EB_POST(EBMessage::kOther, MT_ERROR, "AddBanksToEvent", "Fragment %s: bank format 0x%x is not bank32, banks dropped"
+                    , this->GetEqpName().c_str(), pbh->flags);
+    *size = 0;
+  }
+
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Next record of the ring buffer, left in place
+ *
+ * For the L2 filter: trailer and QT summary through the ebRecord.hxx
+ * helpers.  The record stays valid until ReleaseRecord().
+ *
+ * \param   [out]  prec   record (EVENT_HEADER), NULL if its control word is bad
+ * \return  false on rp timeout (nothing to release)
+ */
+bool EBFragment::PeekRecord(char **prec)
+{
+  int status = rb_get_rp(this->GetRingBufferHandle(), (void**)prec, 1000);
+  if (status == DB_TIMEOUT) {
+    EB_POST(EBMessage::kRpTimeout, MT_ERROR, "PeekRecord", "Got rp timeout for fragmentID %s %d (num events: %d)", this->GetName().c_str(),this->GetFragmentID(), this->GetNumEventsInRB());
+    return false;
+  }
+  if (!CheckControlWord(*prec)) *prec = NULL;
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Done with the record of PeekBanks(): move the rp to the next one
+ */
+void EBFragment::ReleaseRecord()
+{
+  char *src;
+  rb_get_rp(this->GetRingBufferHandle(), (void**)&src, 0);
+
   // Move Read pointer to next fragment
-  DWORD tevsize = ((EVENT_HEADER *)src)->data_size + sizeof(EVENT_HEADER);// + 4;
-  DWORD *qt_list = (DWORD*)src + tevsize/sizeof(DWORD);
-  int nQTBins = qt_list[2];
-  tevsize += (4+nQTBins)*sizeof(DWORD);
-  
-  rb_increment_rp(this->GetRingBufferHandle(), tevsize );
+  rb_increment_rp(this->GetRingBufferHandle(), EBRecordSize(src));
   
   // Inform main thread of new fragment
   this->DecrementNumEventsInRB(); //atomic
-  
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Compose the final event with all the fragments from the Rbs
+ *
+ * The fragment banks are copied once, from the ring buffer to the output
+ * event, behind the banks already there.  With a bank selection for this
+ * fragment (ebBankFilter.hxx), only the runs of banks kept are copied.
+ *
+ * \param   [in/out]  Final event pointer
+ * \param   [in]      filter  bank selection, NULL for all the banks
+ * \param   [in]      cls     trigger class of the event, EBBankFilter::Class()
+ *
+ * \return  true if ok 
+ */
+bool EBFragment::AddBanksToEvent(char * pevent, EBBankFilter *filter, int cls)
+{
+  /*
+   * pevent: points after the EVENT_HEADER (header alread composed in mfe
+   * and initialized by the caller (bk_init32(pevent))
+   */
+  char *pbanks;
+  DWORD size;
+  if (!PeekBanks(&pbanks, &size)) return false;
+
+  int nruns = 1;
+  const char *const *ptr = &pbanks;
+  const size_t *len = NULL;
+  if (size && filter && filter->Applies(this->GetFragmentID(), cls)) {
+    char *prec = pbanks - sizeof(BANK_HEADER) - sizeof(EVENT_HEADER);
+    nruns = filter->Select(prec, this->GetFragmentID(), cls);
+    ptr = filter->GetPtr();
+    len = filter->GetLen();
+    size = 0;
+    for (int i = 0; i < nruns; i++) size += len[i];
+  }
+
+  BANK_HEADER *pbh = (BANK_HEADER *)pevent;
+  if (sizeof(EVENT_HEADER) + bk_size(pevent) + size > (DWORD)max_event_size) {
+    EB_POST(EBMessage::kOther, MT_ERROR, "AddBanksToEvent", "Event too large, fragment %s dropped (%d bytes)"
+                    , this->GetEqpName().c_str(), size);
+    nruns = 0;
+  }
+  char *dst = (char *)(pbh + 1) + pbh->data_size;
+  for (int i = 0; i < nruns; i++) {
+    DWORD n = len ? len[i] : size;
+    memcpy(dst, ptr[i], n);
+    dst += n;
+  }
+  pbh->data_size = dst - (char *)(pbh + 1);
+
+  ReleaseRecord();
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Banks of the next record kept by the bank selection, in place
+ *
+ * For the scatter-gather output: the runs of banks kept are appended to
+ * ptr/len, none if the fragment has nothing left.  The record stays in the
+ * ring buffer until ReleaseRecord().
+ *
+ * \return  false on rp timeout (nothing to release)
+ */
+bool EBFragment::PeekBanks(EBBankFilter &filter, int cls, std::vector<const char *> &ptr, std::vector<size_t> &len)
+{
+  char *pbanks;
+  DWORD size;
+  if (!PeekBanks(&pbanks, &size)) return false;
+  if (!size) return true;
+
+  if (!filter.Applies(this->GetFragmentID(), cls)) {
+    ptr.push_back(pbanks);
+    len.push_back(size);
+    return true;
+  }
+  char *prec = pbanks - sizeof(BANK_HEADER) - sizeof(EVENT_HEADER);
+  int nruns = filter.Select(prec, this->GetFragmentID(), cls);
+  ptr.insert(ptr.end(), filter.GetPtr(), filter.GetPtr() + nruns);
+  len.insert(len.end(), filter.GetLen(), filter.GetLen() + nruns);
   return true;
 }
 
@@ -734,50 +1128,27 @@ std::pair<unsigned int,unsigned int> EBFragment::GetDTMTriggerMaskUsed(){
 	// the src is in the rb and contains a full Midas event
 	int status = rb_get_rp(this->GetRingBufferHandle(), (void**)&src, 1000);
 	if (status == DB_TIMEOUT) {
-		cm_msg(MERROR,"GetDTMTriggerMaskUsed", "Got rp timeout for fragmentID %s %d",this->GetName().c_str(), this->GetFragmentID());
+		EB_POST(EBMessage::kRpTimeout, MT_ERROR, "GetDTMTriggerMaskUsed", "Got rp timeout for fragmentID %s %d",this->GetName().c_str(), this->GetFragmentID());
 		return std::pair<unsigned int,unsigned int>(-1,-1);
 	}
 	
-	EVENT_HEADER *pevent;
-	pevent = (EVENT_HEADER *)src;
-	
-	DWORD tevsize = ((EVENT_HEADER *)src)->data_size + sizeof(EVENT_HEADER);// + 4;
-
-	DWORD *qt_list = (DWORD*)src + tevsize/sizeof(DWORD);
-
-
-
-	unsigned int control = qt_list[3]; // control word, should be deadbeef
-	if(control != 0xdeadbeef){
-		std::cout << "GetDTMTriggerMaskUsed control fail! " << std::endl;
-		for(int i = -4; i < 10; i++){
-			std::cout << std::hex << qt_list[i] << std::dec << std::endl;
-		}
-
+	EBRECORD_TRAILER *trailer = EBRecordTrailer(src);
+	unsigned int control = trailer->control; // control word, should be deadbeef
+	if(control != EB_CONTROL_WORD){
+		EB_POST(EBMessage::kControlWord, EBMSG_STDOUT, "GetDTMTriggerMaskUsed", "GetDTMTriggerMaskUsed control fail! trailer %x %x %x %x"
+		                , trailer->ts_best, trailer->ts_max, trailer->nqtbins, trailer->control);
+		return std::pair<unsigned int,unsigned int>(-1,-1);
 	}
 
-	int bksize;
-	BANK32 *pbh = NULL;
+	// DTRG bank straight from the record bank directory
 	DWORD *pdata = NULL;
-	
-	// Loop over event, looking for DTRG bank...		
-	do {
-		//bksize = bk_iterate32(pevent, &pbh, &pdata);
-		bksize = bk_iterate32((BANK_HEADER *) (pevent + 1), &pbh, &pdata);
-		//std::cout << "Bank name " << bksize << std::endl;
-		if(bksize){
-			//				std::cout << "Bank name " << pbh->name << std::endl;
-			if (strncmp(pbh->name, "DTRG", 4) == 0) {
-				
-				//int TriggerUsed = ((pdata[2] & 0x0000FF00) >> 8);
-				int TriggerUsed = ((pdata[2] & 0x00FF0000) >> 16);
-				int Timestamp = (pdata[0]);
-				return std::pair<unsigned int,unsigned int>(TriggerUsed,Timestamp);
-			}				
-		}
-	} while (bksize);		
+	if (EBRecordFindBank(src, EB_FOURCC('D','T','R','G'), &pdata)) {
+		//int TriggerUsed = ((pdata[2] & 0x0000FF00) >> 8);
+		int TriggerUsed = ((pdata[2] & 0x00FF0000) >> 16);
+		int Timestamp = (pdata[0]);
+		return std::pair<unsigned int,unsigned int>(TriggerUsed,Timestamp);
+	}
 
-	
 	return std::pair<unsigned int,unsigned int>(-1,-1);
 }
 
@@ -19,10 +19,20 @@ This file contains the class definition for the event builder class
 #include <sys/time.h>
 #include <atomic>
 #include <algorithm> //for std::sort()
+#include <vector>
+#include <memory>
 
 #include "midas.h"
 #include "msystem.h"
 
+#include "ebRecord.hxx"
+#include "ebZeroSuppress.hxx"
+#include "ebReorder.hxx"
+
+struct EBSCAN_STATE;
+class EBQTPool;
+class EBBankFilter;
+
 
 
 /**
@@ -52,6 +62,16 @@ public:
     BOOL      enable;                  //!< Enable fragment
   } config;   //!< instance of config structure
 
+  struct EBSIMULATION_SETTINGS {
+    float     rate;                    //!< Generated event rate (Hz), <= 0 as fast as possible
+    INT       nmodules;                //!< Number of V1720 modules per group fragment
+    INT       npulses;                 //!< Mean number of QT pulses per V1720 module
+    INT       zlwords;                 //!< Mean ZL/W4 payload size per module (DWORD)
+    INT       dtmtrigger;              //!< DTM trigger bits to pick from (DTRG trigger word)
+    float     swapped;                 //!< Fraction of events sent after the next one
+    float     lost;                    //!< Fraction of events never sent
+  };
+
   /* Static */
   static const char *config_str_fragment[]; //!< Configuration string for this buffer
   static const char history_settings[][NAME_LENGTH];
@@ -84,19 +104,33 @@ public:
   bool IsRunning();                  //!<
   int GetBMBufferLevel(int);         //!< bm buffer level in bytes
   bool ReadFragment(void *);         //!< Read event from buffer
+  int SimulateFragment(char *, int *);   //!< Generate a synthetic event (SIMULATION build)
   DWORD GetSNFragment(void);         //!< Get current fragment event serial number
   int BankListOfFragment(void *);                      //!< Print Bank listing
   bool FetchHeaderNextEvent(uint32_t * header);  //!<
   bool DeleteNextEvent();                        //!<
   bool FillStatBank(char *, suseconds_t);        //!<
   bool FillBufferLevelBank(char *);              //!<
-  bool AddBanksToEvent(char * pevent);   //!<
+  bool AddBanksToEvent(char * pevent, EBBankFilter *filter = NULL, int cls = -1);   //!< Copy the next fragment banks into the event
+  bool PeekBanks(char **pbanks, DWORD *size);   //!< Banks of the next record, in place
+  bool PeekBanks(EBBankFilter &filter, int cls, std::vector<const char *> &ptr, std::vector<size_t> &len);   //!< Banks kept, in place
+  bool PeekRecord(char **prec);                 //!< Next record (event + trailer), in place
+  void ReleaseRecord();                         //!< Done with the PeekBanks() record
   bool FillEventBank(char * pevent);             //!<
   bool GetV1720Fragment(void **, DWORD * dtmtsl, DWORD * dtmtsh, DWORD ** qhisto);
   bool Poll(DWORD*);                                            //!<
   int SetFragmentRecord(HNDLE h);                               //!<
   int SetHistoryRecord(HNDLE h, void(*cb_func)(INT,INT,void*)); //!<
   int InitializeForAcq();                                       //!<
+  void SelectDecoder();                                         //!< Choose bank decoder from trigger mask (BOR)
+  void SetQTSummary(bool on) { fQTSummary = on; }              //!< QT summary in the ring records (BOR, before StartQTPool)
+  void SetCompactQT(bool on) { fCompactQT = on; }               //!< Sparse QT summary encoding (BOR)
+  bool StartQTPool(int nworkers, int minbanks);                 //!< QT summary worker pool (BOR, before SelectDecoder)
+  void StopQTPool();                                            //!< Stop the QT workers (EOR, after the thread join)
+  bool SetZeroSuppression(const EBZS_SETTINGS &zs);             //!< W2 bank zero suppression (BOR), V1720 groups only
+  const EBZeroSuppressor &GetZeroSuppressor() const { return fZS; }
+  void SetReorderWindow(int nslots, int timeout_ms) { fReorder.Configure(nslots, timeout_ms, fragmentID_); }  //!< BOR, after SetFragmentID
+  const EBReorderWindow &GetReorderWindow() const { return fReorder; }
 
   /* Getters/Setters */
   int GetEvID() { return (int) evid_; }                    //!< returns buffer EVID
@@ -112,7 +146,10 @@ public:
   void SetEnable(bool frage) { enable_ = frage; }          //!< Set fragment enable flag
 
   int GetFragmentID() { return (int) fragmentID_; }                    //!< returns thread fragmentID
-  void SetFragmentID(int fragmentID) { fragmentID_ = fragmentID; }     //!< set fragmentID
+  void SetFragmentID(int fragmentID) {                                 //!< set fragmentID (< 64)
+    fragmentID_ = fragmentID;
+    ready_bit_ = (fragmentID >= 0 && fragmentID < 64) ? (1ULL << fragmentID) : 0;
+  }
 
   std::string GetName();
 
@@ -152,15 +189,32 @@ public:
   int GetRebinFactor() { return fRebinFactor; }
   void SetRebinFactor(int rebinFactor) { fRebinFactor = rebinFactor; }
 
+  void SetSimulation(const EBSIMULATION_SETTINGS &sim);   //!< Set the generator parameters, reset serial number
+
 	/// This method only applies to the DTM fragment.  It will scan the DTM trigger mask used
 	/// from next event in ring buffer.  Also returns the timestamp.
 	/// Format is std::pair< trigger_mask, timestamp >
 	///  Return -1 indicates failure
 	std::pair<unsigned int,unsigned int> GetDTMTriggerMaskUsed();
 
-  /* These are atomic with sequential memory ordering. See below */
-  void IncrementNumEventsInRB() { num_events_in_rb_++; }      //!< Increment Number of events in ring buffer
-  void DecrementNumEventsInRB() { num_events_in_rb_--; }      //!< Decrement Number of events in ring buffer
+  /* These are atomic with sequential memory ordering. See below.
+   * They also keep this fragment's bit in the readiness mask set whenever the
+   * ring buffer holds at least one event: the producer sets the bit after the
+   * increment; the consumer clears it when the count drops to 0, then sets it
+   * back if the producer incremented in the meantime. */
+  void IncrementNumEventsInRB() {                             //!< Increment Number of events in ring buffer
+    num_events_in_rb_++;
+    if (!(fReadyMask.load() & ready_bit_)) fReadyMask.fetch_or(ready_bit_);
+  }
+  void DecrementNumEventsInRB() {                             //!< Decrement Number of events in ring buffer
+    if (--num_events_in_rb_ == 0) {
+      fReadyMask.fetch_and(~ready_bit_);
+      if (num_events_in_rb_.load() > 0) fReadyMask.fetch_or(ready_bit_);
+    }
+  }
+
+  static uint64_t GetReadyMask() { return fReadyMask.load(); }  //!< Bit n set: fragment ID n has an event ready
+  static void ResetReadyMask() { fReadyMask = 0; }
 
 	void PrintSome(){
 	
@@ -241,6 +295,28 @@ private:
 	
 	int fRebinFactor; //!< Number of 4ns bins to combine into for the summary QT histogram
 
+	EBSIMULATION_SETTINGS fSim;  //!< Event generator parameters (SIMULATION build only)
+	DWORD fSimSerial;            //!< Serial number of the next generated event
+	double fSimNextTime;         //!< Time (s) at which the next event is due
+	unsigned int fSimSeed;       //!< rand_r() state, one per fragment thread
+	DWORD fSimSwapped;           //!< Serial number held back by the generator, 0 if none
+
+	/// Bank loop of ReadFragment(), instantiated for each decoder of ebDecoder.hxx
+	typedef void (EBFragment::*ScanBanksFn)(EVENT_HEADER *, EBSCAN_STATE &);
+	template<class Decoder> void ScanBanks(EVENT_HEADER *pevent, EBSCAN_STATE &st);
+	ScanBanksFn fScanBanks;      //!< Decoder for this fragment type, chosen at BOR
+	int fFirstModule;            //!< First module number of this V1720 group, -1 otherwise
+	std::vector<DWORD> fQvect;   //!< QT summary charge, reused between events (fragment thread only)
+	std::vector<DWORD> fNvect;   //!< QT summary number of pulses
+	EBBANK_DIR fDir[EB_MAX_DIR]; //!< Bank directory of the event being read
+	std::unique_ptr<EBQTPool> fQTPool; //!< QT summary helper threads, V1720 groups only
+	unsigned int fQTPoolMinBanks;      //!< Fewer QT banks than this: no hand-off to the pool
+	bool fQTSummary;                   //!< QT summary computed by this thread (someone uses it)
+	bool fCompactQT;                   //!< QT summary stored sparse (EB_TRAILER_QT_SPARSE)
+	std::vector<const DWORD *> fQTBanks; //!< QT banks of the event being read (pool mode)
+	EBZeroSuppressor fZS;        //!< W2 to ZL conversion of the events read (fragment thread only)
+	EBReorderWindow fReorder;    //!< Events put back in serial number order (fragment thread only)
+
 
   /* We use an atomic types here to get lock-free (no pthread mutex lock or spinlock)
    * read-modify-write. operator++(int) and operator++() on an atomic<integral> use
@@ -249,6 +325,8 @@ private:
    * consistent). This saves us from inserting a memory barrier between read/write pointer
    * incrementation and an increment/decrement of this variable.   */
   std::atomic<int> num_events_in_rb_;  //!< Number of events stored in ring buffer
+  uint64_t ready_bit_;                 //!< This fragment's bit in fReadyMask (1 << fragmentID)
+  static std::atomic<uint64_t> fReadyMask;  //!< Readiness of all the fragments, see IncrementNumEventsInRB()
 
   /* Private methods */
 
@@ -256,6 +334,8 @@ private:
 	// rbp points to the start of this ring buffer event.
 	bool CheckControlWord(char *rbp);
 
+	int ReceiveEvent(char *pdata);     //!< Next event from the buffer (or generator), as it comes
+
 
 };
 
@@ -0,0 +1,265 @@
+/*****************************************************************************/
+/**
+\file ebMessage.cxx
+
+\section contents Contents
+Asynchronous, rate-limited diagnostics channel
+
+\subsection notes Notes about this class
+Bounded MPSC queue with per-slot sequence numbers (D. Vyukov's design):
+producers claim a slot with one CAS, the logger thread is the only consumer.
+When the queue is full the message is dropped and counted.
+
+The rate limit allows "limit" messages per id within "interval" seconds;
+the rest are counted and the logger reports the number suppressed once
+the interval is over.  The clock is CLOCK_MONOTONIC_COARSE (vDSO, no syscall).
+
+Before Start() (or after Stop()), PostAt() calls cm_msg()/printf directly.
+Called through the EB_POST() macro, which passes the caller's __FILE__/__LINE__
+on to cm_msg().
+ *****************************************************************************/
+
+#include "ebMessage.hxx"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "midas.h"
+
+EBMessage::Slot EBMessage::queue_[EBMESSAGE_QUEUE_SIZE];
+std::atomic<uint64_t> EBMessage::enqueue_pos_(0);
+std::atomic<uint64_t> EBMessage::dequeue_pos_(0);
+int EBMessage::limit_ = 10;
+int EBMessage::interval_ = 60;
+std::atomic<uint32_t> EBMessage::window_start_[EBMessage::kNIds];
+std::atomic<int> EBMessage::window_count_[EBMessage::kNIds];
+std::atomic<uint64_t> EBMessage::suppressed_[EBMessage::kNIds];
+uint64_t EBMessage::reported_[EBMessage::kNIds];
+std::atomic<uint64_t> EBMessage::dropped_(0);
+uint64_t EBMessage::reported_dropped_ = 0;
+pthread_t EBMessage::tid_;
+std::atomic<bool> EBMessage::running_(false);
+
+//---------------------------------------------------------------------------------
+static uint32_t CoarseSeconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+//---------------------------------------------------------------------------------
+const char *EBMessage::GetIdName(int id)
+{
+  static const char *names[kNIds] = { "thread start", "cpu affinity", "read timeout", "receive error"
+                                    , "wp timeout", "rp timeout", "control word", "SN mismatch", "reorder", "other" };
+  return (id >= 0 && id < kNIds) ? names[id] : "unknown";
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Start the logger thread
+ *
+ * \param   [in]  limit      messages allowed per id per interval (<= 0: no limit)
+ * \param   [in]  interval   rate limit interval in seconds
+ * \return  true if the thread is running
+ */
+bool EBMessage::Start(int limit, int interval)
+{
+  if (running_) return true;
+
+  limit_ = limit;
+  interval_ = (interval > 0) ? interval : 60;
+  for (int i = 0; i < EBMESSAGE_QUEUE_SIZE; i++)
+    queue_[i].seq.store(i, std::memory_order_relaxed);
+  enqueue_pos_ = 0;
+  dequeue_pos_ = 0;
+  for (int i = 0; i < kNIds; i++) {
+    window_start_[i] = 0;
+    window_count_[i] = 0;
+    suppressed_[i] = 0;
+    reported_[i] = 0;
+  }
+  dropped_ = 0;
+  reported_dropped_ = 0;
+
+  running_ = true;
+  if (pthread_create(&tid_, NULL, &LoggerThread, NULL)) {
+    running_ = false;
+    cm_msg(MERROR, "EBMessage::Start", "Cannot create logger thread; messages will be sent directly");
+    return false;
+  }
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+void EBMessage::Stop()
+{
+  if (!running_) return;
+  running_ = false;
+  pthread_join(tid_, NULL);
+}
+
+//---------------------------------------------------------------------------------
+void EBMessage::Flush(int timeout_ms)
+{
+  for (int i = 0; running_ && i < timeout_ms; i++) {
+    if (dequeue_pos_.load() >= enqueue_pos_.load()) return;
+    usleep(1000);
+  }
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Check and count the rate limit for this message id
+ */
+bool EBMessage::Allow(int id)
+{
+  if (limit_ <= 0) return true;
+
+  uint32_t now = CoarseSeconds();
+  uint32_t start = window_start_[id].load(std::memory_order_relaxed);
+  if (now - start >= (uint32_t)interval_) {
+    // New interval; only one producer gets to reset the count
+    if (window_start_[id].compare_exchange_strong(start, now))
+      window_count_[id] = 0;
+  }
+  if (window_count_[id].fetch_add(1, std::memory_order_relaxed) < limit_)
+    return true;
+
+  suppressed_[id].fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Queue a message for the logger thread
+ *
+ * \param   [in]  file      source file of the caller (__FILE__)
+ * \param   [in]  line      line of the caller (__LINE__)
+ * \param   [in]  id        message id (rate limit bucket)
+ * \param   [in]  type      MT_ERROR, MT_INFO (cm_msg) or EBMSG_STDOUT
+ * \param   [in]  routine   routine name for cm_msg
+ * \param   [in]  format    printf format
+ */
+void EBMessage::PostAt(const char *file, int line, Id id, int type, const char *routine, const char *format, ...)
+{
+  va_list argptr;
+
+  if (!running_) {
+    char text[EBMESSAGE_TEXT_SIZE];
+    va_start(argptr, format);
+    vsnprintf(text, sizeof(text), format, argptr);
+    va_end(argptr);
+    if (type == EBMSG_STDOUT) printf("%s\n", text);
+    else cm_msg(type, file, line, routine, "%s", text);
+    return;
+  }
+
+  if (!Allow(id)) return;
+
+  // Claim a slot
+  Slot *slot;
+  uint64_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+  for (;;) {
+    slot = &queue_[pos & (EBMESSAGE_QUEUE_SIZE - 1)];
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+    int64_t dif = (int64_t)seq - (int64_t)pos;
+    if (dif == 0) {
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    } else if (dif < 0) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);   // queue full
+      return;
+    } else {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->type = type;
+  slot->id = id;
+  slot->file = file;
+  slot->line = line;
+  snprintf(slot->routine, sizeof(slot->routine), "%s", routine);
+  va_start(argptr, format);
+  vsnprintf(slot->text, sizeof(slot->text), format, argptr);
+  va_end(argptr);
+  slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Send one message from the queue (logger thread only)
+ *
+ * \return  false if the queue was empty
+ */
+bool EBMessage::Pop()
+{
+  uint64_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+  Slot *slot = &queue_[pos & (EBMESSAGE_QUEUE_SIZE - 1)];
+  uint64_t seq = slot->seq.load(std::memory_order_acquire);
+  if ((int64_t)seq - (int64_t)(pos + 1) < 0)
+    return false;
+
+  if (slot->type == EBMSG_STDOUT)
+    printf("%s\n", slot->text);
+  else
+    cm_msg(slot->type, slot->file, slot->line, slot->routine, "%s", slot->text);
+
+  slot->seq.store(pos + EBMESSAGE_QUEUE_SIZE, std::memory_order_release);
+  dequeue_pos_.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+void EBMessage::ReportSuppressed(bool all)
+{
+  uint32_t now = CoarseSeconds();
+  for (int i = 0; i < kNIds; i++) {
+    uint64_t n = suppressed_[i].load();
+    if (n == reported_[i]) continue;
+    // Wait for the end of the interval so the count is complete
+    if (!all && now - window_start_[i].load() < (uint32_t)interval_) continue;
+    cm_msg(MINFO, "EBMessage", "%llu \"%s\" messages suppressed (limit %d per %d s)"
+           , (unsigned long long)(n - reported_[i]), GetIdName(i), limit_, interval_);
+    reported_[i] = n;
+  }
+  uint64_t d = dropped_.load();
+  if (d != reported_dropped_) {
+    cm_msg(MERROR, "EBMessage", "%llu messages lost, message queue full", (unsigned long long)(d - reported_dropped_));
+    reported_dropped_ = d;
+  }
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Logger thread: lowest priority, drains the queue every 10 ms
+ */
+void *EBMessage::LoggerThread(void *)
+{
+#ifdef SCHED_IDLE
+  struct sched_param param;
+  param.sched_priority = 0;
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+  DWORD last_report = ss_time();
+  while (running_) {
+    while (Pop());
+    if (ss_time() - last_report >= 5) {
+      ReportSuppressed(false);
+      last_report = ss_time();
+    }
+    usleep(10000);
+  }
+
+  // Drain what's left and give the final counts
+  while (Pop());
+  ReportSuppressed(true);
+  return NULL;
+}
@@ -0,0 +1,96 @@
+/*****************************************************************************/
+/**
+\file ebMessage.hxx
+
+## Contents
+
+Asynchronous, rate-limited diagnostics channel for the event builder threads.
+Messages are formatted into a lock-free multi-producer/single-consumer queue
+and passed to cm_msg()/stdout by a low priority logger thread, so the
+fragment threads never take a MIDAS lock or do a syscall to report a problem.
+ *****************************************************************************/
+
+#ifndef EBMESSAGE_HXX_INCLUDE
+#define EBMESSAGE_HXX_INCLUDE
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+
+#define EBMESSAGE_QUEUE_SIZE  1024   //!< Queue slots, power of 2
+#define EBMESSAGE_TEXT_SIZE   256    //!< Max message length
+
+#define EBMSG_STDOUT  0              //!< Message type: print on stdout only (MT_ERROR, MT_INFO go to cm_msg)
+
+/**
+ * Static interface; the message id selects the rate limit bucket.
+ */
+class EBMessage
+{
+
+public:
+
+  enum Id {
+    kThreadStart,       //!< Fragment thread start-up
+    kAffinity,          //!< sched_setaffinity failure
+    kReadTimeout,       //!< No event from a fragment for a long time
+    kReceiveError,      //!< bm_receive_event error
+    kWpTimeout,         //!< Ring buffer wp timeout
+    kRpTimeout,         //!< Ring buffer rp timeout
+    kControlWord,       //!< Control word retries/failure
+    kSNMismatch,        //!< Serial number mismatch
+    kReorder,           //!< Fragment events missing (reorder window)
+    kOther,
+    kNIds
+  };
+
+  static bool Start(int limit, int interval);   //!< Start the logger thread
+  static void Stop();                           //!< Drain the queue and stop the logger thread
+  static void Flush(int timeout_ms = 1000);     //!< Wait until the queue has been drained
+
+  /// Queue a message; printf-style.  Never blocks.  Called through EB_POST(), with the caller's file and line
+  static void PostAt(const char *file, int line, Id id, int type, const char *routine, const char *format, ...)
+    __attribute__ ((format (printf, 6, 7)));
+
+  static uint64_t GetSuppressed(int id) { return (id >= 0 && id < kNIds) ? suppressed_[id].load() : 0; }
+  static uint64_t GetDropped() { return dropped_.load(); }
+  static const char *GetIdName(int id);
+
+private:
+
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    int type;
+    int id;
+    const char *file;                                  //!< __FILE__ of the caller (string literal)
+    int line;
+    char routine[32];
+    char text[EBMESSAGE_TEXT_SIZE];
+  };
+
+  static bool Allow(int id);
+  static void *LoggerThread(void *);
+  static bool Pop();
+  static void ReportSuppressed(bool all);
+
+  static Slot queue_[EBMESSAGE_QUEUE_SIZE];
+  static std::atomic<uint64_t> enqueue_pos_;
+  static std::atomic<uint64_t> dequeue_pos_;
+
+  static int limit_;                                   //!< Messages per id per interval
+  static int interval_;                                //!< Rate limit interval (s)
+  static std::atomic<uint32_t> window_start_[kNIds];   //!< Start of current interval (s)
+  static std::atomic<int> window_count_[kNIds];        //!< Messages posted in current interval
+  static std::atomic<uint64_t> suppressed_[kNIds];     //!< Total suppressed by the rate limit
+  static uint64_t reported_[kNIds];                    //!< Suppressed count already reported (logger only)
+  static std::atomic<uint64_t> dropped_;               //!< Lost because the queue was full
+  static uint64_t reported_dropped_;                   //!< Lost count already reported (logger only)
+
+  static pthread_t tid_;
+  static std::atomic<bool> running_;
+};
+
+/// EB_POST(id, type, routine, format, ...): cm_msg() gets the caller's file and line
+#define EB_POST(...) EBMessage::PostAt(__FILE__, __LINE__, __VA_ARGS__)
+
+#endif // EBMESSAGE_HXX_INCLUDE
@@ -0,0 +1,101 @@
+/*****************************************************************************/
+/**
+\file ebPacked.hxx
+
+## Contents
+
+Packed output format and its unpacker, for the analyzers.
+
+With packing on (Settings "Packing/Max events" > 1) the event builder sends
+several built events in one container event:
+
+    EVENT_HEADER                  (event id/trigger mask of the built events,
+                                   serial number of the first one)
+    BANK_HEADER
+    EBPD  TID_BYTE                the built events back to back, each one a
+                                  full Midas event (EVENT_HEADER + banks)
+    EBPI  TID_DWORD               index: version, number of events, then
+                                  per event its offset in EBPD and its size
+
+Every built event size is a multiple of 8 bytes, so each one stays aligned
+in EBPD.  An event without an EBPI bank is a single, unpacked event.
+
+Header only, no MIDAS library needed:
+
+    EBUnpacker up(pevent);
+    for (int i = 0; i < up.GetNumEvents(); i++)
+      analyze(up.GetEvent(i));
+ *****************************************************************************/
+
+#ifndef EBPACKED_HXX_INCLUDE
+#define EBPACKED_HXX_INCLUDE
+
+#include <string.h>
+
+#include "midas.h"
+
+#define EB_PACKED_DATA_BANK    "EBPD"   //!< Built events
+#define EB_PACKED_INDEX_BANK   "EBPI"   //!< Index of the built events
+#define EB_PACKED_VERSION      1        //!< EBPI[0]
+#define EB_PACKED_INDEX_HEAD   2        //!< EBPI DWORDs before the (offset, size) pairs
+
+/**
+ * Walks a container event; works on unpacked events as well (one event).
+ */
+class EBUnpacker
+{
+
+public:
+
+  EBUnpacker(const EVENT_HEADER *pevent)
+  : event_(pevent), data_(NULL), index_(NULL), nevents_(1)
+  {
+    const BANK_HEADER *pbh = (const BANK_HEADER *)(pevent + 1);
+    if (!(pbh->flags & BANK_FORMAT_32BIT)) return;
+
+    // bank32 walk, each bank 8-byte aligned
+    const char *p = (const char *)(pbh + 1);
+    const char *end = p + pbh->data_size;
+    while (p + sizeof(BANK32) <= end) {
+      const BANK32 *pbk = (const BANK32 *)p;
+      const char *pdata = (const char *)(pbk + 1);
+      if (memcmp(pbk->name, EB_PACKED_DATA_BANK, 4) == 0)
+        data_ = pdata;
+      else if (memcmp(pbk->name, EB_PACKED_INDEX_BANK, 4) == 0)
+        index_ = (const DWORD *)pdata;
+      p = pdata + ((pbk->data_size + 7) & ~7);
+    }
+    if (data_ && index_ && index_[0] == EB_PACKED_VERSION)
+      nevents_ = index_[1];
+    else
+      index_ = NULL;
+  }
+
+  bool IsPacked() const { return index_ != NULL; }
+  int GetNumEvents() const { return nevents_; }
+
+  /// i-th built event, NULL if out of range
+  const EVENT_HEADER *GetEvent(int i) const
+  {
+    if (i < 0 || i >= nevents_) return NULL;
+    if (!index_) return event_;
+    return (const EVENT_HEADER *)(data_ + index_[EB_PACKED_INDEX_HEAD + 2*i]);
+  }
+
+  /// Size in bytes (EVENT_HEADER included) of the i-th built event
+  DWORD GetEventSize(int i) const
+  {
+    if (i < 0 || i >= nevents_) return 0;
+    if (!index_) return sizeof(EVENT_HEADER) + event_->data_size;
+    return index_[EB_PACKED_INDEX_HEAD + 2*i + 1];
+  }
+
+private:
+
+  const EVENT_HEADER *event_;
+  const char *data_;
+  const DWORD *index_;
+  int nevents_;
+};
+
+#endif // EBPACKED_HXX_INCLUDE
@@ -0,0 +1,132 @@
+/*****************************************************************************/
+/**
+\file ebPerf.cxx
+
+\section contents Contents
+Per-thread hardware performance counters
+
+\subsection notes Notes about this class
+Uses perf_event_open(2) directly (no libpfm), counting user+kernel for the
+thread that called Open().  If the kernel doesn't allow it
+(/proc/sys/kernel/perf_event_paranoid), the counter is reported as -1.
+ *****************************************************************************/
+
+#include "ebPerf.hxx"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+//---------------------------------------------------------------------------------
+EBPerfCounters::EBPerfCounters()
+: nevents_(0), valid_(false)
+{
+  for (int i = 0; i < kNCounters; i++) {
+    fd_[i] = -1;
+    value_[i] = 0;
+    have_[i] = false;
+  }
+}
+
+//---------------------------------------------------------------------------------
+EBPerfCounters::~EBPerfCounters()
+{
+  for (int i = 0; i < kNCounters; i++)
+    if (fd_[i] >= 0) close(fd_[i]);
+}
+
+//---------------------------------------------------------------------------------
+void EBPerfCounters::Reset()
+{
+  for (int i = 0; i < kNCounters; i++) {
+    if (fd_[i] >= 0) close(fd_[i]);
+    fd_[i] = -1;
+    value_[i] = 0;
+    have_[i] = false;
+  }
+  nevents_ = 0;
+  valid_ = false;
+}
+
+//---------------------------------------------------------------------------------
+const char *EBPerfCounters::GetCounterName(int i)
+{
+  static const char *names[kNCounters] = { "cycles", "instructions", "LLC-misses"
+                                         , "branch-misses", "context-switches" };
+  return (i >= 0 && i < kNCounters) ? names[i] : "";
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Open the counters on the calling thread
+ *
+ * \return  true if at least one counter could be opened
+ */
+bool EBPerfCounters::Open()
+{
+  static const uint32_t type[kNCounters] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+                                           , PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+                                           , PERF_TYPE_SOFTWARE };
+  static const uint64_t config[kNCounters] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS
+                                             , PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+                                             , PERF_COUNT_SW_CONTEXT_SWITCHES };
+  bool ok = false;
+
+  Reset();
+  for (int i = 0; i < kNCounters; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type[i];
+    attr.config = config[i];
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    // Time enabled/running to scale if the PMU is multiplexed
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    // pid = 0, cpu = -1: this thread, wherever it runs
+    fd_[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    value_[i] = 0;
+    have_[i] = false;
+    if (fd_[i] < 0) continue;
+
+    ioctl(fd_[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd_[i], PERF_EVENT_IOC_ENABLE, 0);
+    ok = true;
+  }
+  return ok;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Read and close the counters
+ *
+ * \param   [in]  nevents   number of events handled by this thread since Open()
+ */
+void EBPerfCounters::Stop(uint64_t nevents)
+{
+  nevents_ = nevents;
+  for (int i = 0; i < kNCounters; i++) {
+    if (fd_[i] < 0) continue;
+
+    ioctl(fd_[i], PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t buf[3]; // value, time enabled, time running
+    if (read(fd_[i], buf, sizeof(buf)) == sizeof(buf) && buf[2] > 0) {
+      value_[i] = (buf[2] < buf[1]) ? (uint64_t)((double)buf[0] * buf[1] / buf[2]) : buf[0];
+      have_[i] = true;
+      valid_ = true;
+    }
+    close(fd_[i]);
+    fd_[i] = -1;
+  }
+}
+
+//---------------------------------------------------------------------------------
+double EBPerfCounters::GetPerEvent(int i)
+{
+  if (i < 0 || i >= kNCounters || !have_[i]) return -1;
+  if (nevents_ == 0) return 0;
+  return (double)value_[i] / nevents_;
+}
@@ -0,0 +1,60 @@
+/*****************************************************************************/
+/**
+\file ebPerf.hxx
+
+## Contents
+
+Hardware performance counters (perf_event_open) for the event builder threads
+ *****************************************************************************/
+
+#ifndef EBPERF_HXX_INCLUDE
+#define EBPERF_HXX_INCLUDE
+
+#include <stdint.h>
+
+/**
+ * Set of perf counters attached to the calling thread.
+ *
+ * Open() has to be called from the thread to be measured, Stop() as well
+ * (the counters are per task, not per cpu).  The values are scaled for
+ * multiplexing and kept after Stop() for the EOR report.
+ */
+class EBPerfCounters
+{
+
+public:
+
+  enum Counter {
+    kCycles,
+    kInstructions,
+    kLLCMisses,
+    kBranchMisses,
+    kContextSwitches,
+    kNCounters
+  };
+
+  EBPerfCounters();
+  ~EBPerfCounters();
+
+  bool Open();                        //!< Open and enable the counters on the calling thread
+  void Reset();                       //!< Close, forget the values of the last run
+  void Stop(uint64_t nevents);        //!< Read, close, and record number of events processed
+  bool IsValid() { return valid_; }   //!< true if Stop() got at least one counter
+
+  uint64_t GetEvents() { return nevents_; }
+  uint64_t GetValue(int i) { return value_[i]; }
+  double GetPerEvent(int i);          //!< value / events, -1 if counter not available
+
+  static const char *GetCounterName(int i);
+
+private:
+
+  int fd_[kNCounters];                //!< perf event file descriptors, -1 if not opened
+  uint64_t value_[kNCounters];        //!< Scaled counter values at Stop()
+  bool have_[kNCounters];             //!< Counter could be opened and read
+  uint64_t nevents_;                  //!< Events processed between Open() and Stop()
+  bool valid_;
+
+};
+
+#endif // EBPERF_HXX_INCLUDE
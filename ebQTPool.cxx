@@ -0,0 +1,180 @@
+/*****************************************************************************/
+/**
+\file ebQTPool.cxx
+
+\section contents Contents
+QT summary worker pool
+
+\subsection notes Notes about this class
+The QT banks of an event are taken one at a time from a shared atomic index,
+so a worker which gets a big bank does not hold the others back.  Every
+worker (and the calling fragment thread) fills its own partial Q and N
+histograms; the caller adds them up once all are done.  The charge saturates
+at 4e9 as in the serial summary, so the result does not depend on how the
+banks were shared out.
+
+Workers sleep on a condition variable between events: the pool is meant for
+fragments large enough that a wake-up is small compared to the summary.
+ *****************************************************************************/
+
+#include "ebQTPool.hxx"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ebDecoder.hxx"
+
+//---------------------------------------------------------------------------------
+EBQTPool::EBQTPool()
+: generation_(0), pending_(0), stop_(false), banks_(NULL), rebin_(1), next_(0)
+{
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&start_cond_, NULL);
+  pthread_cond_init(&done_cond_, NULL);
+}
+
+//---------------------------------------------------------------------------------
+EBQTPool::~EBQTPool()
+{
+  Stop();
+  pthread_cond_destroy(&done_cond_);
+  pthread_cond_destroy(&start_cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Start the helper threads
+ *
+ * \param   [in]  nworkers  number of helper threads (the caller works as well)
+ * \param   [in]  name      fragment name, for the messages
+ * \return  false if no thread could be started
+ */
+bool EBQTPool::Start(int nworkers, const char *name)
+{
+  Stop();
+
+  stop_ = false;
+  generation_ = 0;
+  // No reallocation once the threads hold a pointer to their Worker
+  workers_.reserve(nworkers);
+  for (int i = 0; i < nworkers; i++) {
+    workers_.push_back(Worker());
+    Worker &w = workers_.back();
+    w.pool = this;
+    if (pthread_create(&w.tid, NULL, &WorkerThread, &w)) {
+      cm_msg(MERROR, "EBQTPool", "Cannot start QT worker %d for %s", i, name);
+      workers_.pop_back();
+      break;
+    }
+  }
+  return !workers_.empty();
+}
+
+//---------------------------------------------------------------------------------
+void EBQTPool::Stop()
+{
+  if (workers_.empty()) return;
+
+  pthread_mutex_lock(&mutex_);
+  stop_ = true;
+  pthread_cond_broadcast(&start_cond_);
+  pthread_mutex_unlock(&mutex_);
+
+  for (unsigned int i = 0; i < workers_.size(); i++)
+    pthread_join(workers_[i].tid, NULL);
+  workers_.clear();
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Take QT banks until there are none left, into q/n
+ */
+void EBQTPool::Work(std::vector<DWORD> &q, std::vector<DWORD> &n)
+{
+  EBSCAN_STATE st;
+  st.rebin = rebin_;
+  st.q = &q;
+  st.n = &n;
+
+  const std::vector<const DWORD *> &banks = *banks_;
+  unsigned int i;
+  while ((i = next_.fetch_add(1, std::memory_order_relaxed)) < banks.size())
+    EBAccumulateQT(st, banks[i]);
+}
+
+//---------------------------------------------------------------------------------
+void *EBQTPool::WorkerThread(void *arg)
+{
+  Worker *w = (Worker *)arg;
+  EBQTPool *pool = w->pool;
+  unsigned int seen = 0;
+
+  pthread_mutex_lock(&pool->mutex_);
+  for (;;) {
+    while (pool->generation_ == seen && !pool->stop_)
+      pthread_cond_wait(&pool->start_cond_, &pool->mutex_);
+    if (pool->stop_) break;
+    seen = pool->generation_;
+    pthread_mutex_unlock(&pool->mutex_);
+
+    pool->Work(w->q, w->n);
+
+    pthread_mutex_lock(&pool->mutex_);
+    if (--pool->pending_ == 0)
+      pthread_cond_signal(&pool->done_cond_);
+  }
+  pthread_mutex_unlock(&pool->mutex_);
+
+  return NULL;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   QT summary of the banks, shared with the helper threads
+ *
+ * Called by the fragment thread only.  q and n are added to, as
+ * EBAccumulateQT() does.
+ *
+ * \param   [in]  banks   QT bank data of the event
+ * \param   [in]  rebin   time bin rebin factor (>= 1)
+ * \param   [out] q, n    QT summary
+ */
+void EBQTPool::Accumulate(const std::vector<const DWORD *> &banks, int rebin
+                          , std::vector<DWORD> &q, std::vector<DWORD> &n)
+{
+  banks_ = &banks;
+  rebin_ = rebin;
+  next_.store(0, std::memory_order_relaxed);
+
+  pthread_mutex_lock(&mutex_);
+  pending_ = workers_.size();
+  generation_++;
+  pthread_cond_broadcast(&start_cond_);
+  pthread_mutex_unlock(&mutex_);
+
+  Work(q, n);
+
+  pthread_mutex_lock(&mutex_);
+  while (pending_ > 0)
+    pthread_cond_wait(&done_cond_, &mutex_);
+  pthread_mutex_unlock(&mutex_);
+
+  // Reduce the partial summaries
+  for (unsigned int i = 0; i < workers_.size(); i++) {
+    Worker &w = workers_[i];
+    if (w.q.size() > q.size()) {
+      q.resize(w.q.size(), 0);
+      n.resize(w.q.size(), 0);
+    }
+    for (unsigned int j = 0; j < w.q.size(); j++) {
+      DWORD charge = q[j];
+      if (charge > 4000000000u - w.q[j]) charge = 4000000000u;
+      else                               charge += w.q[j];
+      q[j] = charge;
+      n[j] += w.n[j];
+    }
+    w.q.clear();
+    w.n.clear();
+  }
+}
@@ -0,0 +1,66 @@
+/*****************************************************************************/
+/**
+\file ebQTPool.hxx
+
+## Contents
+
+Per-fragment worker pool for the QT summary of large V1720 group fragments.
+The fragment thread hands the QT banks of one event to the pool, takes part
+in the work itself, and reduces the per-worker partial histograms before
+the ring buffer record is published.
+ *****************************************************************************/
+
+#ifndef EBQTPOOL_HXX_INCLUDE
+#define EBQTPOOL_HXX_INCLUDE
+
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+#include "midas.h"
+
+class EBQTPool
+{
+
+public:
+
+  EBQTPool();
+  ~EBQTPool();
+
+  bool Start(int nworkers, const char *name);
+  void Stop();
+  int  GetNumWorkers() const { return (int)workers_.size(); }
+
+  void Accumulate(const std::vector<const DWORD *> &banks, int rebin
+                  , std::vector<DWORD> &q, std::vector<DWORD> &n);
+
+private:
+
+  /// One helper thread and its partial QT summary
+  struct Worker {
+    EBQTPool *pool;
+    pthread_t tid;
+    std::vector<DWORD> q;
+    std::vector<DWORD> n;
+  };
+
+  EBQTPool(const EBQTPool&);
+  EBQTPool& operator=(const EBQTPool&);
+
+  static void *WorkerThread(void *arg);
+  void Work(std::vector<DWORD> &q, std::vector<DWORD> &n);
+
+  std::vector<Worker> workers_;                //!< Helper threads (the caller is not in there)
+  pthread_mutex_t mutex_;
+  pthread_cond_t start_cond_;                  //!< New event for the workers
+  pthread_cond_t done_cond_;                   //!< Last worker done
+  unsigned int generation_;                    //!< Event counter, under mutex_
+  int pending_;                                //!< Workers still busy, under mutex_
+  bool stop_;                                  //!< Workers exit, under mutex_
+
+  const std::vector<const DWORD *> *banks_;    //!< QT banks of the current event
+  int rebin_;                                  //!< QT summary rebin factor of the current event
+  std::atomic<unsigned int> next_;             //!< Next bank to take
+};
+
+#endif // EBQTPOOL_HXX_INCLUDE
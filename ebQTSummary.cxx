@@ -0,0 +1,186 @@
+/*****************************************************************************/
+/**
+\file ebQTSummary.cxx
+
+\section contents Contents
+Detector-wide QT summary and timestamp spread of the event being assembled
+
+\subsection notes Notes about this class
+Main (assembly) thread only.  The group summaries are added with SSE2
+where the compiler has it, 4 bins per step into 64-bit charge sums (a
+group bin already saturates at 4e9).  Timestamps are 30-bit counters:
+differences are taken modulo 2^30 and sign extended.
+ *****************************************************************************/
+
+#include "ebQTSummary.hxx"
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ebRecord.hxx"
+#include "ebDecoder.hxx"
+
+//---------------------------------------------------------------------------------
+EBQTSummary::EBQTSummary()
+: rebin_(1), lazy_(false), nts_(0), ts_ref_(0), dmin_(0), dmax_(0), dlast_(0)
+{
+}
+
+//---------------------------------------------------------------------------------
+void EBQTSummary::Clear()
+{
+  q_.clear();
+  n_.clear();
+  nts_ = 0;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Add the timestamps and the QT summary of one fragment record
+ *
+ * \param   [in]  rec   ring buffer record (EVENT_HEADER), control word checked
+ */
+void EBQTSummary::Add(char *rec)
+{
+  EBRECORD_TRAILER *t = EBRecordTrailer(rec);
+
+  if (!(t->flags & EB_TRAILER_TS_VALID)) {
+    // No timestamped bank (DTM), nothing to compare
+  } else if (nts_++ == 0) {
+    ts_ref_ = t->ts_best;
+    dmin_ = dmax_ = 0;
+    dlast_ = EBTsDiff(t->ts_max, ts_ref_);
+  } else {
+    int32_t d = EBTsDiff(t->ts_best, ts_ref_);
+    if (d < dmin_) dmin_ = d;
+    if (d > dmax_) dmax_ = d;
+    d = EBTsDiff(t->ts_max, ts_ref_);
+    if (d > dlast_) dlast_ = d;
+  }
+
+  if (lazy_) {
+    AddQTBanks(rec);
+    return;
+  }
+
+  if (!t->nqtbins) return;
+  unsigned int nbins = t->nbins;
+  if (nbins > q_.size()) {
+    q_.resize(nbins, 0);
+    n_.resize(nbins, 0);
+  }
+  const DWORD *q = EBRecordQT(rec);
+  if (t->flags & EB_TRAILER_QT_SPARSE)
+    AddSparse(q, t->nqtbins);
+  else
+    Sum(q, q + nbins, nbins);
+}
+
+//---------------------------------------------------------------------------------
+/// Add one sparse group summary (see ebRecord.hxx) to q_/n_ (q_ long enough)
+void EBQTSummary::AddSparse(const DWORD *in, DWORD nwords)
+{
+  for (DWORD i = 0; i < nwords; i += 2) {
+    DWORD bin = in[i] >> 16;
+    n_[bin] += in[i] & 0xFFFF;
+    q_[bin] += in[i + 1];
+  }
+}
+
+//---------------------------------------------------------------------------------
+/// Add one group summary to q_/n_ (same binning, q_ long enough)
+void EBQTSummary::Sum(const DWORD *q, const DWORD *n, unsigned int nbins)
+{
+  uint64_t *qs = &q_[0];
+  DWORD *ns = &n_[0];
+  unsigned int i = 0;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 4 <= nbins; i += 4) {
+    __m128i vq = _mm_loadu_si128((const __m128i *)(q + i));
+    __m128i lo = _mm_unpacklo_epi32(vq, zero);
+    __m128i hi = _mm_unpackhi_epi32(vq, zero);
+    _mm_storeu_si128((__m128i *)(qs + i),     _mm_add_epi64(_mm_loadu_si128((const __m128i *)(qs + i)), lo));
+    _mm_storeu_si128((__m128i *)(qs + i + 2), _mm_add_epi64(_mm_loadu_si128((const __m128i *)(qs + i + 2)), hi));
+    __m128i vn = _mm_loadu_si128((const __m128i *)(n + i));
+    _mm_storeu_si128((__m128i *)(ns + i), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(ns + i)), vn));
+  }
+#endif
+
+  for (; i < nbins; i++) {
+    qs[i] += q[i];
+    ns[i] += n[i];
+  }
+}
+
+//---------------------------------------------------------------------------------
+/// Lazy mode: QT banks of the record, found through its bank directory
+void EBQTSummary::AddQTBanks(char *rec)
+{
+  EBRECORD_TRAILER *t = EBRecordTrailer(rec);
+
+  if (t->flags & EB_TRAILER_DIR_COMPLETE) {
+    const EBBANK_DIR *dir = EBRecordDir(rec);
+    for (DWORD i = 0; i < t->ndir; i++)
+      if ((dir[i].fourcc & EB_PREFIX_MASK) == EB_FOURCC('Q','T',0,0))
+        AddQTBank((const DWORD *)(rec + dir[i].offset));
+  } else {
+    BANK32 *pbk = NULL;
+    DWORD *pdata;
+    while (bk_iterate32((BANK_HEADER *)((EVENT_HEADER *)rec + 1), &pbk, &pdata))
+      if ((EBBankFourCC(pbk) & EB_PREFIX_MASK) == EB_FOURCC('Q','T',0,0))
+        AddQTBank(pdata);
+  }
+}
+
+//---------------------------------------------------------------------------------
+/// Lazy mode: pulses of one QT bank (as EBAccumulateQT(), into the merged sums)
+void EBQTSummary::AddQTBank(const DWORD *pdata)
+{
+  int ndwords = pdata[N_DWORD_IDX];
+
+  for (int i = QINTEGRAL_IDX+1; i < QINTEGRAL_IDX+ndwords+1; i += 4) {
+    unsigned int bin = ((pdata[i+3] >> 16) & 0xFFFF) / rebin_;
+    if (bin >= q_.size()) {
+      q_.resize(bin+1, 0);
+      n_.resize(bin+1, 0);
+    }
+    q_[bin] += pdata[i+2] & 0xFFFFFF;
+    n_[bin]++;
+  }
+}
+
+//---------------------------------------------------------------------------------
+DWORD EBQTSummary::GetTsMin() const
+{
+  return nts_ ? (ts_ref_ + dmin_) & EB_TS_MASK : 0;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Write the QTSM bank payload
+ *
+ * \param   [out] pdata   room for GetBankSize() bytes
+ * \return  number of DWORDs written
+ */
+int EBQTSummary::FillBank(DWORD *pdata) const
+{
+  unsigned int nbins = q_.size();
+
+  pdata[0] = nbins;
+  pdata[1] = rebin_;
+  pdata[2] = GetTsMin();
+  pdata[3] = GetTsSpread();
+  pdata[4] = GetTsLast();
+  pdata[5] = nts_;
+
+  DWORD *pq = pdata + EBQTSM_HEADER;
+  for (unsigned int i = 0; i < nbins; i++)
+    pq[i] = (q_[i] > 4000000000u) ? 4000000000u : (DWORD)q_[i];
+  if (nbins) memcpy(pq + nbins, &n_[0], nbins * sizeof(DWORD));
+
+  return EBQTSM_HEADER + 2 * nbins;
+}
@@ -0,0 +1,79 @@
+/*****************************************************************************/
+/**
+\file ebQTSummary.hxx
+
+## Contents
+
+Detector-wide QT summary of one event: the QT summaries of the V1720 group
+fragment records (ebRecord.hxx) summed bin by bin, and the spread of the
+fragment timestamps.  Computed by the assembly before the bank merging,
+once per event, from the fragment thread summaries or, in lazy mode, from
+the QT banks of the records themselves (the fragment threads then skip
+it).  Used by the L2 filter (ebFilter.hxx) and written as the QTSM bank:
+
+    DWORD  [0]  number of bins (nbins)
+    DWORD  [1]  bin width, 4ns units (QT summary rebin factor)
+    DWORD  [2]  earliest fragment timestamp (16ns, 30 bits)
+    DWORD  [3]  latest - earliest fragment timestamp (16ns)
+    DWORD  [4]  latest fragment hit (trailer ts_max) - earliest timestamp (16ns)
+    DWORD  [5]  number of fragments with a timestamp (EB_TRAILER_TS_VALID)
+    DWORD  Q[nbins]   charge per bin, saturated at 4e9
+    DWORD  N[nbins]   number of pulses per bin
+ *****************************************************************************/
+
+#ifndef EBQTSUMMARY_HXX_INCLUDE
+#define EBQTSUMMARY_HXX_INCLUDE
+
+#include <stdint.h>
+#include <vector>
+
+#include "midas.h"
+
+#define EBQTSM_HEADER   6    //!< QTSM bank words before the Q bins
+
+class EBQTSummary
+{
+
+public:
+
+  EBQTSummary();
+
+  void SetRebin(int rebin) { rebin_ = (rebin > 0) ? rebin : 1; }   //!< BOR
+  int GetRebin() const { return rebin_; }
+  void SetLazy(bool lazy) { lazy_ = lazy; }  //!< BOR: summary from the QT banks, not from the trailers
+  bool IsLazy() const { return lazy_; }
+
+  void Clear();
+  void Add(char *rec);                       //!< One fragment record, control word checked
+
+  unsigned int GetNumBins() const { return q_.size(); }
+  const std::vector<uint64_t> &GetQ() const { return q_; }
+  const std::vector<DWORD> &GetN() const { return n_; }
+  int GetNumTimestamps() const { return nts_; }
+
+  DWORD GetTsMin() const;                    //!< Earliest fragment timestamp (16ns, 30 bits)
+  DWORD GetTsSpread() const { return nts_ ? dmax_ - dmin_ : 0; }
+  DWORD GetTsLast() const { return nts_ ? dlast_ - dmin_ : 0; }
+
+  int GetBankSize() const { return (EBQTSM_HEADER + 2 * q_.size()) * sizeof(DWORD); }
+  int FillBank(DWORD *pdata) const;          //!< QTSM bank payload, returns the number of DWORDs
+
+private:
+
+  void Sum(const DWORD *q, const DWORD *n, unsigned int nbins);
+  void AddSparse(const DWORD *in, DWORD nwords);
+  void AddQTBanks(char *rec);
+  void AddQTBank(const DWORD *pdata);
+
+  int rebin_;
+  bool lazy_;
+  std::vector<uint64_t> q_;
+  std::vector<DWORD> n_;
+  int nts_;                                  //!< Records with a timestamp
+  DWORD ts_ref_;                             //!< Timestamp of the first of them
+  int32_t dmin_;                             //!< Earliest/latest ts_best - ts_ref_ (30-bit wrap)
+  int32_t dmax_;
+  int32_t dlast_;                            //!< Latest ts_max - ts_ref_
+};
+
+#endif // EBQTSUMMARY_HXX_INCLUDE
@@ -0,0 +1,177 @@
+/*****************************************************************************/
+/**
+\file ebRecord.hxx
+
+## Contents
+
+Layout of a fragment record in the ring buffer:
+
+    EVENT_HEADER + banks          (Midas event as received)
+    EBRECORD_TRAILER              (timestamps, control word, sizes)
+    DWORD qt[nqtbins]             (QT summary, V1720 only)
+    EBBANK_DIR dir[ndir]          (one entry per bank of the event)
+
+The QT summary has nbins bins.  Dense: the Q bins then the N bins
+(nqtbins = 2 nbins).  Sparse (EB_TRAILER_QT_SPARSE), only the bins with
+pulses, two DWORDs each (nqtbins = 2 x bins used):
+
+    DWORD  bin << 16 | N (saturated at 0xFFFF)
+    DWORD  Q
+
+The record is written by the fragment thread (ReadFragment) and read by the
+assembly.  The control word is checked before anything else of the trailer
+is trusted.  Consumers look banks up in the directory instead of walking the
+whole event with bk_iterate32().
+ *****************************************************************************/
+
+#ifndef EBRECORD_HXX_INCLUDE
+#define EBRECORD_HXX_INCLUDE
+
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "midas.h"
+
+#define EB_CONTROL_WORD      0xdeadbeef   //!< Trailer control word
+#define EB_MAX_DIR           256          //!< Max bank directory entries per record
+
+#define EB_TRAILER_DIR_COMPLETE  0x1      //!< flags: every bank of the event is in the directory
+#define EB_TRAILER_TS_VALID      0x2      //!< flags: ts_best/ts_max from timestamped banks of the event
+#define EB_TRAILER_QT_SPARSE     0x4      //!< flags: QT summary as (bin|N, Q) pairs of the bins used
+
+#define EB_TS_MASK           0x3fffffff   //!< Trailer timestamps are 30-bit counters
+
+/// Bank name as a little-endian integer, name[0] in the low byte
+#define EB_FOURCC(a,b,c,d)  ((DWORD)(a) | ((DWORD)(b) << 8) | ((DWORD)(c) << 16) | ((DWORD)(d) << 24))
+
+/// Trailer following the Midas event in the ring buffer; control stays at DWORD 3
+struct EBRECORD_TRAILER {
+  DWORD ts_best;       //!< [0] Timestamp of the fragment (16ns, 30 bits)
+  DWORD ts_max;        //!< [1] Latest timestamp (16ns, 30 bits)
+  DWORD nqtbins;       //!< [2] Number of QT summary DWORDs following the trailer
+  DWORD control;       //!< [3] EB_CONTROL_WORD
+  DWORD ndir;          //!< [4] Number of bank directory entries
+  DWORD size;          //!< [5] Trailer + QT summary + directory size in bytes
+  DWORD flags;         //!< [6] EB_TRAILER_xxx
+  DWORD nbins;         //!< [7] Number of QT summary bins (Q and N each)
+};
+
+/// Bank directory entry
+struct EBBANK_DIR {
+  DWORD fourcc;        //!< Bank name, see EB_FOURCC()
+  DWORD offset;        //!< Offset of the bank data from the start of the record (EVENT_HEADER)
+  DWORD size;          //!< Bank data size in bytes
+};
+
+/// Room kept for the trailer and a full directory in the ring buffer slot: the
+/// event received is at most the slot size minus this.  The QT summary goes in
+/// only if it fits in what the event left.
+#define EB_RECORD_RESERVE    (sizeof(EBRECORD_TRAILER) + EB_MAX_DIR * sizeof(EBBANK_DIR))
+
+//---------------------------------------------------------------------------------
+static inline DWORD EBEventSize(const char *rec)
+{
+  return ((const EVENT_HEADER *)rec)->data_size + sizeof(EVENT_HEADER);
+}
+
+static inline EBRECORD_TRAILER *EBRecordTrailer(char *rec)
+{
+  return (EBRECORD_TRAILER *)(rec + EBEventSize(rec));
+}
+
+/// Full record size (event + trailer), the ring buffer rp increment
+static inline DWORD EBRecordSize(char *rec)
+{
+  return EBEventSize(rec) + EBRecordTrailer(rec)->size;
+}
+
+/// a - b for 30-bit timestamps
+static inline int32_t EBTsDiff(DWORD a, DWORD b)
+{
+  return (int32_t)(((a - b) & EB_TS_MASK) << 2) >> 2;
+}
+
+static inline DWORD *EBRecordQT(char *rec)
+{
+  return (DWORD *)(EBRecordTrailer(rec) + 1);
+}
+
+static inline EBBANK_DIR *EBRecordDir(char *rec)
+{
+  EBRECORD_TRAILER *t = EBRecordTrailer(rec);
+  return (EBBANK_DIR *)((DWORD *)(t + 1) + t->nqtbins);
+}
+
+/**
+ * \brief   Find a bank of the record through the directory
+ *
+ * \param   [in]  rec      record (EVENT_HEADER) in the ring buffer
+ * \param   [in]  fourcc   bank name, EB_FOURCC()
+ * \param   [out] pdata    bank data
+ * \return  bank data size in bytes, 0 if not found
+ */
+static inline DWORD EBRecordFindBank(char *rec, DWORD fourcc, DWORD **pdata)
+{
+  EBRECORD_TRAILER *t = EBRecordTrailer(rec);
+  const EBBANK_DIR *dir = EBRecordDir(rec);
+  for (DWORD i = 0; i < t->ndir; i++) {
+    if (dir[i].fourcc == fourcc) {
+      *pdata = (DWORD *)(rec + dir[i].offset);
+      return dir[i].size;
+    }
+  }
+  if (!(t->flags & EB_TRAILER_DIR_COMPLETE)) {
+    // Directory overflowed, look the old way
+    char name[5];
+    memcpy(name, &fourcc, 4);
+    name[4] = 0;
+    DWORD bktype, bklen;
+    if (bk_find((BANK_HEADER *)((EVENT_HEADER *)rec + 1), name, &bklen, &bktype, (void **)pdata) == SUCCESS)
+      return ((BANK32 *)*pdata - 1)->data_size;
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Sparse QT summary: the bins with pulses only
+ *
+ * The empty bins are skipped 4 at a time (SSE2, where the compiler has it).
+ *
+ * \param   [in]  q      charge per bin
+ * \param   [in]  n      pulses per bin
+ * \param   [in]  nbins  number of bins
+ * \param   [out] out    room for 2 nbins DWORDs
+ * \return  number of DWORDs written (nqtbins)
+ */
+static inline DWORD EBQTEncodeSparse(const DWORD *q, const DWORD *n, DWORD nbins, DWORD *out)
+{
+  DWORD *o = out;
+  DWORD i = 0;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 4 <= nbins; i += 4) {
+    __m128i vn = _mm_loadu_si128((const __m128i *)(n + i));
+    int empty = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(vn, zero)));
+    if (empty == 0xF) continue;
+    for (int k = 0; k < 4; k++) {
+      if (empty & (1 << k)) continue;
+      *o++ = ((i + k) << 16) | (n[i + k] > 0xFFFF ? 0xFFFF : n[i + k]);
+      *o++ = q[i + k];
+    }
+  }
+#endif
+
+  for (; i < nbins; i++) {
+    if (!n[i]) continue;
+    *o++ = (i << 16) | (n[i] > 0xFFFF ? 0xFFFF : n[i]);
+    *o++ = q[i];
+  }
+  return o - out;
+}
+
+#endif // EBRECORD_HXX_INCLUDE
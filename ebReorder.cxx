@@ -0,0 +1,170 @@
+/*****************************************************************************/
+/**
+\file ebReorder.cxx
+
+\section contents Contents
+Reorder window of a fragment thread
+
+\subsection notes Notes about this class
+Fragment thread only (one instance per EBFragment).  The slot of a serial
+number is serial % nslots: the window spans nslots consecutive serial
+numbers from the expected one, so a slot holds at most one of them.
+ *****************************************************************************/
+
+#include "ebReorder.hxx"
+
+#include <string.h>
+
+#include "ebMessage.hxx"
+#include "ebTrace.hxx"
+
+//---------------------------------------------------------------------------------
+EBReorderWindow::EBReorderWindow()
+: timeout_ms_(0), id_(-1), started_(false), expected_(0), nparked_(0), gap_since_(0)
+  , reordered_(0), missing_(0), dropped_(0)
+{
+  hold_.serial = 0;
+  hold_.full = false;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Set the window for the run (BOR)
+ *
+ * \param   [in]  nslots      events parked at most, 0 for no reordering
+ * \param   [in]  timeout_ms  wait for a missing event while others are parked
+ * \param   [in]  id          fragment ID, for the messages and the trace
+ */
+void EBReorderWindow::Configure(int nslots, int timeout_ms, int id)
+{
+  Slot empty;
+  empty.serial = 0;
+  empty.full = false;
+  slots_.assign((nslots > 0) ? nslots : 0, empty);
+  hold_.full = false;
+  timeout_ms_ = (timeout_ms > 0) ? timeout_ms : 0;
+  id_ = id;
+  started_ = false;
+  expected_ = 0;
+  nparked_ = 0;
+  gap_since_ = 0;
+  reordered_ = 0;
+  missing_ = 0;
+  dropped_ = 0;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Next event in serial number order, if it is already here
+ *
+ * Also moves the window on: the held event is parked once it fits, the
+ * expected event is given up on if it can't, or after the timeout.
+ *
+ * \param   [out] pdata  destination (ring buffer wp)
+ * \param   [in]  idle   nothing received by the caller: check the timeout
+ * \return  true if pdata holds the next event
+ */
+bool EBReorderWindow::Pop(char *pdata, bool idle)
+{
+  DWORD nslots = slots_.size();
+
+  for (;;) {
+    Slot &slot = slots_[expected_ % nslots];
+    if (slot.full && slot.serial == expected_) {
+      memcpy(pdata, &slot.event[0], slot.event.size());
+      slot.full = false;
+      nparked_--;
+      expected_++;
+      reordered_++;
+      gap_since_ = ss_millitime();
+      return true;
+    }
+
+    if (hold_.full) {
+      if (hold_.serial - expected_ < nslots) {
+        Slot &to = slots_[hold_.serial % nslots];
+        to.event.swap(hold_.event);
+        to.serial = hold_.serial;
+        to.full = true;
+        hold_.full = false;
+        nparked_++;
+      } else {
+        // Nothing parked before the held event: all the serial numbers up to it are gone
+        Skip(nparked_ ? 1 : hold_.serial - expected_);
+      }
+      continue;
+    }
+
+    if (idle && nparked_ > 0 && ss_millitime() - gap_since_ > (DWORD)timeout_ms_) {
+      Skip(1);
+      continue;
+    }
+    return false;
+  }
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Event just received
+ *
+ * \param   [in]  pdata  Midas event (ring buffer wp)
+ * \return  true if it is the next event in order; otherwise it has been
+ *          parked (or dropped, late or duplicate) and pdata is free again
+ */
+bool EBReorderWindow::Offer(char *pdata)
+{
+  DWORD serial = ((EVENT_HEADER *)pdata)->serial_number;
+
+  if (!started_) {
+    started_ = true;
+    expected_ = serial;
+  }
+  if (serial == expected_) {
+    expected_++;
+    if (nparked_) gap_since_ = ss_millitime();
+    return true;
+  }
+
+  int32_t ahead = (int32_t)(serial - expected_);
+  if (ahead < 0) {
+    dropped_++;     // given up on already, or duplicate
+    return false;
+  }
+
+  if (nparked_ == 0) gap_since_ = ss_millitime();
+  if ((DWORD)ahead < slots_.size()) {
+    Slot &slot = slots_[serial % slots_.size()];
+    if (slot.full) {
+      dropped_++;   // duplicate
+      return false;
+    }
+    Park(slot, pdata, serial);
+    nparked_++;
+  } else {
+    Park(hold_, pdata, serial);
+  }
+  EBTrace::Record(id_, EBTrace::kReorder, serial);
+  return false;
+}
+
+//---------------------------------------------------------------------------------
+/// Copy an event into a slot
+void EBReorderWindow::Park(Slot &slot, const char *pevent, DWORD serial)
+{
+  DWORD size = ((const EVENT_HEADER *)pevent)->data_size + sizeof(EVENT_HEADER);
+  slot.event.assign(pevent, pevent + size);
+  slot.serial = serial;
+  slot.full = true;
+}
+
+//---------------------------------------------------------------------------------
+/// Give up on the next n serial numbers
+void EBReorderWindow::Skip(DWORD n)
+{
+  EB_POST(EBMessage::kReorder, EBMSG_STDOUT, "EBReorderWindow"
+                  , "Fragment ID %d: S/N %u-%u missing, %d events parked", id_, expected_, expected_ + n - 1, nparked_);
+  EBTrace::Record(id_, EBTrace::kSNMismatch, expected_);
+  missing_ += n;
+  expected_ += n;
+  gap_since_ = ss_millitime();
+}
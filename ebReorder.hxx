@@ -0,0 +1,72 @@
+/*****************************************************************************/
+/**
+\file ebReorder.hxx
+
+## Contents
+
+Reorder window of a fragment thread.  Multi-threaded front-ends may send
+their events slightly out of serial number order; the ring buffer records
+can only be released in order, so the fragment thread puts them back in
+order before they go into the ring buffer.
+
+An event ahead of the expected serial number is parked in slot
+serial % nslots (a copy, kept until its turn comes).  The expected event is
+declared missing when the window can't hold an event any more, or when
+nothing came in for "timeout" ms while events were parked; the thread then
+moves on to the next serial number.  Late events (serial number already
+given up on) and duplicates are dropped.  Events in order only pay for the
+serial number compare.
+ *****************************************************************************/
+
+#ifndef EBREORDER_HXX_INCLUDE
+#define EBREORDER_HXX_INCLUDE
+
+#include <stdint.h>
+#include <vector>
+
+#include "midas.h"
+
+class EBReorderWindow
+{
+
+public:
+
+  EBReorderWindow();
+
+  void Configure(int nslots, int timeout_ms, int id);   //!< BOR; 0 slots: events taken as they come
+  bool IsEnabled() const { return !slots_.empty(); }
+
+  /// Next event in order into pdata: parked one, or expected one given up on. idle: nothing received
+  bool Pop(char *pdata, bool idle);
+  /// Event just received in pdata; true if it is the next one, otherwise parked or dropped
+  bool Offer(char *pdata);
+
+  uint64_t GetReordered() const { return reordered_; }  //!< Events delivered from the window
+  uint64_t GetMissing() const { return missing_; }      //!< Serial numbers given up on
+  uint64_t GetDropped() const { return dropped_; }      //!< Late or duplicate events
+
+private:
+
+  struct Slot {
+    std::vector<char> event;       //!< Copy of the Midas event, reused
+    DWORD serial;
+    bool full;
+  };
+
+  void Park(Slot &slot, const char *pevent, DWORD serial);
+  void Skip(DWORD n);
+
+  std::vector<Slot> slots_;
+  Slot hold_;                      //!< Event beyond the window, parked once the window moves
+  int timeout_ms_;
+  int id_;                         //!< Fragment ID
+  bool started_;                   //!< expected_ set by the first event of the run
+  DWORD expected_;                 //!< Serial number of the next event to deliver
+  int nparked_;
+  DWORD gap_since_;                //!< ss_millitime() of the last progress while events are parked
+  uint64_t reordered_;
+  uint64_t missing_;
+  uint64_t dropped_;
+};
+
+#endif // EBREORDER_HXX_INCLUDE
@@ -0,0 +1,139 @@
+/*****************************************************************************/
+/**
+\file ebRouter.cxx
+
+\section contents Contents
+Trigger-class routing of the built events to several output buffers
+
+\subsection notes Notes about this class
+Main (assembly) thread only.  The events routed away from the equipment
+buffer are sent from the assembly with bm_send_event(), or
+bm_send_event_sg() on the scatter-gather path.
+ *****************************************************************************/
+
+#include "ebRouter.hxx"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ebMessage.hxx"
+
+//---------------------------------------------------------------------------------
+EBRouter::EBRouter()
+{
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Read the routes and open their buffers (BOR)
+ *
+ * \param   [in]  hDB             ODB handle
+ * \param   [in]  hKey            routing settings key
+ * \param   [in]  default_buffer  equipment buffer: a route to it is no route
+ * \return  false if a buffer can't be opened
+ */
+bool EBRouter::Configure(HNDLE hDB, HNDLE hKey, const char *default_buffer)
+{
+  Close();
+
+  for (int i = 0; i < EBROUTE_MAX; i++) {
+    char key[64];
+    char name[NAME_LENGTH] = "";
+    INT bits = 0;
+    BOOL wait = FALSE;
+    int size;
+
+    sprintf(key, "Route %d/Buffer", i + 1);
+    size = sizeof(name);
+    db_get_value(hDB, hKey, key, name, &size, TID_STRING, TRUE);
+    sprintf(key, "Route %d/Trigger bits", i + 1);
+    size = sizeof(bits);
+    db_get_value(hDB, hKey, key, &bits, &size, TID_INT, TRUE);
+    sprintf(key, "Route %d/Wait when full", i + 1);
+    size = sizeof(wait);
+    db_get_value(hDB, hKey, key, &wait, &size, TID_BOOL, TRUE);
+    if (!name[0] || !bits || !strcmp(name, default_buffer)) continue;
+
+    Route_t r;
+    r.name = name;
+    r.trigger_bits = bits;
+    r.wait = wait;
+    r.events = r.bytes = r.dropped = 0;
+    int status = bm_open_buffer(name, DEFAULT_BUFFER_SIZE, &r.hbuf);
+    if (status != BM_SUCCESS && status != BM_CREATED) {
+      cm_msg(MERROR, "EBRouter", "Cannot open buffer %s for trigger bits 0x%x, status %d", name, bits, status);
+      Close();
+      return false;
+    }
+    routes_.push_back(r);
+    cm_msg(MINFO, "EBRouter", "Trigger bits 0x%x to buffer %s%s", bits, name, wait ? "" : ", dropped when full");
+  }
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+void EBRouter::Close()
+{
+  for (unsigned int i = 0; i < routes_.size(); i++) {
+    bm_flush_cache(routes_[i].hbuf, BM_WAIT);
+    bm_close_buffer(routes_[i].hbuf);
+  }
+  routes_.clear();
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Route of an event
+ *
+ * \param   [in]  trigger   DTM trigger bits, 0xFFFFFFFF if unknown
+ * \return  route index, -1 for the equipment buffer
+ */
+int EBRouter::Route(DWORD trigger) const
+{
+  if (trigger == 0xFFFFFFFF) return -1;
+  for (unsigned int i = 0; i < routes_.size(); i++)
+    if (trigger & routes_[i].trigger_bits) return i;
+  return -1;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Send a built event to the buffer of its route
+ *
+ * \return  true if sent, false if dropped (buffer full) or on error
+ */
+bool EBRouter::Send(int route, const EVENT_HEADER *pevent)
+{
+  Route_t &r = routes_[route];
+  DWORD size = sizeof(EVENT_HEADER) + pevent->data_size;
+  int status = bm_send_event(r.hbuf, pevent, size, r.wait ? BM_WAIT : BM_NO_WAIT);
+  return Sent(r, status, size, pevent->serial_number);
+}
+
+//---------------------------------------------------------------------------------
+/// Same, the event in pieces (header first)
+bool EBRouter::Send(int route, int n, const char *const *ptr, const size_t *len)
+{
+  Route_t &r = routes_[route];
+  DWORD size = 0;
+  for (int i = 0; i < n; i++) size += len[i];
+  int status = bm_send_event_sg(r.hbuf, n, ptr, len, r.wait ? BM_WAIT : BM_NO_WAIT);
+  return Sent(r, status, size, ((const EVENT_HEADER *)ptr[0])->serial_number);
+}
+
+//---------------------------------------------------------------------------------
+/// Counters and error message of one send
+bool EBRouter::Sent(Route_t &r, int status, DWORD size, DWORD serial)
+{
+  if (status == BM_SUCCESS) {
+    r.events++;
+    r.bytes += size;
+    return true;
+  }
+  if (status == BM_ASYNC_RETURN) {
+    r.dropped++;
+  } else {
+    EB_POST(EBMessage::kOther, MT_ERROR, "EBRouter", "bm_send_event error %d to %s, SN: %d", status, r.name.c_str(), serial);
+  }
+  return false;
+}
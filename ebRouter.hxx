@@ -0,0 +1,71 @@
+/*****************************************************************************/
+/**
+\file ebRouter.hxx
+
+## Contents
+
+Trigger-class routing of the built events.  Up to EBROUTE_MAX routes under
+Settings/Routing, each an output buffer and the DTM trigger bits (DTRG
+trigger word, bits 16-23) of the events it takes:
+
+    Route n/Buffer          buffer name, "" for no route
+    Route n/Trigger bits    events with one of these bits go to this buffer
+    Route n/Wait when full  FALSE: the event is dropped (and counted) when
+                            the buffer is full, so that a slow stream never
+                            holds up the others
+
+The first matching route wins; the other events, and those without a DTRG
+bank, go to the equipment buffer (SYSTEM) as before.  Each buffer has its
+own logger, and its own backpressure.
+ *****************************************************************************/
+
+#ifndef EBROUTER_HXX_INCLUDE
+#define EBROUTER_HXX_INCLUDE
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "midas.h"
+
+#define EBROUTE_MAX   4     //!< Routes besides the equipment buffer
+
+class EBRouter
+{
+
+public:
+
+  EBRouter();
+
+  bool Configure(HNDLE hDB, HNDLE hKey, const char *default_buffer);   //!< BOR: open the buffers, false on error
+  void Close();                                 //!< EOR: flush and close the buffers
+  bool IsEnabled() const { return !routes_.empty(); }
+
+  int Route(DWORD trigger) const;               //!< Route of an event, -1: equipment buffer
+  bool Send(int route, const EVENT_HEADER *pevent);
+  bool Send(int route, int n, const char *const *ptr, const size_t *len);   //!< Scatter-gather
+
+  int GetNumRoutes() const { return routes_.size(); }
+  const char *GetBufferName(int route) const { return routes_[route].name.c_str(); }
+  uint64_t GetEvents(int route) const { return routes_[route].events; }
+  uint64_t GetBytes(int route) const { return routes_[route].bytes; }
+  uint64_t GetDropped(int route) const { return routes_[route].dropped; }
+
+private:
+
+  struct Route_t {
+    std::string name;
+    INT hbuf;
+    DWORD trigger_bits;
+    BOOL wait;
+    uint64_t events;
+    uint64_t bytes;
+    uint64_t dropped;    //!< Buffer full, not waiting
+  };
+
+  bool Sent(Route_t &r, int status, DWORD size, DWORD serial);
+
+  std::vector<Route_t> routes_;
+};
+
+#endif // EBROUTER_HXX_INCLUDE
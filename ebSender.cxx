@@ -0,0 +1,446 @@
+/*****************************************************************************/
+/**
+\file ebSender.cxx
+
+\section contents Contents
+Asynchronous output stage
+
+\subsection notes Notes about this class
+The output ring is a MIDAS rb_* ring buffer: the assembly (mfe main thread)
+is the only writer, the sender thread the only reader.  The sender takes up
+to "batch" events back to back, sends them with bm_send_event() and flushes
+the buffer write cache once per batch.  A full output buffer is retried
+every millisecond so that Stop() can give up on a dead consumer.
+
+With packing on, the events are copied from the ring into one container
+(ebPacked.hxx) until it holds "max events", would go over "max bytes", or
+the ring has stayed empty for "max delay" since the first one; an event too
+large for any container is sent on its own.  The copy is small next to the
+buffer manager and logger cost saved on small events.
+
+With compression on, the events are copied from the ring into the
+EBCompressor pipeline and sent in the same order once compressed.  Packing
+is for small events and compression for large ones: compression wins if
+both are set.
+
+With the disk writer, Send() hands the events (or containers) to
+EBDiskWriter::Write() in the sender thread; one in "Monitor prescale" is
+also put in the output buffer with BM_NO_WAIT, so that a slow analyzer
+never holds up the writing.  If the writer fails, Send() falls back to the
+output buffer.
+
+Stop() is called at EOR once the fragment threads are joined: the events
+still in the ring go out before end_of_run() returns, in front of the
+end-of-run transition.
+ *****************************************************************************/
+
+#include "ebSender.hxx"
+
+#include <stdio.h>
+#include <time.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ebMessage.hxx"
+#include "ebPacked.hxx"
+#include "ebWriter.hxx"
+
+int EBSender::hbuf_ = -1;
+int EBSender::rb_handle_ = -1;
+int EBSender::ring_size_ = 0;
+int EBSender::batch_ = 1;
+int EBSender::pack_events_ = 0;
+int EBSender::pack_bytes_ = 0;
+int EBSender::pack_delay_ms_ = 0;
+int EBSender::pack_limit_ = 0;
+char *EBSender::pack_buf_ = NULL;
+std::vector<DWORD> EBSender::pack_index_;
+int EBSender::zip_workers_ = 0;
+int EBSender::zip_level_ = 1;
+int EBSender::zip_min_bytes_ = 0;
+EBCompressor EBSender::compressor_;
+EBDiskWriter *EBSender::writer_ = NULL;
+int EBSender::monitor_prescale_ = 0;
+uint64_t EBSender::nwritten_ = 0;
+std::atomic<uint64_t> EBSender::queued_(0);
+std::atomic<uint64_t> EBSender::sent_(0);
+std::atomic<uint64_t> EBSender::batches_(0);
+std::atomic<uint64_t> EBSender::containers_(0);
+std::atomic<uint64_t> EBSender::assembly_wait_us_(0);
+std::atomic<uint64_t> EBSender::sender_wait_us_(0);
+std::atomic<uint64_t> EBSender::monitor_sent_(0);
+std::atomic<uint64_t> EBSender::monitor_dropped_(0);
+std::atomic<uint64_t> EBSender::uncompressed_(0);
+pthread_t EBSender::tid_;
+std::atomic<bool> EBSender::running_(false);
+std::atomic<bool> EBSender::abort_(false);
+
+//---------------------------------------------------------------------------------
+static uint64_t MonotonicUs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Multi-event packing parameters, for the next Start()
+ *
+ * \param   [in]  max_events    built events per container (<= 1: no packing)
+ * \param   [in]  max_bytes     container size limit (capped at the max event size)
+ * \param   [in]  max_delay_ms  how long a container may wait to be filled
+ */
+void EBSender::SetPacking(int max_events, int max_bytes, int max_delay_ms)
+{
+  pack_events_ = max_events;
+  pack_bytes_ = max_bytes;
+  pack_delay_ms_ = (max_delay_ms > 0) ? max_delay_ms : 0;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Waveform bank compression parameters, for the next Start()
+ *
+ * \param   [in]  nworkers   compression threads (<= 0: no compression)
+ * \param   [in]  level      zlib level, 1 (fast) to 9
+ * \param   [in]  min_bytes  smallest W2xx/W4xx bank compressed
+ */
+void EBSender::SetCompression(int nworkers, int level, int min_bytes)
+{
+  zip_workers_ = nworkers;
+  zip_level_ = (level >= 1 && level <= 9) ? level : 1;
+  zip_min_bytes_ = min_bytes;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Disk writer for the next Start(), already opened
+ *
+ * \param   [in]  writer   NULL: the events go to the output buffer
+ */
+void EBSender::SetWriter(EBDiskWriter *writer)
+{
+  writer_ = writer;
+  monitor_prescale_ = writer ? writer->GetMonitorPrescale() : 0;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Create the output ring buffer and start the sender thread
+ *
+ * \param   [in]  hBuf       output buffer handle (equipment buffer)
+ * \param   [in]  ring_size  output ring buffer size in bytes
+ * \param   [in]  max_event  largest event
+ * \param   [in]  batch      max events per output buffer flush
+ * \return  true if the sender is running
+ */
+bool EBSender::Start(int hBuf, int ring_size, int max_event, int batch)
+{
+  if (running_) Stop();
+
+  hbuf_ = hBuf;
+  ring_size_ = ring_size;
+  batch_ = (batch > 0) ? batch : 1;
+  queued_ = 0;
+  sent_ = 0;
+  batches_ = 0;
+  containers_ = 0;
+  assembly_wait_us_ = 0;
+  sender_wait_us_ = 0;
+  monitor_sent_ = 0;
+  monitor_dropped_ = 0;
+  uncompressed_ = 0;
+  nwritten_ = 0;
+  abort_ = false;
+
+  if (rb_create(ring_size, max_event, &rb_handle_) != DB_SUCCESS) {
+    cm_msg(MERROR, "EBSender::Start", "Cannot create the output ring buffer (%d bytes)", ring_size);
+    rb_handle_ = -1;
+    return false;
+  }
+
+  if (zip_workers_ > 0) {
+    if (pack_events_ > 1) {
+      cm_msg(MINFO, "EBSender::Start", "Compression on: no multi-event packing");
+      pack_events_ = 0;
+    }
+    if (!compressor_.Start(zip_workers_, zip_level_, zip_min_bytes_, max_event))
+      cm_msg(MERROR, "EBSender::Start", "Compression off: no worker");
+  }
+
+  if (pack_events_ > 1) {
+    // Room for the container headers and the index bank
+    int overhead = sizeof(EVENT_HEADER) + sizeof(BANK_HEADER) + 2*sizeof(BANK32) + 8
+                   + (EB_PACKED_INDEX_HEAD + 2*pack_events_) * sizeof(DWORD);
+    pack_limit_ = (pack_bytes_ > 0 && pack_bytes_ < max_event) ? pack_bytes_ : max_event;
+    pack_limit_ -= overhead;
+    pack_index_.resize(EB_PACKED_INDEX_HEAD + 2*pack_events_);
+    pack_buf_ = (char *)malloc(max_event);
+    if (pack_limit_ <= 0 || !pack_buf_) {
+      cm_msg(MERROR, "EBSender::Start", "Packing off: %d events do not fit in %d bytes", pack_events_, max_event);
+      pack_events_ = 0;
+    }
+  }
+
+  running_ = true;
+  if (pthread_create(&tid_, NULL, &SenderThread, NULL)) {
+    running_ = false;
+    compressor_.Stop();
+    rb_delete(rb_handle_);
+    rb_handle_ = -1;
+    free(pack_buf_);
+    pack_buf_ = NULL;
+    cm_msg(MERROR, "EBSender::Start", "Cannot create sender thread");
+    return false;
+  }
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+void EBSender::Stop(int timeout_ms)
+{
+  if (rb_handle_ < 0) return;
+
+  // Let the sender send everything, then make it give up
+  int level = 0;
+  for (int i = 0; i < timeout_ms; i++) {
+    rb_get_buffer_level(rb_handle_, &level);
+    if (level == 0 && sent_.load() == queued_.load()) break;
+    usleep(1000);
+  }
+  if (sent_.load() != queued_.load()) {
+    cm_msg(MERROR, "EBSender::Stop", "Output buffer blocked, %llu events not sent"
+           , (unsigned long long)(queued_.load() - sent_.load()));
+    abort_ = true;
+  }
+
+  running_ = false;
+  pthread_join(tid_, NULL);
+  compressor_.Stop();
+  rb_delete(rb_handle_);
+  rb_handle_ = -1;
+  free(pack_buf_);
+  pack_buf_ = NULL;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Room in the output ring for the next event (assembly)
+ *
+ * \param   [in]  timeout_ms  how long to wait for the sender to free some room
+ * \return  slot for a full event (EVENT_HEADER first), NULL on timeout
+ */
+EVENT_HEADER *EBSender::GetSlot(int timeout_ms)
+{
+  void *wp;
+  if (rb_get_wp(rb_handle_, &wp, 0) == DB_SUCCESS) return (EVENT_HEADER *)wp;
+
+  uint64_t start = MonotonicUs();
+  int status = rb_get_wp(rb_handle_, &wp, timeout_ms);
+  assembly_wait_us_ += MonotonicUs() - start;
+  return (status == DB_SUCCESS) ? (EVENT_HEADER *)wp : NULL;
+}
+
+//---------------------------------------------------------------------------------
+void EBSender::Commit(EVENT_HEADER *pevent)
+{
+  rb_increment_wp(rb_handle_, sizeof(EVENT_HEADER) + pevent->data_size);
+  queued_++;
+}
+
+//---------------------------------------------------------------------------------
+double EBSender::GetFillLevel()
+{
+  int level = 0;
+  if (rb_handle_ < 0 || ring_size_ <= 0) return 0;
+  rb_get_buffer_level(rb_handle_, &level);
+  return 100.0 * level / ring_size_;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Put one event in the output buffer, waiting while it is full
+ *
+ * With the disk writer: write it, and put one in monitor_prescale_ in the
+ * output buffer if there is room.
+ */
+int EBSender::Send(EVENT_HEADER *pevent)
+{
+  int status;
+  if (writer_ && writer_->Write(pevent)) {
+    if (monitor_prescale_ > 0 && (nwritten_++ % monitor_prescale_) == 0) {
+      status = bm_send_event(hbuf_, pevent, sizeof(EVENT_HEADER) + pevent->data_size, BM_NO_WAIT);
+      if (status == BM_SUCCESS) monitor_sent_++;
+      else monitor_dropped_++;
+    }
+    return BM_SUCCESS;
+  }
+
+  uint64_t start = 0;
+  while ((status = bm_send_event(hbuf_, pevent, sizeof(EVENT_HEADER) + pevent->data_size, BM_NO_WAIT)) == BM_ASYNC_RETURN) {
+    if (abort_) break;
+    if (!start) start = MonotonicUs();
+    usleep(1000);
+  }
+  if (start) sender_wait_us_ += MonotonicUs() - start;
+  return status;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Pack the events from rp on in one container and send it
+ */
+void EBSender::SendPacked(void *rp)
+{
+  EVENT_HEADER *pfirst = (EVENT_HEADER *)rp;
+  DWORD size = sizeof(EVENT_HEADER) + pfirst->data_size;
+
+  // Too large to share a container
+  if ((int)size > pack_limit_) {
+    if (Send(pfirst) != BM_SUCCESS && !abort_)
+      EB_POST(EBMessage::kOther, MT_ERROR, "EBSender", "bm_send_event error, SN: %d", pfirst->serial_number);
+    rb_increment_rp(rb_handle_, size);
+    sent_++;
+    return;
+  }
+
+  EVENT_HEADER *pcont = (EVENT_HEADER *)pack_buf_;
+  memcpy(pcont, pfirst, sizeof(EVENT_HEADER));
+  char *pbh = (char *)(pcont + 1);
+  bk_init32(pbh);
+
+  char *pdata;
+  bk_create(pbh, EB_PACKED_DATA_BANK, TID_BYTE, (void **)&pdata);
+  char *pstart = pdata;
+  DWORD *index = &pack_index_[0];
+  int n = 0;
+  uint64_t deadline = MonotonicUs() + 1000 * (uint64_t)pack_delay_ms_;
+
+  for (;;) {
+    EVENT_HEADER *pevent = (EVENT_HEADER *)rp;
+    size = sizeof(EVENT_HEADER) + pevent->data_size;
+    if ((pdata - pstart) + size > (DWORD)pack_limit_) break;   // next container
+
+    memcpy(pdata, pevent, size);
+    index[EB_PACKED_INDEX_HEAD + 2*n] = pdata - pstart;
+    index[EB_PACKED_INDEX_HEAD + 2*n + 1] = size;
+    pdata += size;
+    pcont->time_stamp = pevent->time_stamp;
+    rb_increment_rp(rb_handle_, size);
+    if (++n == pack_events_) break;
+
+    // Next event, waiting for it until the deadline
+    int status;
+    while ((status = rb_get_rp(rb_handle_, &rp, 0)) != DB_SUCCESS && running_ && MonotonicUs() < deadline)
+      usleep(100);
+    if (status != DB_SUCCESS) break;
+  }
+  bk_close(pbh, pdata);
+
+  DWORD *pindex;
+  bk_create(pbh, EB_PACKED_INDEX_BANK, TID_DWORD, (void **)&pindex);
+  index[0] = EB_PACKED_VERSION;
+  index[1] = n;
+  memcpy(pindex, index, (EB_PACKED_INDEX_HEAD + 2*n) * sizeof(DWORD));
+  bk_close(pbh, pindex + EB_PACKED_INDEX_HEAD + 2*n);
+  pcont->data_size = bk_size(pbh);
+
+  if (Send(pcont) != BM_SUCCESS && !abort_)
+    EB_POST(EBMessage::kOther, MT_ERROR, "EBSender", "bm_send_event error, container SN: %d", pcont->serial_number);
+  sent_ += n;
+  containers_++;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Sender loop with the compression stage
+ *
+ * Feeds the compressor in ring order and sends what comes back (in the
+ * same order), a batch at a time.  An event too large for the pipeline
+ * slots is sent as it is, once the events before it are out.  Runs until
+ * Stop() and the pipeline is empty.
+ */
+void EBSender::RunCompressed()
+{
+  void *rp;
+
+  while (running_ || compressor_.GetPending()) {
+    // Feed the workers; the ring space is free once the event is copied in
+    bool fed = false;
+    while (rb_get_rp(rb_handle_, &rp, 0) == DB_SUCCESS) {
+      EVENT_HEADER *pevent = (EVENT_HEADER *)rp;
+      if (!compressor_.Fits(pevent)) {
+        if (compressor_.GetPending()) break;
+        EB_POST(EBMessage::kOther, MT_ERROR, "EBSender", "Event of %u bytes too large for the compressor, sent uncompressed, SN: %d"
+                        , (unsigned int)(sizeof(EVENT_HEADER) + pevent->data_size), pevent->serial_number);
+        int status = Send(pevent);
+        if (status != BM_SUCCESS && !abort_)
+          EB_POST(EBMessage::kOther, MT_ERROR, "EBSender", "bm_send_event error %d, SN: %d", status, pevent->serial_number);
+        uncompressed_++;
+        sent_++;
+      } else if (!compressor_.Submit(pevent)) {
+        break;
+      }
+      rb_increment_rp(rb_handle_, sizeof(EVENT_HEADER) + pevent->data_size);
+      fed = true;
+    }
+
+    // Send the oldest events once compressed
+    int n = 0;
+    EVENT_HEADER *pevent;
+    while (n < batch_ && (pevent = compressor_.Next(n ? 0 : 1)) != NULL) {
+      int status = Send(pevent);
+      if (status != BM_SUCCESS && !abort_)
+        EB_POST(EBMessage::kOther, MT_ERROR, "EBSender", "bm_send_event error %d, SN: %d", status, pevent->serial_number);
+      compressor_.Release();
+      sent_++;
+      n++;
+    }
+    if (n) {
+      bm_flush_cache(hbuf_, BM_NO_WAIT);
+      batches_++;
+    } else if (!fed && !compressor_.GetPending()) {
+      // Nothing anywhere: wait for the assembly
+      rb_get_rp(rb_handle_, &rp, 100);
+    }
+  }
+}
+
+//---------------------------------------------------------------------------------
+void *EBSender::SenderThread(void *)
+{
+  void *rp;
+
+  if (compressor_.IsRunning()) {
+    RunCompressed();
+    return NULL;
+  }
+
+  while (running_) {
+    if (rb_get_rp(rb_handle_, &rp, 100) != DB_SUCCESS) continue;
+
+    if (pack_events_ > 1) {
+      SendPacked(rp);
+      bm_flush_cache(hbuf_, BM_NO_WAIT);
+      batches_++;
+      continue;
+    }
+
+    // One batch: the events already there, up to batch_
+    int n = 0;
+    do {
+      EVENT_HEADER *pevent = (EVENT_HEADER *)rp;
+      int status = Send(pevent);
+      if (status != BM_SUCCESS && !abort_)
+        EB_POST(EBMessage::kOther, MT_ERROR, "EBSender", "bm_send_event error %d, SN: %d", status, pevent->serial_number);
+      rb_increment_rp(rb_handle_, sizeof(EVENT_HEADER) + pevent->data_size);
+      sent_++;
+    } while (++n < batch_ && rb_get_rp(rb_handle_, &rp, 0) == DB_SUCCESS);
+
+    bm_flush_cache(hbuf_, BM_NO_WAIT);
+    batches_++;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,101 @@
+/*****************************************************************************/
+/**
+\file ebSender.hxx
+
+## Contents
+
+Asynchronous output stage of the event builder.  The assembly builds each
+event in a slot of the output ring buffer and goes on with the next one; a
+sender thread passes the completed events to the output (SYSTEM) buffer in
+batches, so a full output buffer stalls the sender, not the assembly.
+Optionally, it packs several built events in one container (ebPacked.hxx),
+or has the waveform banks compressed by a worker pool (ebCompressor.hxx).
+With the disk writer (ebWriter.hxx), what would go to the output buffer is
+written to local files instead, a sample of it still going to the buffer.
+ *****************************************************************************/
+
+#ifndef EBSENDER_HXX_INCLUDE
+#define EBSENDER_HXX_INCLUDE
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+#include "midas.h"
+#include "ebCompressor.hxx"
+
+class EBDiskWriter;
+
+/**
+ * Static interface; one output stage per frontend, started at BOR.
+ */
+class EBSender
+{
+
+public:
+
+  static bool Start(int hBuf, int ring_size, int max_event, int batch);  //!< Create the ring, start the sender
+  static void SetPacking(int max_events, int max_bytes, int max_delay_ms);  //!< Before Start(); max_events <= 1: off
+  static void SetCompression(int nworkers, int level, int min_bytes);       //!< Before Start(); nworkers <= 0: off
+  static void SetWriter(EBDiskWriter *writer);  //!< Before Start(), opened; NULL: off
+  static void Stop(int timeout_ms = 10000);     //!< Send what is queued and stop the sender
+  static bool IsRunning() { return running_; }
+
+  static EVENT_HEADER *GetSlot(int timeout_ms); //!< Assembly: room for the next event, NULL if full
+  static void Commit(EVENT_HEADER *pevent);     //!< Assembly: the event in the slot is complete
+
+  static uint64_t GetQueued() { return queued_.load(); }
+  static uint64_t GetSent() { return sent_.load(); }
+  static uint64_t GetBatches() { return batches_.load(); }
+  static uint64_t GetContainers() { return containers_.load(); }
+  static uint64_t GetBytesIn() { return compressor_.GetBytesIn(); }     //!< Before compression
+  static uint64_t GetBytesOut() { return compressor_.GetBytesOut(); }   //!< After compression
+  static uint64_t GetUncompressed() { return uncompressed_.load(); }    //!< Events too large for the compressor, sent as they are
+  static double GetAssemblyWait() { return assembly_wait_us_.load() * 1e-6; }  //!< s, output ring full
+  static double GetSenderWait() { return sender_wait_us_.load() * 1e-6; }      //!< s, output buffer full
+  static double GetFillLevel();                 //!< Output ring level in percent
+  static uint64_t GetMonitorSent() { return monitor_sent_.load(); }        //!< Disk writer: sampled events in the output buffer
+  static uint64_t GetMonitorDropped() { return monitor_dropped_.load(); }  //!< Output buffer full
+
+private:
+
+  static void *SenderThread(void *);
+  static int Send(EVENT_HEADER *pevent);
+  static void SendPacked(void *rp);
+  static void RunCompressed();
+
+  static int hbuf_;                              //!< Output (SYSTEM) buffer handle
+  static int rb_handle_;                         //!< Output ring buffer
+  static int ring_size_;
+  static int batch_;                             //!< Max events per output buffer flush
+  static int pack_events_;                       //!< Max built events per container (<= 1: no packing)
+  static int pack_bytes_;                        //!< Max container size
+  static int pack_delay_ms_;                     //!< Max wait for the container to fill
+  static int pack_limit_;                        //!< Room for built events in a container
+  static char *pack_buf_;                        //!< Container being composed (sender only)
+  static std::vector<DWORD> pack_index_;         //!< Its index (sender only)
+  static int zip_workers_;                       //!< Compression threads (<= 0: no compression)
+  static int zip_level_;                         //!< zlib level
+  static int zip_min_bytes_;                     //!< Smallest waveform bank compressed
+  static EBCompressor compressor_;
+  static EBDiskWriter *writer_;                  //!< Events to local files (NULL: off)
+  static int monitor_prescale_;                  //!< One written event in n also to the output buffer
+  static uint64_t nwritten_;                     //!< Sender only
+
+  static std::atomic<uint64_t> queued_;          //!< Events committed by the assembly
+  static std::atomic<uint64_t> sent_;            //!< Events in the output buffer
+  static std::atomic<uint64_t> batches_;         //!< Output buffer flushes
+  static std::atomic<uint64_t> containers_;      //!< Packed container events sent
+  static std::atomic<uint64_t> assembly_wait_us_;
+  static std::atomic<uint64_t> sender_wait_us_;
+  static std::atomic<uint64_t> monitor_sent_;
+  static std::atomic<uint64_t> monitor_dropped_;
+  static std::atomic<uint64_t> uncompressed_;
+
+  static pthread_t tid_;
+  static std::atomic<bool> running_;
+  static std::atomic<bool> abort_;               //!< Stop() timed out: drop what is left
+};
+
+#endif // EBSENDER_HXX_INCLUDE
@@ -0,0 +1,160 @@
+/*****************************************************************************/
+/**
+\file ebShedder.cxx
+
+\section contents Contents
+Load shedding by DTM trigger bit, driven by the ring buffer fill level
+
+\subsection notes Notes about this class
+Main (assembly) thread only.  One step per update at most, so that a
+prescale change has an interval to show in the ring buffer levels before
+the next one.
+ *****************************************************************************/
+
+#include "ebShedder.hxx"
+
+#include <stdio.h>
+
+//---------------------------------------------------------------------------------
+EBLoadShedder::EBLoadShedder()
+: enabled_(FALSE), interval_(500), high_(60.), low_(30.), max_prescale_(64)
+  , hold_(4), below_(0), last_update_(0), fill_(0.), shed_(0), kept_(0), steps_(0)
+{
+  for (int i = 0; i < EBLS_NTRIGGERS; i++) {
+    priority_[i] = 1;
+    prescale_[i] = 1;
+    count_[i] = 0;
+  }
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Read the settings, prescales back to 1 (BOR)
+ *
+ * \param   [in]  hDB    ODB handle
+ * \param   [in]  hKey   load shedding settings key
+ */
+void EBLoadShedder::Configure(HNDLE hDB, HNDLE hKey)
+{
+  int size;
+
+  size = sizeof(enabled_);
+  db_get_value(hDB, hKey, "Enable", &enabled_, &size, TID_BOOL, TRUE);
+  size = sizeof(interval_);
+  db_get_value(hDB, hKey, "Interval (ms)", &interval_, &size, TID_INT, TRUE);
+  size = sizeof(high_);
+  db_get_value(hDB, hKey, "High level (%)", &high_, &size, TID_DOUBLE, TRUE);
+  size = sizeof(low_);
+  db_get_value(hDB, hKey, "Low level (%)", &low_, &size, TID_DOUBLE, TRUE);
+  size = sizeof(max_prescale_);
+  db_get_value(hDB, hKey, "Max prescale", &max_prescale_, &size, TID_INT, TRUE);
+  size = sizeof(hold_);
+  db_get_value(hDB, hKey, "Hold intervals", &hold_, &size, TID_INT, TRUE);
+  size = sizeof(priority_);
+  db_get_value(hDB, hKey, "Priority", priority_, &size, TID_INT, TRUE);
+
+  if (interval_ < 10) interval_ = 10;
+  if (max_prescale_ < 1) max_prescale_ = 1;
+  for (int i = 0; i < EBLS_NTRIGGERS; i++) {
+    prescale_[i] = 1;
+    count_[i] = 0;
+  }
+  below_ = 0;
+  last_update_ = 0;
+  fill_ = 0.;
+  shed_ = 0;
+  kept_ = 0;
+  steps_ = 0;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Ramp the prescales with the fill level of the fullest ring buffer
+ *
+ * \param   [in]  now    ss_millitime()
+ * \param   [in]  fill   fill level (%)
+ */
+void EBLoadShedder::Update(DWORD now, double fill)
+{
+  last_update_ = now;
+  fill_ = fill;
+
+  // Quick to shed, slow to give it back: the levels drop as soon as events are shed
+  bool changed = false;
+  below_ = (fill < low_) ? below_ + 1 : 0;
+  if (fill > high_) {
+    changed = StepUp();
+  } else if (below_ >= hold_) {
+    changed = StepDown();
+    below_ = 0;
+  }
+  if (!changed) return;
+
+  steps_++;
+  char text[128];
+  int n = 0;
+  for (int i = 0; i < EBLS_NTRIGGERS; i++)
+    n += sprintf(text + n, " %u", prescale_[i]);
+  cm_msg(MINFO, "EBLoadShedder", "Ring buffers %.0f%% full, prescales by DTM trigger bit:%s", fill, text);
+}
+
+//---------------------------------------------------------------------------------
+/// Double the prescales of the highest priority value not at the max yet
+bool EBLoadShedder::StepUp()
+{
+  int pmax = 0;
+  for (int i = 0; i < EBLS_NTRIGGERS; i++)
+    if (priority_[i] > pmax && prescale_[i] < (DWORD)max_prescale_) pmax = priority_[i];
+  if (pmax == 0) return false;
+
+  for (int i = 0; i < EBLS_NTRIGGERS; i++)
+    if (priority_[i] == pmax && prescale_[i] < (DWORD)max_prescale_)
+      prescale_[i] = (2 * prescale_[i] < (DWORD)max_prescale_) ? 2 * prescale_[i] : max_prescale_;
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+/// Halve the prescales of the lowest priority value still prescaled
+bool EBLoadShedder::StepDown()
+{
+  int pmin = 0;
+  for (int i = 0; i < EBLS_NTRIGGERS; i++)
+    if (prescale_[i] > 1 && (pmin == 0 || priority_[i] < pmin)) pmin = priority_[i];
+  if (pmin == 0) return false;
+
+  for (int i = 0; i < EBLS_NTRIGGERS; i++)
+    if (priority_[i] == pmin && prescale_[i] > 1) prescale_[i] /= 2;
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Decision for one event
+ *
+ * \param   [in]  trigger   DTM trigger bits of the event, 0xFFFFFFFF if unknown (kept)
+ * \param   [out] prescale  prescale applied (lowest of the trigger bits)
+ * \return  true if the event is kept
+ */
+bool EBLoadShedder::Keep(DWORD trigger, DWORD *prescale)
+{
+  bool keep = false;
+  DWORD applied = 0;
+
+  if (trigger != 0xFFFFFFFF) {
+    for (int i = 0; i < EBLS_NTRIGGERS; i++) {
+      if (!(trigger & (1 << i))) continue;
+      if ((count_[i]++ % prescale_[i]) == 0) keep = true;
+      if (applied == 0 || prescale_[i] < applied) applied = prescale_[i];
+    }
+  }
+  if (applied == 0) {
+    // Unknown trigger or none of the 8 bits: not prescaled
+    keep = true;
+    applied = 1;
+  }
+
+  *prescale = applied;
+  if (keep) kept_++;
+  else shed_++;
+  return keep;
+}
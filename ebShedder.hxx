@@ -0,0 +1,79 @@
+/*****************************************************************************/
+/**
+\file ebShedder.hxx
+
+## Contents
+
+Load shedding of the assembly under sustained backpressure.  When the
+output can't keep up, the fragment ring buffers fill and the fragment
+threads stop reading at 75%: dead time then hits every trigger type alike.
+The shedder looks at the fullest ring buffer (the EBFR numbers) every
+"Interval (ms)" and prescales the events by DTM trigger bit (DTRG trigger
+word, bits 16-23) before their banks are merged:
+
+  - fill above "High level (%)": the trigger bits of the highest priority
+    value not at "Max prescale" yet have their prescale doubled
+  - fill below "Low level (%)" for "Hold intervals" updates in a row: the
+    trigger bits of the lowest priority value with a prescale have it halved
+  - priority 0: never prescaled (rare, high-priority triggers)
+
+An event is kept if one of its trigger bits keeps it.  Every built event
+gets an EBLS bank (TID_DWORD) for the livetime correction:
+
+    [0]  DTM trigger bits of the event (0xFFFFFFFF: no DTRG bank)
+    [1]  prescale applied to the event (lowest of its trigger bits)
+    [2]  fill level (%) of the fullest ring buffer at the last update
+ *****************************************************************************/
+
+#ifndef EBSHEDDER_HXX_INCLUDE
+#define EBSHEDDER_HXX_INCLUDE
+
+#include <stdint.h>
+
+#include "midas.h"
+
+#define EBLS_NTRIGGERS   8    //!< DTM trigger bits
+
+class EBLoadShedder
+{
+
+public:
+
+  EBLoadShedder();
+
+  void Configure(HNDLE hDB, HNDLE hKey);     //!< BOR, keys under hKey ("Load shedding")
+  bool IsEnabled() const { return enabled_; }
+  bool IsDue(DWORD now) const { return now - last_update_ >= (DWORD)interval_; }   //!< ss_millitime()
+  void Update(DWORD now, double fill);       //!< New fill level (%) of the fullest ring buffer
+
+  bool Keep(DWORD trigger, DWORD *prescale); //!< Decision for one event, applied prescale returned
+
+  DWORD GetPrescale(int bit) const { return prescale_[bit]; }
+  double GetFill() const { return fill_; }
+  uint64_t GetShed() const { return shed_; }     //!< Events dropped in this run
+  uint64_t GetKept() const { return kept_; }
+  int GetSteps() const { return steps_; }        //!< Prescale changes in this run
+
+private:
+
+  bool StepUp();
+  bool StepDown();
+
+  BOOL enabled_;
+  INT interval_;                             //!< ms between updates
+  double high_;                              //!< %
+  double low_;                               //!< %
+  INT max_prescale_;
+  INT hold_;                                 //!< Updates below low_ before a step down
+  int below_;                                //!< Updates below low_ in a row
+  INT priority_[EBLS_NTRIGGERS];             //!< 0: never shed, higher: shed first
+  DWORD prescale_[EBLS_NTRIGGERS];           //!< Current prescale per trigger bit, 1: all kept
+  DWORD count_[EBLS_NTRIGGERS];              //!< Events seen per trigger bit
+  DWORD last_update_;
+  double fill_;
+  uint64_t shed_;
+  uint64_t kept_;
+  int steps_;
+};
+
+#endif // EBSHEDDER_HXX_INCLUDE
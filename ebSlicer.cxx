@@ -0,0 +1,310 @@
+/*****************************************************************************/
+/**
+\file ebSlicer.cxx
+
+\section contents Contents
+Time-slice assembly: records placed in fixed windows by timestamp
+
+\subsection notes Notes about this class
+Main (assembly) thread only.  The records are copied out of the ring
+buffers into their slice as soon as the assembly sees them, so that the
+ring buffers never wait for a slice to close; the slice keeps them in the
+order they came and only its index is sorted, by fragment then time, when
+it is closed.  The event is then written in that order.
+
+The 30-bit timestamps wrap every 17 s: each fragment extends its own from
+the last one it sent (a step of less than half the range either way).  A
+fragment's first timestamp, or its first one after being idle, is extended
+from the latest one of any fragment instead, so that they all share the
+same 64-bit time line even if it was silent for more than half the range.
+ *****************************************************************************/
+
+#include "ebSlicer.hxx"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "ebRecord.hxx"
+
+//---------------------------------------------------------------------------------
+EBTimeSlicer::EBTimeSlicer()
+: length_(62500), disorder_(6250), idle_ms_(100), max_open_(64), max_event_(0)
+  , fragments_(0), start_time_(0), have_ref_(false), last_ext_(0), next_index_(0), forced_next_(false)
+  , slices_(0), records_(0), late_(0), nots_(0), overflow_(0), forced_(0)
+{
+}
+
+//---------------------------------------------------------------------------------
+EBTimeSlicer::~EBTimeSlicer()
+{
+  for (std::map<uint64_t, Slice_t *>::iterator it = open_.begin(); it != open_.end(); ++it)
+    delete it->second;
+  for (unsigned int i = 0; i < pool_.size(); i++)
+    delete pool_[i];
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Read the settings (BOR)
+ *
+ * \param   [in]  hDB        ODB handle
+ * \param   [in]  hKey       time slice settings key
+ * \param   [in]  max_event  largest event: limit of a slice
+ */
+void EBTimeSlicer::Configure(HNDLE hDB, HNDLE hKey, int max_event)
+{
+  INT length_us = 1000;
+  INT disorder_us = 100;
+  int size;
+
+  size = sizeof(length_us);
+  db_get_value(hDB, hKey, "Length (us)", &length_us, &size, TID_INT, TRUE);
+  size = sizeof(disorder_us);
+  db_get_value(hDB, hKey, "Max disorder (us)", &disorder_us, &size, TID_INT, TRUE);
+  size = sizeof(idle_ms_);
+  db_get_value(hDB, hKey, "Idle timeout (ms)", &idle_ms_, &size, TID_INT, TRUE);
+  size = sizeof(max_open_);
+  db_get_value(hDB, hKey, "Max open slices", &max_open_, &size, TID_INT, TRUE);
+
+  // 62.5 ticks of 16ns per us
+  if (length_us < 1) length_us = 1;
+  if (disorder_us < 0) disorder_us = 0;
+  length_ = (uint64_t)length_us * 125 / 2;
+  disorder_ = (uint64_t)disorder_us * 125 / 2;
+  if (max_open_ < 2) max_open_ = 2;
+  max_event_ = max_event;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   New run: no slice open, fragments without timestamps yet
+ *
+ * \param   [in]  fragments  fragment IDs taking part (bit n: ID n)
+ * \param   [in]  now        ss_millitime()
+ */
+void EBTimeSlicer::Start(uint64_t fragments, DWORD now)
+{
+  for (std::map<uint64_t, Slice_t *>::iterator it = open_.begin(); it != open_.end(); ++it) {
+    it->second->data.clear();
+    it->second->rec.clear();
+    pool_.push_back(it->second);
+  }
+  open_.clear();
+
+  frag_.assign(64, Frag_t());
+  for (unsigned int i = 0; i < frag_.size(); i++) {
+    frag_[i].started = false;
+    frag_[i].ext = 0;
+    frag_[i].watermark = 0;
+    frag_[i].last_seen = now;
+  }
+  fragments_ = fragments;
+  start_time_ = now;
+  have_ref_ = false;
+  last_ext_ = 0;
+  next_index_ = 0;
+  forced_next_ = false;
+  slices_ = records_ = late_ = nots_ = overflow_ = forced_ = 0;
+}
+
+//---------------------------------------------------------------------------------
+/// 30-bit trailer timestamp to the common 64-bit time line
+uint64_t EBTimeSlicer::Extend(Frag_t &f, DWORD ts30, DWORD now)
+{
+  bool own = f.started && now - f.last_seen <= (DWORD)idle_ms_;
+  uint64_t ref = own ? f.ext : (have_ref_ ? last_ext_ : ts30);
+  int64_t ext = (int64_t)ref + EBTsDiff(ts30, (DWORD)ref & EB_TS_MASK);
+  if (ext < 0) ext = 0;
+
+  f.started = true;
+  f.ext = ext;
+  if (f.ext > f.watermark) f.watermark = f.ext;
+  if (!have_ref_ || f.ext > last_ext_) last_ext_ = f.ext;
+  have_ref_ = true;
+  return f.ext;
+}
+
+//---------------------------------------------------------------------------------
+EBTimeSlicer::Slice_t *EBTimeSlicer::GetSlice(uint64_t index)
+{
+  std::map<uint64_t, Slice_t *>::iterator it = open_.find(index);
+  if (it != open_.end()) return it->second;
+
+  Slice_t *s;
+  if (pool_.empty()) {
+    s = new Slice_t;
+  } else {
+    s = pool_.back();
+    pool_.pop_back();
+  }
+  open_[index] = s;
+  return s;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Place a fragment record in its slice
+ *
+ * \param   [in]  frag   fragment ID
+ * \param   [in]  prec   record (EVENT_HEADER) in the ring buffer, released by the caller
+ * \param   [in]  now    ss_millitime()
+ */
+void EBTimeSlicer::Add(int frag, char *prec, DWORD now)
+{
+  Frag_t &f = frag_[frag];
+
+  EBRECORD_TRAILER *t = EBRecordTrailer(prec);
+  if (!(t->flags & EB_TRAILER_TS_VALID)) {
+    f.last_seen = now;
+    nots_++;
+    return;
+  }
+
+  uint64_t ts = Extend(f, t->ts_best, now);
+  f.last_seen = now;
+  uint64_t index = ts / length_;
+  if (slices_ && index < next_index_) {
+    late_++;
+    return;
+  }
+
+  Slice_t *s = GetSlice(index);
+  DWORD size = EBEventSize(prec);
+  // Event, bank headers, TSLC and TSLI banks included
+  size_t total = sizeof(EVENT_HEADER) + sizeof(BANK_HEADER) + 3 * (sizeof(BANK32) + 8) + 9 * sizeof(DWORD)
+                 + (s->rec.size() + 1) * 4 * sizeof(DWORD) + s->data.size() + size;
+  if (total > (size_t)max_event_) {
+    overflow_++;
+    if (s->rec.empty()) {
+      open_.erase(index);
+      pool_.push_back(s);
+    }
+    return;
+  }
+
+  Record_t r;
+  r.ts = ts;
+  r.frag = frag;
+  r.offset = s->data.size();
+  r.size = size;
+  s->data.insert(s->data.end(), prec, prec + size);
+  s->rec.push_back(r);
+}
+
+//---------------------------------------------------------------------------------
+/// Fragments not holding the slices back: idle, or without timestamps since BOR
+uint64_t EBTimeSlicer::IdleMask(DWORD now) const
+{
+  uint64_t mask = 0;
+  for (unsigned int i = 0; i < frag_.size(); i++) {
+    if (!(fragments_ & (1ULL << i))) continue;
+    const Frag_t &f = frag_[i];
+    if (now - f.last_seen > (DWORD)idle_ms_ || (!f.started && now - start_time_ > (DWORD)idle_ms_))
+      mask |= (1ULL << i);
+  }
+  return mask;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Watermark rule for the oldest open slice
+ *
+ * \return  true if no fragment still sending can have a record for it
+ */
+bool EBTimeSlicer::IsDue(DWORD now)
+{
+  if (open_.empty()) return false;
+  if ((int)open_.size() > max_open_) {
+    forced_next_ = true;
+    return true;
+  }
+
+  uint64_t end = (open_.begin()->first + 1) * length_;
+  uint64_t idle = IdleMask(now);
+  for (unsigned int i = 0; i < frag_.size(); i++) {
+    if (!(fragments_ & (1ULL << i)) || (idle & (1ULL << i))) continue;
+    const Frag_t &f = frag_[i];
+    if (!f.started) return false;            // not heard from yet
+    if (f.watermark < end + disorder_) return false;
+  }
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Close the oldest slice into the event, if due
+ *
+ * \param   [in]  pevent  event (after the EVENT_HEADER), bk_init32() done
+ * \param   [in]  now     ss_millitime()
+ * \param   [in]  flush   EOR: the oldest open slice, due or not
+ * \return  false if no slice is due
+ */
+bool EBTimeSlicer::Build(char *pevent, DWORD now, bool flush)
+{
+  if (flush ? open_.empty() : !IsDue(now)) return false;
+
+  std::map<uint64_t, Slice_t *>::iterator it = open_.begin();
+  uint64_t index = it->first;
+  Slice_t *s = it->second;
+  uint64_t t0 = index * length_;
+  uint64_t idle = IdleMask(now);
+
+  std::sort(s->rec.begin(), s->rec.end());
+
+  char name[5] = "TSLC";
+  DWORD *pd;
+  bk_create(pevent, name, TID_DWORD, (void **)&pd);
+  *pd++ = (DWORD)index;
+  *pd++ = (DWORD)(index >> 32);
+  *pd++ = (DWORD)t0;
+  *pd++ = (DWORD)(t0 >> 32);
+  *pd++ = (DWORD)length_;
+  *pd++ = s->rec.size();
+  *pd++ = (DWORD)idle;
+  *pd++ = (DWORD)(idle >> 32);
+  *pd++ = flush ? 2 : (forced_next_ ? 1 : 0);
+  bk_close(pevent, pd);
+
+  strcpy(name, "TSLI");
+  bk_create(pevent, name, TID_DWORD, (void **)&pd);
+  DWORD offset = 0;
+  for (unsigned int i = 0; i < s->rec.size(); i++) {
+    *pd++ = s->rec[i].frag;
+    *pd++ = (DWORD)(s->rec[i].ts - t0);
+    *pd++ = offset;
+    *pd++ = s->rec[i].size;
+    offset += s->rec[i].size;
+  }
+  bk_close(pevent, pd);
+
+  char *pb;
+  strcpy(name, "TSLD");
+  bk_create(pevent, name, TID_BYTE, (void **)&pb);
+  for (unsigned int i = 0; i < s->rec.size(); i++) {
+    memcpy(pb, &s->data[s->rec[i].offset], s->rec[i].size);
+    pb += s->rec[i].size;
+  }
+  bk_close(pevent, pb);
+
+  slices_++;
+  records_ += s->rec.size();
+  if (forced_next_ && !flush) forced_++;
+  forced_next_ = false;
+  next_index_ = index + 1;
+
+  s->data.clear();
+  s->rec.clear();
+  pool_.push_back(s);
+  open_.erase(it);
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+uint64_t EBTimeSlicer::GetOpenRecords() const
+{
+  uint64_t n = 0;
+  for (std::map<uint64_t, Slice_t *>::const_iterator it = open_.begin(); it != open_.end(); ++it)
+    n += it->second->rec.size();
+  return n;
+}
@@ -0,0 +1,127 @@
+/*****************************************************************************/
+/**
+\file ebSlicer.hxx
+
+## Contents
+
+Time-slice assembly (SLICE_MODE), for trigger-less continuous readout.
+Instead of matching the fragments event by event, every fragment record is
+placed by its timestamp (trailer ts_best, 16ns, 30 bits, extended to 64
+bits) in a fixed-length time window, and one event is built per window
+(Settings/Time slice):
+
+    Length (us)            slice length
+    Max disorder (us)      how far back in time a fragment may still send
+    Idle timeout (ms)      a fragment without records for that long doesn't
+                           hold the slices back any more
+    Max open slices        beyond that, the oldest slice is closed anyway
+
+Watermark rule: each fragment's watermark is the latest timestamp it sent.
+A slice is closed once the lowest watermark of the fragments still sending
+is "Max disorder" past its end; a record for a slice already closed is late
+and dropped (counted).  Records without a timestamp are dropped (counted).
+
+A time-slice event has three banks:
+
+    TSLC (TID_DWORD)  [0-1] slice number (low, high)
+                      [2-3] slice start (16ns, low, high)
+                      [4]   slice length (16ns)
+                      [5]   number of records
+                      [6-7] fragment IDs idle when the slice was closed
+                      [8]   1: closed early (too many open slices),
+                            2: flushed at the end of the run
+    TSLI (TID_DWORD)  per record: fragment ID, time from the slice start
+                      (16ns), offset in TSLD, size
+    TSLD (TID_BYTE)   the fragment events (EVENT_HEADER + banks), sorted by
+                      fragment ID, then time
+
+At the end of the run the records left in the ring buffers are sorted in and
+the slices still open are flushed, due or not (TSLC[8] = 2).
+ *****************************************************************************/
+
+#ifndef EBSLICER_HXX_INCLUDE
+#define EBSLICER_HXX_INCLUDE
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+#include "midas.h"
+
+class EBTimeSlicer
+{
+
+public:
+
+  EBTimeSlicer();
+  ~EBTimeSlicer();
+
+  void Configure(HNDLE hDB, HNDLE hKey, int max_event);   //!< BOR, keys under hKey ("Time slice")
+  void Start(uint64_t fragments, DWORD now);              //!< BOR: fragment IDs taking part
+
+  void Add(int frag, char *prec, DWORD now);    //!< Record of the ring buffer (copied into its slice)
+  bool IsDue(DWORD now);                        //!< The oldest open slice can be closed
+  bool Build(char *pevent, DWORD now, bool flush = false);  //!< Banks of the oldest slice, if due (bk_init32 done)
+
+  uint64_t GetSlices() const { return slices_; }
+  uint64_t GetRecords() const { return records_; }      //!< Records built into slices
+  uint64_t GetLate() const { return late_; }            //!< Records for a closed slice
+  uint64_t GetNoTimestamp() const { return nots_; }
+  uint64_t GetOverflow() const { return overflow_; }    //!< Records not fitting in the slice event
+  uint64_t GetForced() const { return forced_; }        //!< Slices closed early
+  int GetOpen() const { return open_.size(); }
+  uint64_t GetOpenRecords() const;                      //!< Records in the open slices
+
+private:
+
+  EBTimeSlicer(const EBTimeSlicer&);
+  EBTimeSlicer& operator=(const EBTimeSlicer&);
+
+  struct Record_t {
+    uint64_t ts;                 //!< Extended timestamp (16ns)
+    DWORD frag;
+    DWORD offset;                //!< In Slice_t::data
+    DWORD size;
+    bool operator<(const Record_t &r) const { return frag < r.frag || (frag == r.frag && ts < r.ts); }
+  };
+  struct Slice_t {
+    std::vector<char> data;      //!< Fragment events, as they came
+    std::vector<Record_t> rec;
+  };
+  struct Frag_t {
+    bool started;                //!< Timestamp seen
+    uint64_t ext;                //!< Last timestamp, extended
+    uint64_t watermark;          //!< Latest timestamp, extended
+    DWORD last_seen;             //!< ss_millitime() of the last record
+  };
+
+  uint64_t Extend(Frag_t &f, DWORD ts30, DWORD now);
+  uint64_t IdleMask(DWORD now) const;
+  Slice_t *GetSlice(uint64_t index);
+
+  uint64_t length_;              //!< 16ns
+  uint64_t disorder_;            //!< 16ns
+  INT idle_ms_;
+  INT max_open_;
+  int max_event_;
+
+  std::vector<Frag_t> frag_;     //!< By fragment ID
+  uint64_t fragments_;           //!< Fragment IDs taking part
+  DWORD start_time_;             //!< ss_millitime() at BOR
+  bool have_ref_;
+  uint64_t last_ext_;            //!< Latest extended timestamp of any fragment, reference for a new one
+  uint64_t next_index_;          //!< Slices before this one are closed
+  bool forced_next_;             //!< Oldest slice due because too many are open
+
+  std::map<uint64_t, Slice_t *> open_;
+  std::vector<Slice_t *> pool_;  //!< Closed slices, their buffers reused
+
+  uint64_t slices_;
+  uint64_t records_;
+  uint64_t late_;
+  uint64_t nots_;
+  uint64_t overflow_;
+  uint64_t forced_;
+};
+
+#endif // EBSLICER_HXX_INCLUDE
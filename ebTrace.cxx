@@ -0,0 +1,139 @@
+/*****************************************************************************/
+/**
+\file ebTrace.cxx
+
+\section contents Contents
+Flight recorder for the event builder threads
+
+\subsection notes Notes about this class
+Rings are allocated at BOR (Init) and only released by the next Init, so a
+late Record() from a thread being joined is always safe.
+ *****************************************************************************/
+
+#include "ebTrace.hxx"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "midas.h"
+
+std::vector<EBTrace::Ring *> EBTrace::rings_;
+double EBTrace::dump_seconds_ = 10.;
+char EBTrace::dump_dir_[256] = ".";
+std::atomic<uint64_t> EBTrace::last_dump_(0);
+std::atomic<unsigned int> EBTrace::dumps_(0);
+
+//---------------------------------------------------------------------------------
+uint64_t EBTrace::Now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//---------------------------------------------------------------------------------
+const char *EBTrace::GetTypeName(int type)
+{
+  static const char *names[kNTypes] = { "", "receive", "publish", "ring full"
+                                      , "assembly", "assembly end", "control word retry"
+                                      , "SN mismatch", "reorder" };
+  return (type > 0 && type < kNTypes) ? names[type] : "unknown";
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Allocate one ring per fragment thread plus one for the assembly
+ *
+ * \param   [in]  nfragments   number of fragment threads
+ * \param   [in]  nrecords     records per ring, rounded up to a power of 2
+ */
+void EBTrace::Init(int nfragments, int nrecords)
+{
+  Clear();
+  int n = 1024;
+  while (n < nrecords) n <<= 1;
+  for (int i = 0; i <= nfragments; i++)
+    rings_.push_back(new Ring(n));
+  last_dump_ = 0;
+}
+
+//---------------------------------------------------------------------------------
+void EBTrace::Clear()
+{
+  for (unsigned int i = 0; i < rings_.size(); i++)
+    delete rings_[i];
+  rings_.clear();
+}
+
+//---------------------------------------------------------------------------------
+void EBTrace::SetDumpDir(const char *dir)
+{
+  snprintf(dump_dir_, sizeof(dump_dir_), "%s", (dir && dir[0]) ? dir : ".");
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Write the last dump_seconds_ of every ring to a file
+ *
+ * File name: [dump dir]/ebtrace_[unix time]_[pid]_[dump number].bin
+ *
+ * \param   [in]  reason        stored in the file header
+ * \param   [in]  min_interval  don't dump again within this many seconds (0: always)
+ * \return  true if a file was written
+ */
+bool EBTrace::Dump(const char *reason, int min_interval)
+{
+  uint64_t now = Now();
+  uint64_t last = last_dump_.load();
+  if (last && min_interval > 0 && now - last < (uint64_t)min_interval * 1000000000ULL)
+    return false;
+  if (!last_dump_.compare_exchange_strong(last, now))
+    return false;   // another thread is dumping
+
+  uint64_t tmin = now - (uint64_t)(dump_seconds_ * 1e9);
+  std::vector<EBTRACE_RECORD> all;
+  for (unsigned int i = 0; i < rings_.size(); i++) {
+    Ring *r = rings_[i];
+    uint64_t h1 = r->head.load(std::memory_order_acquire);
+    uint64_t n = std::min<uint64_t>(h1, r->rec.size());
+    std::vector<EBTRACE_RECORD> copy(r->rec.begin(), r->rec.end());
+    uint64_t h2 = r->head.load(std::memory_order_acquire);
+    // Records (h2 - size, h1) were not touched by the writer while copying;
+    // slot h2 - size is the one of h2, possibly being written
+    for (uint64_t k = h1 - n; k < h1; k++) {
+      if (h2 >= r->rec.size() && k <= h2 - r->rec.size()) continue;
+      const EBTRACE_RECORD &rec = copy[k & r->mask];
+      if (rec.time >= tmin) all.push_back(rec);
+    }
+  }
+  std::stable_sort(all.begin(), all.end()
+                   , [](const EBTRACE_RECORD &a, const EBTRACE_RECORD &b) { return a.time < b.time; });
+
+  char filename[512];
+  snprintf(filename, sizeof(filename), "%s/ebtrace_%u_%d_%u.bin", dump_dir_, (unsigned int)time(NULL)
+           , (int)getpid(), dumps_++);
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    cm_msg(MERROR, "EBTrace::Dump", "Cannot open trace dump file %s: %s", filename, strerror(errno));
+    return false;
+  }
+
+  EBTRACE_FILE_HEADER header;
+  memset(&header, 0, sizeof(header));
+  header.magic = EBTRACE_MAGIC;
+  header.version = EBTRACE_VERSION;
+  header.nrecords = all.size();
+  header.nthreads = rings_.size();
+  header.dump_time = now;
+  snprintf(header.reason, sizeof(header.reason), "%s", reason);
+  fwrite(&header, sizeof(header), 1, f);
+  if (!all.empty()) fwrite(&all[0], sizeof(EBTRACE_RECORD), all.size(), f);
+  fclose(f);
+
+  cm_msg(MINFO, "EBTrace::Dump", "Flight recorder (%s): %d records dumped to %s"
+         , reason, (int)all.size(), filename);
+  return true;
+}
@@ -0,0 +1,111 @@
+/*****************************************************************************/
+/**
+\file ebTrace.hxx
+
+## Contents
+
+Flight recorder for the event builder threads: per-thread lock-free rings of
+compact timestamped records, dumped to a binary file on error or on demand.
+Use ebTrace2Json.exe to convert a dump to the Chrome trace (about:tracing /
+Perfetto) JSON format.
+ *****************************************************************************/
+
+#ifndef EBTRACE_HXX_INCLUDE
+#define EBTRACE_HXX_INCLUDE
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#define EBTRACE_MAGIC    0x52544245   //!< "EBTR"
+#define EBTRACE_VERSION  1
+
+/// One trace record, 16 bytes
+struct EBTRACE_RECORD {
+  uint64_t time;      //!< CLOCK_MONOTONIC in ns
+  uint16_t type;      //!< EBTrace::Type
+  uint16_t thread;    //!< 0: assembly thread, 1..N: fragment thread ID+1
+  uint32_t arg;       //!< Serial number, level, ... depending on type
+};
+
+/// Dump file header, followed by nrecords EBTRACE_RECORD sorted in time
+struct EBTRACE_FILE_HEADER {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nrecords;
+  uint32_t nthreads;
+  uint64_t dump_time;   //!< CLOCK_MONOTONIC (ns) when dumped
+  char     reason[64];  //!< Why the dump was taken
+};
+
+/**
+ * Static interface to the per-thread recorders.
+ *
+ * Each ring has a single writer (its own thread) and is read only by Dump(),
+ * which copies the ring and drops any record that may have been overwritten
+ * while copying.  Record() is a few stores and one release store, no lock.
+ */
+class EBTrace
+{
+
+public:
+
+  enum Type {
+    kReceive = 1,       //!< Fragment read from its Midas buffer (arg: serial number)
+    kPublish,           //!< Fragment made available to the assembly (arg: events in ring)
+    kRingFull,          //!< Fragment thread throttled on ring level (arg: level in kB)
+    kAssemblyStart,     //!< Assembly of an event started (arg: serial number)
+    kAssemblyEnd,       //!< Assembly done (arg: event size in bytes)
+    kControlRetry,      //!< Control word not yet valid (arg: retries in us)
+    kSNMismatch,        //!< Serial number mismatch (arg: fragment serial number)
+    kReorder,           //!< Fragment out of order, parked (arg: its serial number)
+    kNTypes
+  };
+
+  static const int kAssembly = -1;   //!< Thread index for the assembly (main) thread
+
+  static void Init(int nfragments, int nrecords);   //!< Allocate rings, at BOR
+  static void Clear();                               //!< Release rings
+  static void SetDumpSeconds(double s) { dump_seconds_ = s; }
+  static void SetDumpDir(const char *dir);
+
+  /// Add a record from the calling thread (fragment ID, or kAssembly)
+  static inline void Record(int thread, Type type, uint32_t arg) {
+    unsigned int slot = thread + 1;
+    if (slot >= rings_.size()) return;
+    rings_[slot]->Add(type, slot, arg);
+  }
+
+  /// Dump the last "dump seconds" of all the rings, at most once per min_interval s
+  static bool Dump(const char *reason, int min_interval = 10);
+
+  static const char *GetTypeName(int type);
+  static uint64_t Now();
+
+private:
+
+  struct Ring {
+    std::vector<EBTRACE_RECORD> rec;
+    uint64_t mask;
+    std::atomic<uint64_t> head;   //!< Number of records ever written
+    Ring(int n) : rec(n), mask(n - 1), head(0) {}
+
+    inline void Add(int type, int thread, uint32_t arg) {
+      uint64_t h = head.load(std::memory_order_relaxed);
+      EBTRACE_RECORD &r = rec[h & mask];
+      r.time = Now();
+      r.type = type;
+      r.thread = thread;
+      r.arg = arg;
+      head.store(h + 1, std::memory_order_release);
+    }
+  };
+
+  static std::vector<Ring *> rings_;
+  static double dump_seconds_;
+  static char dump_dir_[256];
+  static std::atomic<uint64_t> last_dump_;
+  static std::atomic<unsigned int> dumps_;     //!< Dumps written by this process
+};
+
+#endif // EBTRACE_HXX_INCLUDE
@@ -0,0 +1,107 @@
+/*****************************************************************************/
+/**
+\file ebTrace2Json.cxx
+
+\section contents Contents
+Convert an event builder flight recorder dump (ebtrace_*.bin) to the Chrome
+trace JSON format, to be loaded in chrome://tracing or ui.perfetto.dev
+
+\subsection usage Usage
+ebTrace2Json.exe ebtrace_1234567890_4321_0.bin > trace.json
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "ebTrace.hxx"
+
+//---------------------------------------------------------------------------------
+// Same as EBTrace::GetTypeName(), without pulling in midas
+static const char *TypeName(int type)
+{
+  static const char *names[EBTrace::kNTypes] = { "", "receive", "publish", "ring full"
+                                               , "assembly", "assembly end", "control word retry"
+                                               , "SN mismatch", "reorder" };
+  return (type > 0 && type < EBTrace::kNTypes) ? names[type] : "unknown";
+}
+
+//---------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s ebtrace_file.bin > trace.json\n", argv[0]);
+    return 1;
+  }
+
+  FILE *f = fopen(argv[1], "rb");
+  if (!f) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  EBTRACE_FILE_HEADER header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != EBTRACE_MAGIC) {
+    fprintf(stderr, "%s: not an event builder trace file\n", argv[1]);
+    fclose(f);
+    return 1;
+  }
+  if (header.version != EBTRACE_VERSION) {
+    fprintf(stderr, "%s: unsupported version %u\n", argv[1], header.version);
+    fclose(f);
+    return 1;
+  }
+
+  std::vector<EBTRACE_RECORD> rec(header.nrecords);
+  if (header.nrecords && fread(&rec[0], sizeof(EBTRACE_RECORD), header.nrecords, f) != header.nrecords) {
+    fprintf(stderr, "%s: truncated file\n", argv[1]);
+    fclose(f);
+    return 1;
+  }
+  fclose(f);
+
+  uint64_t t0 = rec.empty() ? 0 : rec[0].time;
+  header.reason[sizeof(header.reason) - 1] = 0;
+
+  printf("{\"otherData\":{\"reason\":\"%s\"},\n\"traceEvents\":[\n", header.reason);
+  for (unsigned int t = 0; t < header.nthreads; t++) {
+    if (t == 0)
+      printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"assembly\"}},\n");
+    else
+      printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"fragment %u\"}},\n", t, t - 1);
+  }
+
+  bool inAssembly = false;
+  for (unsigned int i = 0; i < rec.size(); i++) {
+    const EBTRACE_RECORD &r = rec[i];
+    double ts = (r.time - t0) * 1e-3; // us
+    switch (r.type) {
+    case EBTrace::kAssemblyStart:
+      // A dump can start in the middle of an assembly; only pair B/E we have seen
+      printf("{\"name\":\"assembly\",\"ph\":\"B\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"serial\":%u}},\n"
+             , r.thread, ts, r.arg);
+      inAssembly = true;
+      break;
+    case EBTrace::kAssemblyEnd:
+      if (!inAssembly) break;
+      printf("{\"name\":\"assembly\",\"ph\":\"E\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"size\":%u}},\n"
+             , r.thread, ts, r.arg);
+      inAssembly = false;
+      break;
+    case EBTrace::kPublish:
+      printf("{\"name\":\"ring %u\",\"ph\":\"C\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"events\":%u}},\n"
+             , r.thread - 1, r.thread, ts, r.arg);
+      break;
+    default:
+      printf("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"arg\":%u}},\n"
+             , TypeName(r.type), r.thread, ts, r.arg);
+      break;
+    }
+  }
+  // Closing metadata record, avoids the trailing comma problem
+  printf("{\"name\":\"dump\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":0,\"ts\":%.3f}\n]}\n"
+         , (header.dump_time > t0) ? (header.dump_time - t0) * 1e-3 : 0.);
+
+  return 0;
+}
@@ -0,0 +1,358 @@
+/*****************************************************************************/
+/**
+\file ebWriter.cxx
+
+\section contents Contents
+Direct-to-disk output of the built events
+
+\subsection notes Notes about this class
+Open() and Close() are called by the main thread while the sender is not
+running, Write() (and the file rotation) by the sender thread only: no
+lock.  The counters are atomics for the EBlvl bank.
+
+An event may straddle two buffers: each write is a full buffer, so the file
+offsets stay aligned for O_DIRECT.  A file system without O_DIRECT (tmpfs)
+gets the same writes through the page cache.
+ *****************************************************************************/
+
+#include "ebWriter.hxx"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ebMessage.hxx"
+
+//---------------------------------------------------------------------------------
+static uint64_t MonotonicUs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//---------------------------------------------------------------------------------
+EBDiskWriter::EBDiskWriter()
+: enabled_(FALSE), dir_("."), buffer_kb_(4096), nbuffers_(2), max_file_mb_(2000)
+  , direct_(TRUE), monitor_prescale_(100), run_(0), subrun_(0), fd_(-1), direct_open_(false)
+  , bufsize_(0), fill_(0), cur_(0), offset_(0), file_bytes_(0)
+  , bytes_(0), files_(0), wait_us_(0)
+{
+}
+
+//---------------------------------------------------------------------------------
+EBDiskWriter::~EBDiskWriter()
+{
+  if (fd_ >= 0) {
+    CloseFile();
+  }
+  FreeBuffers();
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Read the settings (BOR)
+ *
+ * \param   [in]  hDB    ODB handle
+ * \param   [in]  hKey   disk writer settings key
+ */
+void EBDiskWriter::Configure(HNDLE hDB, HNDLE hKey)
+{
+  char dir[256] = ".";
+  int size;
+
+  size = sizeof(enabled_);
+  db_get_value(hDB, hKey, "Enable", &enabled_, &size, TID_BOOL, TRUE);
+  size = sizeof(dir);
+  db_get_value(hDB, hKey, "Directory", dir, &size, TID_STRING, TRUE);
+  size = sizeof(buffer_kb_);
+  db_get_value(hDB, hKey, "Buffer size (kB)", &buffer_kb_, &size, TID_INT, TRUE);
+  size = sizeof(nbuffers_);
+  db_get_value(hDB, hKey, "Buffers", &nbuffers_, &size, TID_INT, TRUE);
+  size = sizeof(max_file_mb_);
+  db_get_value(hDB, hKey, "Max file size (MB)", &max_file_mb_, &size, TID_INT, TRUE);
+  size = sizeof(direct_);
+  db_get_value(hDB, hKey, "O_DIRECT", &direct_, &size, TID_BOOL, TRUE);
+  size = sizeof(monitor_prescale_);
+  db_get_value(hDB, hKey, "Monitor prescale", &monitor_prescale_, &size, TID_INT, TRUE);
+
+  dir_ = dir[0] ? dir : ".";
+  if (buffer_kb_ < EBWRITER_ALIGN / 1024) buffer_kb_ = EBWRITER_ALIGN / 1024;
+  buffer_kb_ -= buffer_kb_ % (EBWRITER_ALIGN / 1024);
+  if (nbuffers_ < 2) nbuffers_ = 2;
+  if (max_file_mb_ < 0) max_file_mb_ = 0;
+  if (monitor_prescale_ < 0) monitor_prescale_ = 0;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Allocate the buffers, take the BOR ODB dump and open the first file
+ *
+ * \param   [in]  hDB    ODB handle
+ * \param   [in]  run    run number
+ * \return  false if the file can't be opened (events to the equipment buffer)
+ */
+bool EBDiskWriter::Open(HNDLE hDB, int run)
+{
+  if (fd_ >= 0) CloseFile();
+  FreeBuffers();
+
+  run_ = run;
+  subrun_ = 0;
+  bytes_ = 0;
+  files_ = 0;
+  wait_us_ = 0;
+
+  bufsize_ = (size_t)buffer_kb_ * 1024;
+  for (int i = 0; i < nbuffers_; i++) {
+    void *p = NULL;
+    if (posix_memalign(&p, EBWRITER_ALIGN, bufsize_)) {
+      cm_msg(MERROR, "EBDiskWriter", "Cannot allocate %d buffers of %d kB", nbuffers_, buffer_kb_);
+      FreeBuffers();
+      return false;
+    }
+    buf_.push_back((char *)p);
+  }
+  cb_.resize(nbuffers_);
+  pending_.assign(nbuffers_, 0);
+
+  OdbDump(hDB, EVENTID_BOR, bor_dump_);
+  if (!OpenFile()) {
+    FreeBuffers();
+    return false;
+  }
+  cm_msg(MINFO, "EBDiskWriter", "Writing to %s (%s, %d x %d kB buffers)", filename_.c_str()
+         , direct_open_ ? "O_DIRECT" : "buffered", nbuffers_, buffer_kb_);
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   End of the last file of the run: EOR ODB dump, tail, close
+ */
+void EBDiskWriter::Close(HNDLE hDB)
+{
+  if (fd_ >= 0) {
+    std::vector<char> eor;
+    if (OdbDump(hDB, EVENTID_EOR, eor)) Append(&eor[0], eor.size());
+    if (fd_ >= 0) CloseFile();
+  }
+  FreeBuffers();
+}
+
+//---------------------------------------------------------------------------------
+void EBDiskWriter::FreeBuffers()
+{
+  for (unsigned int i = 0; i < buf_.size(); i++)
+    free(buf_[i]);
+  buf_.clear();
+  cb_.clear();
+  pending_.clear();
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   ODB dump event, as the logger writes it
+ *
+ * \param   [in]  id   EVENTID_BOR or EVENTID_EOR
+ * \param   [out] ev   full event (EVENT_HEADER first), empty on error
+ */
+bool EBDiskWriter::OdbDump(HNDLE hDB, WORD id, std::vector<char> &ev)
+{
+  for (int size = 1024 * 1024; size <= 64 * 1024 * 1024; size *= 2) {
+    ev.assign(sizeof(EVENT_HEADER) + size, 0);
+    char *pdata = &ev[sizeof(EVENT_HEADER)];
+    int remaining = size;
+    int status = db_copy(hDB, 0, pdata, &remaining, "");
+    if (status == DB_TRUNCATED) continue;
+    if (status != DB_SUCCESS) break;
+
+    DWORD len = strlen(pdata) + 1;
+    bm_compose_event((EVENT_HEADER *)&ev[0], id, MIDAS_MAGIC, len, run_);
+    ev.resize(sizeof(EVENT_HEADER) + len);
+    return true;
+  }
+  cm_msg(MERROR, "EBDiskWriter", "Cannot copy the ODB for the %s dump", (id == EVENTID_BOR) ? "BOR" : "EOR");
+  ev.clear();
+  return false;
+}
+
+//---------------------------------------------------------------------------------
+/// Next file of the run, BOR ODB dump first
+bool EBDiskWriter::OpenFile()
+{
+  char name[512];
+  snprintf(name, sizeof(name), "%s/run%05d_%03d.mid", dir_.c_str(), run_, subrun_);
+  filename_ = name;
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  direct_open_ = false;
+  fd_ = -1;
+  if (direct_) {
+    fd_ = open(name, flags | O_DIRECT, 0644);
+    if (fd_ >= 0) direct_open_ = true;
+    else if (errno != EINVAL) {
+      Fail("open", errno);
+      return false;
+    }
+  }
+  if (fd_ < 0) fd_ = open(name, flags, 0644);
+  if (fd_ < 0) {
+    Fail("open", errno);
+    return false;
+  }
+
+  cur_ = 0;
+  fill_ = 0;
+  offset_ = 0;
+  file_bytes_ = 0;
+  files_++;
+  if (!bor_dump_.empty()) return Append(&bor_dump_[0], bor_dump_.size());
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Write the tail, wait for all the writes, close
+ *
+ * The tail is padded to the alignment and the file cut back to the event
+ * bytes afterwards.
+ */
+bool EBDiskWriter::CloseFile()
+{
+  bool ok = true;
+  if (fill_) {
+    size_t n = (fill_ + EBWRITER_ALIGN - 1) & ~(size_t)(EBWRITER_ALIGN - 1);
+    memset(buf_[cur_] + fill_, 0, n - fill_);
+    ok = Submit(n);
+  }
+  for (unsigned int i = 0; ok && i < pending_.size(); i++)
+    ok = Wait(i);
+  if (ok && ftruncate(fd_, file_bytes_) < 0) {
+    Fail("ftruncate", errno);
+    ok = false;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  return ok;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Write one built event, next file first if this one is full
+ *
+ * \return  false if it couldn't be written, the writer is closed then
+ */
+bool EBDiskWriter::Write(const EVENT_HEADER *pevent)
+{
+  if (fd_ < 0) return false;
+
+  size_t size = sizeof(EVENT_HEADER) + pevent->data_size;
+  uint64_t max_bytes = (uint64_t)max_file_mb_ * 1024 * 1024;
+  if (max_bytes && file_bytes_ > bor_dump_.size() && file_bytes_ + size > max_bytes) {
+    if (!CloseFile()) return false;
+    subrun_++;
+    if (!OpenFile()) return false;
+    EB_POST(EBMessage::kOther, MT_INFO, "EBDiskWriter", "Next file %s", filename_.c_str());
+  }
+  if (!Append((const char *)pevent, size)) return false;
+  bytes_ += size;
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+/// Copy into the current buffer, handing out each buffer once full
+bool EBDiskWriter::Append(const char *p, size_t n)
+{
+  file_bytes_ += n;
+  while (n) {
+    size_t k = bufsize_ - fill_;
+    if (k > n) k = n;
+    memcpy(buf_[cur_] + fill_, p, k);
+    fill_ += k;
+    p += k;
+    n -= k;
+    if (fill_ == bufsize_ && !Submit(bufsize_)) return false;
+  }
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Start the write of the current buffer, move on to the next one
+ *
+ * \param   [in]  n   bytes, a multiple of EBWRITER_ALIGN
+ * \return  false on error (writer closed)
+ */
+bool EBDiskWriter::Submit(size_t n)
+{
+  struct aiocb *cb = &cb_[cur_];
+  memset(cb, 0, sizeof(*cb));
+  cb->aio_fildes = fd_;
+  cb->aio_buf = buf_[cur_];
+  cb->aio_nbytes = n;
+  cb->aio_offset = offset_;
+  if (aio_write(cb) < 0) {
+    Fail("aio_write", errno);
+    return false;
+  }
+  pending_[cur_] = 1;
+  offset_ += n;
+
+  // The next buffer is free once its previous write is done
+  cur_ = (cur_ + 1) % buf_.size();
+  fill_ = 0;
+  return Wait(cur_);
+}
+
+//---------------------------------------------------------------------------------
+/// Wait for the write of buffer i, if any
+bool EBDiskWriter::Wait(int i)
+{
+  if (!pending_[i]) return true;
+
+  struct aiocb *cb = &cb_[i];
+  const struct aiocb *list[1] = { cb };
+  uint64_t start = 0;
+  int err;
+  while ((err = aio_error(cb)) == EINPROGRESS) {
+    if (!start) start = MonotonicUs();
+    aio_suspend(list, 1, NULL);
+  }
+  if (start) wait_us_ += MonotonicUs() - start;
+  pending_[i] = 0;
+
+  ssize_t done = aio_return(cb);
+  if (err || done != (ssize_t)cb->aio_nbytes) {
+    Fail("aio_write", err ? err : ENOSPC);
+    return false;
+  }
+  return true;
+}
+
+//---------------------------------------------------------------------------------
+/// Write error: the file is given up, the writes in flight are waited for
+void EBDiskWriter::Fail(const char *what, int err)
+{
+  EB_POST(EBMessage::kOther, MT_ERROR, "EBDiskWriter", "%s error on %s: %s, events to the equipment buffer"
+                  , what, filename_.c_str(), strerror(err));
+  for (unsigned int i = 0; i < pending_.size(); i++) {
+    if (!pending_[i]) continue;
+    const struct aiocb *list[1] = { &cb_[i] };
+    while (aio_error(&cb_[i]) == EINPROGRESS)
+      aio_suspend(list, 1, NULL);
+    aio_return(&cb_[i]);
+    pending_[i] = 0;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  fill_ = 0;
+}
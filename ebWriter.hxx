@@ -0,0 +1,108 @@
+/*****************************************************************************/
+/**
+\file ebWriter.hxx
+
+## Contents
+
+Built-in disk writer of the output stage.  Instead of going through the
+SYSTEM buffer to the logger, the built events are written by the sender
+thread straight to local files (Settings/Disk writer):
+
+    Enable                 FALSE: the events go to the equipment buffer
+    Directory              where the files go, run%05d_%03d.mid
+    Buffer size (kB)       size of each write, a multiple of 4 kB
+    Buffers                buffers in flight, 2 or more (double buffering)
+    Max file size (MB)     next file of the run beyond this, 0: one file per run
+    O_DIRECT               direct I/O, the page cache left out
+    Monitor prescale       one event in n also goes to the equipment buffer
+                           for the online monitoring (never waited for), 0: none
+
+The events are copied back to back into aligned buffers; a full buffer is
+handed to POSIX AIO (aio_write) and the next one is filled while it goes
+out, so that the sender only waits for the disk when all the buffers are
+in flight.  Each file is a MIDAS file: ODB dump of the BOR first, the ODB
+dump of the EOR at the end of the last file of the run.  The tail of a
+file is written padded to the O_DIRECT alignment, then cut back to size.
+
+On a write error the file is closed and the events go to the equipment
+buffer again, as without the writer.
+ *****************************************************************************/
+
+#ifndef EBWRITER_HXX_INCLUDE
+#define EBWRITER_HXX_INCLUDE
+
+#include <stdint.h>
+#include <aio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "midas.h"
+
+#define EBWRITER_ALIGN   4096   //!< O_DIRECT offset, size and buffer alignment
+
+class EBDiskWriter
+{
+
+public:
+
+  EBDiskWriter();
+  ~EBDiskWriter();
+
+  void Configure(HNDLE hDB, HNDLE hKey);        //!< BOR, keys under hKey ("Disk writer")
+  bool IsEnabled() const { return enabled_; }
+  int GetMonitorPrescale() const { return monitor_prescale_; }
+
+  bool Open(HNDLE hDB, int run);                //!< BOR, before the sender starts: buffers, first file
+  void Close(HNDLE hDB);                        //!< EOR, once the sender is stopped
+  bool IsOpen() const { return fd_ >= 0; }
+
+  bool Write(const EVENT_HEADER *pevent);       //!< Sender thread; false: not written, writer closed
+
+  uint64_t GetBytes() const { return bytes_.load(); }       //!< Event bytes written in this run
+  uint64_t GetFiles() const { return files_.load(); }
+  double GetWaitTime() const { return wait_us_.load() * 1e-6; }  //!< s, sender waiting for the disk
+
+private:
+
+  EBDiskWriter(const EBDiskWriter&);
+  EBDiskWriter& operator=(const EBDiskWriter&);
+
+  bool OdbDump(HNDLE hDB, WORD id, std::vector<char> &ev);
+  bool OpenFile();
+  bool CloseFile();
+  bool Append(const char *p, size_t n);
+  bool Submit(size_t n);
+  bool Wait(int i);
+  void Fail(const char *what, int err);
+  void FreeBuffers();
+
+  BOOL enabled_;
+  std::string dir_;
+  INT buffer_kb_;
+  INT nbuffers_;
+  INT max_file_mb_;
+  BOOL direct_;
+  INT monitor_prescale_;
+
+  int run_;
+  int subrun_;                                  //!< File number in the run
+  std::string filename_;
+  int fd_;
+  bool direct_open_;                            //!< File opened with O_DIRECT
+  std::vector<char *> buf_;                     //!< Aligned buffers, bufsize_ each
+  std::vector<struct aiocb> cb_;
+  std::vector<uint8_t> pending_;                //!< Write of the buffer in flight
+  size_t bufsize_;
+  size_t fill_;                                 //!< Bytes in the current buffer
+  int cur_;                                     //!< Buffer being filled
+  off_t offset_;                                //!< File offset of the current buffer
+  uint64_t file_bytes_;                         //!< Event bytes in the current file
+  std::vector<char> bor_dump_;                  //!< BOR ODB dump event, first in each file
+
+  std::atomic<uint64_t> bytes_;
+  std::atomic<uint64_t> files_;
+  std::atomic<uint64_t> wait_us_;
+};
+
+#endif // EBWRITER_HXX_INCLUDE
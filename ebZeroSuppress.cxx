@@ -0,0 +1,205 @@
+/*****************************************************************************/
+/**
+\file ebZeroSuppress.cxx
+
+\section contents Contents
+Zero suppression of the raw V1720 W2xx banks into ZLxx banks
+
+\subsection notes Notes about this class
+Used by the fragment thread only (one instance per EBFragment).  The
+threshold test is done 4 words (8 samples) at a time with SSE2 where the
+compiler has it, the run-length packing works on the per-word flags.  The
+event is rewritten in place: a converted bank is never larger than the raw
+one (otherwise it is kept raw), so the banks after it only move down.
+ *****************************************************************************/
+
+#include "ebZeroSuppress.hxx"
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ebDecoder.hxx"
+
+//---------------------------------------------------------------------------------
+EBZeroSuppressor::EBZeroSuppressor()
+: enabled_(false), bytes_in_(0), bytes_out_(0)
+{
+  memset(&zs_, 0, sizeof(zs_));
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Set the parameters for the run (BOR)
+ */
+void EBZeroSuppressor::Configure(const EBZS_SETTINGS &zs)
+{
+  zs_ = zs;
+  if (zs_.pre < 0) zs_.pre = 0;
+  if (zs_.post < 0) zs_.post = 0;
+
+  enabled_ = false;
+  for (int i = 0; i < EBZS_MAX_MODULES; i++)
+    if (zs_.threshold[i] > 0) enabled_ = true;
+
+  bytes_in_ = 0;
+  bytes_out_ = 0;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Convert the W2xx banks of an event into ZLxx banks, in place
+ *
+ * Banks of modules without threshold, of an unknown layout, or that would
+ * not get smaller are left as they are.  The event and bank header sizes
+ * are updated.
+ *
+ * \param   [in]  pevent  fragment event (bank32)
+ * \return  number of banks converted
+ */
+int EBZeroSuppressor::SuppressEvent(EVENT_HEADER *pevent)
+{
+  BANK_HEADER *pbh = (BANK_HEADER *)(pevent + 1);
+  if (pbh->flags != (BANK_FORMAT_VERSION | BANK_FORMAT_32BIT)) return 0;
+
+  char *p = (char *)(pbh + 1);
+  char *end = p + pbh->data_size;
+  char *q = p;
+  int nconv = 0;
+
+  while (p < end) {
+    BANK32 *pbk = (BANK32 *)p;
+    DWORD size = pbk->data_size;
+    char *next = (char *)(pbk + 1) + ALIGN8(size);
+    DWORD fourcc = EBBankFourCC(pbk);
+
+    int nout = 0;
+    if ((fourcc & EB_PREFIX_MASK) == EB_FOURCC('W','2',0,0)) {
+      int module = EBBankModule(fourcc);
+      if (module >= 0 && module < EBZS_MAX_MODULES && zs_.threshold[module] > 0) {
+        nout = SuppressBank((const DWORD *)(pbk + 1), size / sizeof(DWORD), zs_.threshold[module]);
+        if (nout * sizeof(DWORD) >= size) nout = 0;
+        bytes_in_ += size;
+        bytes_out_ += nout ? nout * sizeof(DWORD) : size;
+      }
+    }
+
+    if (nout) {
+      BANK32 bk = *pbk;
+      bk.name[0] = 'Z';
+      bk.name[1] = 'L';
+      bk.data_size = nout * sizeof(DWORD);
+      memcpy(q, &bk, sizeof(bk));
+      memcpy(q + sizeof(bk), &out_[0], bk.data_size);
+      memset(q + sizeof(bk) + bk.data_size, 0, ALIGN8(bk.data_size) - bk.data_size);
+      q += sizeof(bk) + ALIGN8(bk.data_size);
+      nconv++;
+    } else {
+      if (q != p) memmove(q, p, next - p);
+      q += next - p;
+    }
+    p = next;
+  }
+
+  pbh->data_size = q - (char *)(pbh + 1);
+  pevent->data_size = sizeof(BANK_HEADER) + pbh->data_size;
+  return nconv;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Flag the words of one channel with a sample over threshold
+ *
+ * flag_[i] = 1 if one of the two samples of w[i] is beyond the threshold.
+ */
+void EBZeroSuppressor::FlagWords(const DWORD *w, int n, int threshold)
+{
+  uint8_t *flag = &flag_[0];
+  int i = 0;
+
+#ifdef __SSE2__
+  // 8 samples per step, as 16-bit lanes (12-bit samples: the signed compare is fine)
+  const __m128i mask = _mm_set1_epi32(0x0FFF0FFF);
+  const __m128i thr = _mm_set1_epi16((short)threshold);
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(w + i)), mask);
+    __m128i c = zs_.negative ? _mm_cmplt_epi16(v, thr) : _mm_cmpgt_epi16(v, thr);
+    int m = _mm_movemask_epi8(c);
+    flag[i]   = (m & 0x000F) != 0;
+    flag[i+1] = (m & 0x00F0) != 0;
+    flag[i+2] = (m & 0x0F00) != 0;
+    flag[i+3] = (m & 0xF000) != 0;
+  }
+#endif
+
+  for (; i < n; i++) {
+    int s0 = w[i] & 0xFFF;
+    int s1 = (w[i] >> 16) & 0xFFF;
+    if (zs_.negative) flag[i] = (s0 < threshold || s1 < threshold);
+    else              flag[i] = (s0 > threshold || s1 > threshold);
+  }
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Zero-length encode one raw V1720 bank into out_
+ *
+ * \param   [in]  raw        W2 bank payload (header + samples of each channel)
+ * \param   [in]  nwords     payload size in words
+ * \param   [in]  threshold  ADC counts
+ * \return  size of the ZL payload in words, 0 if the layout is not understood
+ */
+int EBZeroSuppressor::SuppressBank(const DWORD *raw, DWORD nwords, int threshold)
+{
+  if (nwords < 4) return 0;
+  DWORD evsize = raw[0] & 0x0FFFFFFF;
+  if ((raw[0] >> 28) != 0xA || evsize < 4 || evsize > nwords) return 0;
+
+  int nch = __builtin_popcount(raw[1] & 0xFF);
+  if (nch == 0) return 0;
+  int nsamp = (evsize - 4) / nch;     // words per channel
+  if (nsamp * nch != (int)evsize - 4) return 0;
+
+  // Worst case: size word, then one control word per data word
+  out_.resize(4 + nch * (1 + 2 * nsamp));
+  flag_.resize(nsamp);
+
+  DWORD *o = &out_[0] + 4;
+  for (int ch = 0; ch < nch; ch++) {
+    const DWORD *w = raw + 4 + ch * nsamp;
+    FlagWords(w, nsamp, threshold);
+
+    // Kept words: flags dilated by pre before and post after (in place, reading ahead)
+    uint8_t *keep = &flag_[0];
+    int keep_until = -1;
+    for (int j = 0; j < nsamp + zs_.pre; j++) {
+      if (j < nsamp && keep[j]) keep_until = j + zs_.post;
+      int i = j - zs_.pre;
+      if (i >= 0) keep[i] = (i <= keep_until);
+    }
+
+    // Runs of kept / skipped words
+    DWORD *chsize = o++;
+    for (int i = 0; i < nsamp; ) {
+      int run = 1;
+      while (i + run < nsamp && keep[i + run] == keep[i]) run++;
+      if (keep[i]) {
+        *o++ = 0x80000000 | run;
+        memcpy(o, w + i, run * sizeof(DWORD));
+        o += run;
+      } else {
+        *o++ = run;
+      }
+      i += run;
+    }
+    *chsize = o - chsize;
+  }
+
+  int nout = o - &out_[0];
+  out_[0] = 0xA0000000 | nout;
+  out_[1] = raw[1];
+  out_[2] = raw[2];
+  out_[3] = raw[3];
+  return nout;
+}
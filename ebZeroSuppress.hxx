@@ -0,0 +1,72 @@
+/*****************************************************************************/
+/**
+\file ebZeroSuppress.hxx
+
+## Contents
+
+Builder-side zero suppression of the raw V1720 waveform banks.  Some
+front-ends send W2xx banks (full readout window) instead of the ZLxx banks
+of the firmware zero-length encoding; the fragment thread turns them into
+ZLxx banks of the same format before the event goes into the ring buffer:
+
+    DWORD  0xA0000000 | event size (words)     (V1720 header, 4 words)
+    DWORD  channel mask, board id
+    DWORD  event counter
+    DWORD  trigger time tag
+    per channel in the mask:
+      DWORD  channel size (words, this one included)
+      DWORD  control: bit 31 set, n words kept follow / clear, n words skipped
+      ...
+
+A data word holds 2 samples (bits 0-11 and 16-27).  A word is kept if one
+of its samples is beyond the module threshold (below it for negative
+pulses), together with "pre" words before and "post" words after.
+ *****************************************************************************/
+
+#ifndef EBZEROSUPPRESS_HXX_INCLUDE
+#define EBZEROSUPPRESS_HXX_INCLUDE
+
+#include <stdint.h>
+#include <vector>
+
+#include "midas.h"
+
+#define EBZS_MAX_MODULES   32    //!< V1720 modules, 4 groups of 8
+
+/// Zero suppression parameters, read from the ODB at BOR
+typedef struct {
+  INT       threshold[EBZS_MAX_MODULES]; //!< ADC counts per module, 0: W2 banks of that module left as they are
+  INT       pre;                         //!< Words (2 samples) kept before a word over threshold
+  INT       post;                        //!< Words kept after
+  BOOL      negative;                    //!< Negative pulses: keep the samples below threshold
+} EBZS_SETTINGS;
+
+class EBZeroSuppressor
+{
+
+public:
+
+  EBZeroSuppressor();
+
+  void Configure(const EBZS_SETTINGS &zs);
+  bool IsEnabled() const { return enabled_; }
+
+  int SuppressEvent(EVENT_HEADER *pevent);   //!< In place; number of W2 banks converted
+
+  uint64_t GetBytesIn() const { return bytes_in_; }    //!< W2 bank bytes seen
+  uint64_t GetBytesOut() const { return bytes_out_; }  //!< Their size once suppressed
+
+private:
+
+  int SuppressBank(const DWORD *raw, DWORD nwords, int threshold);
+  void FlagWords(const DWORD *w, int n, int threshold);
+
+  EBZS_SETTINGS zs_;
+  bool enabled_;                 //!< At least one module threshold set
+  std::vector<DWORD> out_;       //!< ZL bank being built
+  std::vector<uint8_t> flag_;    //!< Words over threshold, then words kept, of one channel
+  uint64_t bytes_in_;
+  uint64_t bytes_out_;
+};
+
+#endif // EBZEROSUPPRESS_HXX_INCLUDE
@@ -27,12 +27,23 @@ event headers.
 Possible matching condition:
 
 a) Serial Number matching: final event will be composed if and only if all the 
-   active fragments have a matching serial event number. Otherwise the task will be aborted.
+   active fragments have a matching serial event number.  Each fragment thread
+   puts its events back in serial number order (ebReorder.hxx, Settings/Reorder
+   window); an event a fragment never delivered is built without that fragment
+   (EBMF bank) or skipped (Settings/Build partial events).  A fragment silent
+   while the others have events is quarantined by the poll watchdog
+   (Settings/Quarantine timeout) and left out of the events until it catches up.
 
 b) Time Stamp matching & trigger mask: final event will be composed if and only if
    all the expected fragments (defined in a trigger fragment with a trigger mask) 
    have a matching time stamp in a dedicated bank from each fragment.
 
+c) Time slices (Settings/Assembly mode 3), for trigger-less continuous readout:
+   the fragment records are placed by timestamp in fixed-length windows, one
+   event per window once no fragment still sending can add to it
+   (ebSlicer.hxx, Settings/Time slice).  No DTM fragment needed; the L2 filter,
+   load shedding, routing and bank selection don't apply.
+
 \subsubsection threadProcessing Possible inline data processing
 In the individual thread (fragment thread) it is possible to process the fragment 
 data for multi-level trigger condition evaluation. This information is to be added
@@ -42,6 +53,30 @@ to the fragment ring buffer.
 In the main thread (collector thread), it is possible after confirmation of 
 Time Stamp matching to evaluate the "extra fragment information" in order to
 dynamically change the composition of the final event.
+The optional level-2 filter (ebFilter.hxx, Settings/L2 filter) does this with
+the QT summaries of the fragment records, before the banks are merged.
+Under sustained backpressure the load shedder (ebShedder.hxx, Settings/Load
+shedding) prescales the events by DTM trigger bit, from the ring buffer levels.
+Events can also go to other output buffers than SYSTEM by DTM trigger bit
+(ebRouter.hxx, Settings/Routing), each with its own logger.  Bank types
+downstream doesn't use are left out as the banks are merged (ebBankFilter.hxx,
+Settings/Bank selection), per fragment and per trigger class.  The output
+stage can write the built events to local files itself (ebWriter.hxx,
+Settings/Disk writer), the equipment buffer getting a sample for monitoring.
+Each built event has an index of its fragments (EBFI bank, Settings/
+Fragment index bank): source, serial number, timestamp and where the banks
+of each fragment are, for the unpackers to go straight to the data they need.
+It comes after the builder's own banks (L2DC, QTSM, EBLS, EBMF), ahead of
+the fragment banks: look it up by name.  The bank ranges are byte offsets
+from the first bank of the event (right after its BANK_HEADER).
+
+\subsubsection simulation Simulation build
+With SIMULATION=1 in the Makefile, the fragment threads don't read the
+fragment Midas buffers but generate synthetic DTM/V1720/V1740/VETO events
+(EBFragment::SimulateFragment()) at the rate and sizes set under
+/Equipment/EBuilder/Settings/Simulation. If no EQ_EB equipment is defined,
+a DTM fragment and "V1720 groups" V1720 fragments are created internally.
+The output side (SYSTEM buffer, logger) is unchanged.
 
 - feBuilder.exe
 
@@ -60,6 +95,18 @@ dynamically change the composition of the final event.
 
 #include "midas.h"
 #include "ebFragment.hxx"
+#include "ebRecord.hxx"
+#include "ebPerf.hxx"
+#include "ebTrace.hxx"
+#include "ebMessage.hxx"
+#include "ebSender.hxx"
+#include "ebFilter.hxx"
+#include "ebQTSummary.hxx"
+#include "ebShedder.hxx"
+#include "ebRouter.hxx"
+#include "ebBankFilter.hxx"
+#include "ebWriter.hxx"
+#include "ebSlicer.hxx"
 
 
 // __________________________________________________________________
@@ -74,12 +121,16 @@ dynamically change the composition of the final event.
 #endif
 
 #ifndef NBFRAGMENT
-#define NBFRAGMENT      10
+#define NBFRAGMENT      10   //!< Minimum length of the EBLV/EBFR monitoring banks
 #endif
+#define NBFRAGMENT_MAX  64   //!< Max number of fragments (one bit each in the readiness mask)
 
 #define BM_BUFFER_SIZE  1000000
 #define SN_MODE 1
 #define TS_MODE 2
+#define SLICE_MODE 3
+
+#define EBFI_WORDS 7         //!< EBFI bank DWORDs per fragment
 
 #ifndef HWLOGDIR
 #define HWLOGDIR "/home/deap/pro/FrontEnd/ebuilder"
@@ -122,7 +173,6 @@ INT max_event_size_frag = 5 * 1024 * 1024 * 4 *2;
 //! buffer size to hold events
 INT event_buffer_size = 25 * max_event_size + 10000;
 
-INT _mode = 0;     //!< Assembly mode, 1: Serial Number assembly, 2: Time Stamp assembly (user code)
 INT _modulo=0;     //!< Modulo factor for event distribution
 
 //! log of hardware status
@@ -133,6 +183,12 @@ bool runInProgress = false; //!< run is in progress
 bool eor_transition_called = false;// keep track of where cm_transition(TR_STOP...) has been called.
 bool timestampErrorWarning = false;// warn user about timestamp errors
 BOOL fStrictTimestampMatching = true; // determine whether to stop run for timestamp mismatchs
+BOOL fPerfCounters = false;        // open perf_event counters on the builder threads for this run
+BOOL fScatterGather = false;       // send the fragment banks from the ring buffers with bm_send_event_sg()
+BOOL fAsyncOutput = false;         // build events in the output ring, sent by the EBSender thread
+BOOL fBuildPartial = true;         // event missing in some fragments: built without them (FALSE: skipped)
+INT quarantine_timeout = 30;       // s a fragment may hold up the others before it is quarantined, 0: never
+INT fAssemblyMode = SN_MODE;       // SN_MODE: events matched by serial number, SLICE_MODE: time slices
 
 // __________________________________________________________________
 /*-- MIDAS Function declarations -----------------------------------------*/
@@ -147,6 +203,16 @@ extern void interrupt_routine(void);  //!< Interrupt Service Routine
 
 
 INT SNAssembly(char *pevent, INT off);
+INT SliceAssembly(char *pevent, INT off);
+void SliceCollect(EBFragment *frag, DWORD now, int max);
+void FlushSlices();
+void Watchdog(uint64_t ready, uint64_t needed);
+double MaxRingLevel();
+DWORD DTMTrigger();
+bool SelectFragments();
+bool PeekRecords();
+DWORD BanksSize(char *pevent);
+INT SendScatterGather(char *pevent, int route);
 INT read_buffer_level(char *pevent, INT off);
 void * fragment_thread(void *);
 
@@ -209,9 +275,44 @@ std::vector<EBFragment> ebfragment;               //!< objects for each fragment
 std::vector<EBFragment>::iterator itebfragment;   //!< Main thread iterator
 
 
-pthread_t tid[NBFRAGMENT];                 //!< Thread ID
-int thread_retval[NBFRAGMENT] = {0};       //!< Thread return value
-int thread_fragment[NBFRAGMENT];           //!< fragment number associated with each thread
+/* Per fragment thread bookkeeping, indexed by fragment ID and sized at BOR
+ * (not resized while threads are running) */
+std::vector<pthread_t> tid;                //!< Thread ID
+std::vector<int> thread_retval;            //!< Thread return value
+uint64_t required_mask = 0;                //!< Fragment IDs needed to build an event (enabled fragments)
+uint64_t quarantined_mask = 0;             //!< Fragment IDs taken out of the assembly by the watchdog
+std::vector<DWORD> blocked_since;          //!< ss_millitime() since which a fragment holds up the others, 0 if not
+std::vector<int> rb_is_above_threshold;    //!< ring buffer above the 70% threshold (warning printed)
+
+std::vector<EBPerfCounters> perf_fragment; //!< perf counters of each fragment thread
+EBPerfCounters perf_assembly;              //!< perf counters of the assembly (main) thread
+DWORD nbuilt = 0;                          //!< Number of events built in this run
+bool perf_report_pending = false;          //!< EBPC bank to be sent with the next EBlvl event
+
+BOOL trace_dump_now = FALSE;               //!< ODB Settings/Trace/Dump now, hot-linked
+
+std::vector<const char *> sg_ptr;          //!< Scatter-gather output: header, then fragment banks
+std::vector<size_t> sg_len;                //!< Scatter-gather output: length of each piece
+std::vector<EBFragment *> sg_frag;         //!< Scatter-gather output: fragments to release after the send
+
+std::unique_ptr<EBL2Filter> l2filter;      //!< Level-2 filter of this run, NULL if none
+std::vector<char *> ev_records;            //!< Ring buffer records of the event being assembled (PeekRecords())
+EBQTSummary qt_summary;                    //!< Their merged QT summary and timestamp spread
+std::vector<EBFragment *> ev_frag;         //!< Fragments with the event being assembled (SelectFragments())
+std::vector<DWORD> ev_sn;                  //!< Serial number at the head of each enabled fragment ring
+uint64_t ev_missing = 0;                   //!< Fragment IDs without the event being assembled
+DWORD npartial = 0;                        //!< Events built without some fragments in this run
+DWORD nskipped = 0;                        //!< Events skipped for missing fragments in this run
+DWORD ndegraded = 0;                       //!< Events built without the quarantined fragments in this run
+DWORD nquarantines = 0;                    //!< Fragments quarantined in this run
+DWORD nstale = 0;                          //!< Records of quarantined fragments dropped as too old
+EBLoadShedder shedder;                     //!< Prescales by DTM trigger bit under backpressure
+EBRouter router;                           //!< Output buffers by DTM trigger bit, besides the equipment one
+EBBankFilter bankfilter;                   //!< Bank include/exclude lists, per fragment and trigger class
+EBDiskWriter writer;                       //!< Built events to local files, from the output stage
+EBTimeSlicer slicer;                       //!< Time-slice assembly (SLICE_MODE)
+BOOL fQTSummaryBank = false;               // QTSM bank (merged QT summary) in the built events
+BOOL fFragmentIndex = true;                // EBFI bank (where each fragment's banks are) in the built events
 
 /********************************************************************/
 /********************************************************************/
@@ -240,6 +341,19 @@ void seq_callback(INT h, INT hseq, void *info){
    }
 }
 
+//---------------------------------------------------------------------------------
+/**
+ * \brief   ODB hot-link on Settings/Trace/Dump now
+ *
+ * Dump the flight recorder on demand and reset the flag.
+ */
+void trace_dump_callback(INT h, INT hkey, void *info){
+  if (!trace_dump_now) return;
+  EBTrace::Dump("on demand", 0);
+  trace_dump_now = FALSE;
+  db_set_value(h, hkey, "", &trace_dump_now, sizeof(trace_dump_now), 1, TID_BOOL);
+}
+
 //---------------------------------------------------------------------------------
 /**
  * \brief   Frontend initialization
@@ -331,6 +445,28 @@ INT frontend_init() {
       }
     }
   } // for loop over odb enumeration
+
+#if SIMULATION
+  // No digitizers around: create a DTM and the V1720 group fragments ourselves
+  if (ebfragment.empty()) {
+    INT ngroups = 4;
+    size = sizeof(INT);
+    db_get_value(hDB, hEqKey, EQ_NAME "/Settings/Simulation/V1720 groups", &ngroups, &size, TID_INT, TRUE);
+    for (int ig = -1; ig < ngroups && ig < 4; ig++) {
+      char name[NAME_LENGTH];
+      if (ig < 0) sprintf(name, "SimDTM");
+      else        sprintf(name, "SimV1720-%d", ig);
+      ebfragment.push_back(hDB);
+      ebfragment.back().SetVerbosity(0);
+      ebfragment.back().SetEqpName(name);
+      ebfragment.back().SetFrontEndName(name);
+      ebfragment.back().SetBufferName(name);
+      ebfragment.back().SetTmask((ig < 0) ? 0x1 : (0x2 << ig));
+      ebfragment.back().SetEvID(1);
+    }
+    printf("SIMULATION: created %ld internal fragments\n", ebfragment.size());
+  }
+#endif
   
   if (debug) {
     printf("Number of objects: ebfragment.size()=%ld\n", ebfragment.size());
@@ -376,6 +512,12 @@ INT frontend_init() {
     }
   }
   
+  if (ebfragment.size() > NBFRAGMENT_MAX) {
+    cm_msg(MERROR, "frontend_init", "Found %d EQ_EB fragments, the event builder handles at most %d"
+           , (int)ebfragment.size(), NBFRAGMENT_MAX);
+    return FE_ERR_ODB;
+  }
+
   // No more fragment to register
   if (ebfragment.size() >= 1)
     printf("Found %ld fragments for event building\n", ebfragment.size());
@@ -391,12 +533,24 @@ INT frontend_init() {
   sprintf(set_str, "%s/Settings", EQ_NAME);
   db_find_key(hDB, hEqKey, set_str, &hsf);
   
-  size = sizeof(INT);
-  db_get_value(hDB, hsf
-	       , "Assembly mode", &_mode, &size, TID_INT, TRUE);  // Create if not present
   size = sizeof(INT);
   db_get_value(hDB, hsf
 	       , "Modulo", &_modulo, &size, TID_INT, TRUE);  // Create if not present
+
+  // Diagnostics from the builder threads go through the rate-limited message queue
+  INT msg_limit = 10, msg_interval = 60;
+  size = sizeof(INT);
+  db_get_value(hDB, hsf, "Messages/Limit per type", &msg_limit, &size, TID_INT, TRUE);
+  size = sizeof(INT);
+  db_get_value(hDB, hsf, "Messages/Interval (s)", &msg_interval, &size, TID_INT, TRUE);
+  EBMessage::Start(msg_limit, msg_interval);
+
+  // Flight recorder on-demand dump
+  HNDLE hdump;
+  size = sizeof(trace_dump_now);
+  db_get_value(hDB, hsf, "Trace/Dump now", &trace_dump_now, &size, TID_BOOL, TRUE);
+  if (db_find_key(hDB, hsf, "Trace/Dump now", &hdump) == DB_SUCCESS)
+    db_open_record(hDB, hdump, &trace_dump_now, sizeof(trace_dump_now), MODE_READ, trace_dump_callback, NULL);
   
   // CPU core allocation (0 for the main thread)
   cpu_set_t mask;
@@ -429,6 +583,8 @@ INT frontend_exit(){
 	   itebfragment->Disconnect();
    }
 
+   EBMessage::Stop();
+
    set_equipment_status(equipment[EBUILDER_EQUIPMENT].name, "Exited", "#00ff00");
    return SUCCESS;
 }
@@ -450,6 +606,9 @@ int thread_cleanup(){
 				
 	// This will exit the threads
 	runInProgress = false;
+	EBSender::Stop();
+	writer.Close(hDB);
+	router.Close();
 
 	for (itebfragment = ebfragment.begin(); itebfragment != ebfragment.end(); ++itebfragment) {
 		if (! itebfragment->IsEnabled()) continue;   // Skip disabled fragment
@@ -458,10 +617,12 @@ int thread_cleanup(){
 		if(itebfragment->GetThreadStatus() == 0) continue;
 
 		pthread_join(tid[itebfragment->GetFragmentID()],(void**)&status);
+		itebfragment->StopQTPool();
 				
 		// Reset thread status
 		itebfragment->SetThreadStatus(0);
 
+#if !SIMULATION
 		// Remove event requestID		
 		//		cm_msg(MINFO,"EOR", "DElete request (%i) %s",itebfragment->GetFragmentID(),itebfragment->GetEqpName().c_str());
 		status1 = bm_delete_request(itebfragment->GetRequestID());
@@ -479,6 +640,9 @@ int thread_cleanup(){
 			return status1;
 		}
 		itebfragment->SetBufferHandle(-1);
+#else
+		UNUSED(status1);
+#endif
 		
 		// Delete Ring Buffer
 		rb_delete(itebfragment->GetRingBufferHandle());
@@ -547,10 +711,250 @@ INT begin_of_run(INT run_number, char *error) {
   int rebin_factor = 0;
   size = sizeof(rebin_factor);
   db_get_value(hDB, hsf, "QT summary rebin factor", &rebin_factor, &size, TID_INT, TRUE);
+  // Optional helper threads per V1720 group for the QT summary of large fragments
+  int qt_workers = 0;
+  int qt_min_banks = 16;
+  size = sizeof(qt_workers);
+  db_get_value(hDB, hsf, "QT workers per fragment", &qt_workers, &size, TID_INT, TRUE);
+  size = sizeof(qt_min_banks);
+  db_get_value(hDB, hsf, "QT workers min banks", &qt_min_banks, &size, TID_INT, TRUE);
+  // Zero suppression of the raw W2 banks (ebZeroSuppress.hxx), threshold 0: module off
+  EBZS_SETTINGS zs;
+  memset(&zs, 0, sizeof(zs));
+  zs.pre = 8;
+  zs.post = 8;
+  zs.negative = TRUE;
+  size = sizeof(zs.threshold);
+  db_get_value(hDB, hsf, "Zero suppression/Threshold", zs.threshold, &size, TID_INT, TRUE);
+  size = sizeof(zs.pre);
+  db_get_value(hDB, hsf, "Zero suppression/Pre words", &zs.pre, &size, TID_INT, TRUE);
+  size = sizeof(zs.post);
+  db_get_value(hDB, hsf, "Zero suppression/Post words", &zs.post, &size, TID_INT, TRUE);
+  size = sizeof(zs.negative);
+  db_get_value(hDB, hsf, "Zero suppression/Negative pulses", &zs.negative, &size, TID_BOOL, TRUE);
+  // Detector-wide QT summary bank, merged from the fragment records (ebQTSummary.hxx)
+  size = sizeof(fQTSummaryBank);
+  db_get_value(hDB, hsf, "QT summary bank", &fQTSummaryBank, &size, TID_BOOL, TRUE);
+  // Fragment index bank: per fragment, source, serial number, timestamp and bank range
+  size = sizeof(fFragmentIndex);
+  db_get_value(hDB, hsf, "Fragment index bank", &fFragmentIndex, &size, TID_BOOL, TRUE);
+  qt_summary.SetRebin(rebin_factor);
+  // Level-2 filter on the fragment records, before the bank merging (ebFilter.hxx)
+  char l2_type[32] = "";
+  INT l2_prescale = 0;
+  size = sizeof(l2_type);
+  db_get_value(hDB, hsf, "L2 filter/Type", l2_type, &size, TID_STRING, TRUE);
+  size = sizeof(l2_prescale);
+  db_get_value(hDB, hsf, "L2 filter/Prescale", &l2_prescale, &size, TID_INT, TRUE);
+  l2filter.reset(EBL2Filter::Create(l2_type));
+  if (l2filter) {
+    HNDLE hl2 = 0;
+    db_find_key(hDB, hsf, "L2 filter", &hl2);
+    l2filter->Configure(hDB, hl2, rebin_factor);
+    l2filter->SetPrescale(l2_prescale);
+    cm_msg(MINFO, "BOR", "L2 filter %s, 1 in %d rejected events kept", l2filter->GetType(), l2_prescale);
+  }
+  // QT summary only computed if used: by the fragment threads, or by the assembly on demand
+  BOOL qt_lazy = FALSE;
+  size = sizeof(qt_lazy);
+  db_get_value(hDB, hsf, "QT summary in assembly", &qt_lazy, &size, TID_BOOL, TRUE);
+  bool qt_needed = l2filter || fQTSummaryBank;
+  qt_summary.SetLazy(qt_needed && qt_lazy);
+  // QT summary in the ring records as (bin, N, Q) of the bins used, not full Q and N arrays
+  BOOL qt_compact = TRUE;
+  size = sizeof(qt_compact);
+  db_get_value(hDB, hsf, "Compact QT trailer", &qt_compact, &size, TID_BOOL, TRUE);
+  // Load shedding by DTM trigger bit when the ring buffers fill up (ebShedder.hxx)
+  HNDLE hls = 0;
+  if (db_find_key(hDB, hsf, "Load shedding", &hls) != DB_SUCCESS) {
+    db_create_key(hDB, hsf, "Load shedding", TID_KEY);
+    db_find_key(hDB, hsf, "Load shedding", &hls);
+  }
+  shedder.Configure(hDB, hls);
+  if (!qt_needed)
+    cm_msg(MINFO, "BOR", "QT summary not used (no L2 filter, no QT summary bank): not computed");
 
   // Get the ODB variable that determines whether to stop the run for timestamp mismatchs. 
   size = sizeof(fStrictTimestampMatching); 
   db_get_value(hDB, hsf, "strictTimestampMatching",&fStrictTimestampMatching, &size, TID_BOOL, TRUE);
+
+  // Hardware performance counters on the fragment and assembly threads, reported at EOR
+  size = sizeof(fPerfCounters);
+  db_get_value(hDB, hsf, "Perf counters", &fPerfCounters, &size, TID_BOOL, TRUE);
+  // Output path: banks copied into the mfe event (FALSE) or gathered from the ring buffers (TRUE)
+  size = sizeof(fScatterGather);
+  db_get_value(hDB, hsf, "Scatter-gather output", &fScatterGather, &size, TID_BOOL, TRUE);
+  // Out-of-order fragments put back in order (ebReorder.hxx); event missing in a fragment:
+  // given up on after the timeout, then built without that fragment or skipped
+  INT reorder_window = 16;
+  INT reorder_timeout = 100;
+  size = sizeof(reorder_window);
+  db_get_value(hDB, hsf, "Reorder window", &reorder_window, &size, TID_INT, TRUE);
+  size = sizeof(reorder_timeout);
+  db_get_value(hDB, hsf, "Reorder timeout (ms)", &reorder_timeout, &size, TID_INT, TRUE);
+  size = sizeof(fBuildPartial);
+  db_get_value(hDB, hsf, "Build partial events", &fBuildPartial, &size, TID_BOOL, TRUE);
+  // Watchdog: fragment without events while the others have some, taken out of the assembly
+  size = sizeof(quarantine_timeout);
+  db_get_value(hDB, hsf, "Quarantine timeout (s)", &quarantine_timeout, &size, TID_INT, TRUE);
+  // Assembly: events matched by serial number, or time slices (ebSlicer.hxx)
+  fAssemblyMode = SN_MODE;
+  size = sizeof(fAssemblyMode);
+  db_get_value(hDB, hsf, "Assembly mode", &fAssemblyMode, &size, TID_INT, TRUE);
+  if (fAssemblyMode == 0)   // created 0 by older versions
+    fAssemblyMode = SN_MODE;
+  if (fAssemblyMode != SN_MODE && fAssemblyMode != SLICE_MODE) {
+    cm_msg(MERROR, "BOR", "Assembly mode %d not supported (%d: serial number, %d: time slices): serial number matching"
+           , fAssemblyMode, SN_MODE, SLICE_MODE);
+    fAssemblyMode = SN_MODE;
+  }
+  HNDLE hts = 0;
+  if (db_find_key(hDB, hsf, "Time slice", &hts) != DB_SUCCESS) {
+    db_create_key(hDB, hsf, "Time slice", TID_KEY);
+    db_find_key(hDB, hsf, "Time slice", &hts);
+  }
+  slicer.Configure(hDB, hts, max_event_size);
+  if (fAssemblyMode == SLICE_MODE && fScatterGather) {
+    cm_msg(MINFO, "BOR", "Time slices: scatter-gather output ignored");
+    fScatterGather = false;
+  }
+  equipment[EBUILDER_EQUIPMENT].readout = (fAssemblyMode == SLICE_MODE) ? SliceAssembly : SNAssembly;
+  // Output stage: own ring buffer and sender thread, batches of events per flush
+  INT async_ring_size = 10 * max_event_size;
+  INT async_batch = 16;
+  size = sizeof(fAsyncOutput);
+  db_get_value(hDB, hsf, "Async output", &fAsyncOutput, &size, TID_BOOL, TRUE);
+  size = sizeof(async_ring_size);
+  db_get_value(hDB, hsf, "Async output ring size", &async_ring_size, &size, TID_INT, TRUE);
+  size = sizeof(async_batch);
+  db_get_value(hDB, hsf, "Async output batch", &async_batch, &size, TID_INT, TRUE);
+  // Multi-event packing (ebPacked.hxx), done by the output stage
+  INT pack_events = 1;
+  INT pack_bytes = 0;
+  INT pack_delay = 10;
+  size = sizeof(pack_events);
+  db_get_value(hDB, hsf, "Packing/Max events", &pack_events, &size, TID_INT, TRUE);
+  size = sizeof(pack_bytes);
+  db_get_value(hDB, hsf, "Packing/Max bytes", &pack_bytes, &size, TID_INT, TRUE);
+  size = sizeof(pack_delay);
+  db_get_value(hDB, hsf, "Packing/Max delay (ms)", &pack_delay, &size, TID_INT, TRUE);
+  EBSender::SetPacking(pack_events, pack_bytes, pack_delay);
+  if (pack_events > 1 && !fAsyncOutput) {
+    cm_msg(MINFO, "BOR", "Packing %d events per container: async output on", pack_events);
+    fAsyncOutput = true;
+  }
+  // Waveform bank compression (ebCompress.hxx), done by the output stage
+  INT zip_workers = 0;
+  INT zip_level = 1;
+  INT zip_min_bytes = 4096;
+  size = sizeof(zip_workers);
+  db_get_value(hDB, hsf, "Compression/Workers", &zip_workers, &size, TID_INT, TRUE);
+  size = sizeof(zip_level);
+  db_get_value(hDB, hsf, "Compression/Level", &zip_level, &size, TID_INT, TRUE);
+  size = sizeof(zip_min_bytes);
+  db_get_value(hDB, hsf, "Compression/Min bank bytes", &zip_min_bytes, &size, TID_INT, TRUE);
+  EBSender::SetCompression(zip_workers, zip_level, zip_min_bytes);
+  if (zip_workers > 0 && !fAsyncOutput) {
+    cm_msg(MINFO, "BOR", "Compression with %d workers: async output on", zip_workers);
+    fAsyncOutput = true;
+  }
+  // Built-in writer to local files (ebWriter.hxx), run by the output stage
+  HNDLE hdw = 0;
+  if (db_find_key(hDB, hsf, "Disk writer", &hdw) != DB_SUCCESS) {
+    db_create_key(hDB, hsf, "Disk writer", TID_KEY);
+    db_find_key(hDB, hsf, "Disk writer", &hdw);
+  }
+  writer.Configure(hDB, hdw);
+  EBSender::SetWriter(NULL);
+  if (writer.IsEnabled()) {
+    if (!fAsyncOutput) {
+      cm_msg(MINFO, "BOR", "Disk writer: async output on");
+      fAsyncOutput = true;
+    }
+    if (writer.Open(hDB, run_number))
+      EBSender::SetWriter(&writer);
+    else
+      cm_msg(MERROR, "BOR", "Disk writer off: events to buffer %s", equipment[EBUILDER_EQUIPMENT].info.buffer);
+  }
+  if (fAsyncOutput) {
+    if (fScatterGather) {
+      cm_msg(MINFO, "BOR", "Async output: scatter-gather output ignored");
+      fScatterGather = false;
+    }
+    if (!EBSender::Start(equipment[EBUILDER_EQUIPMENT].buffer_handle, async_ring_size, max_event_size, async_batch)) {
+      fAsyncOutput = false;
+      writer.Close(hDB);
+    }
+  }
+  // Trigger-class routing to other output buffers (ebRouter.hxx)
+  HNDLE hrt = 0;
+  if (db_find_key(hDB, hsf, "Routing", &hrt) != DB_SUCCESS) {
+    db_create_key(hDB, hsf, "Routing", TID_KEY);
+    db_find_key(hDB, hsf, "Routing", &hrt);
+  }
+  if (!router.Configure(hDB, hrt, equipment[EBUILDER_EQUIPMENT].info.buffer)) {
+    set_equipment_status(equipment[EBUILDER_EQUIPMENT].name, "Ended run", "#00ff00");
+    thread_cleanup();
+    return BM_CONFLICT;
+  }
+  // Bank include/exclude lists applied at the merge (ebBankFilter.hxx), fragment lists below
+  HNDLE hbs = 0;
+  if (db_find_key(hDB, hsf, "Bank selection", &hbs) != DB_SUCCESS) {
+    db_create_key(hDB, hsf, "Bank selection", TID_KEY);
+    db_find_key(hDB, hsf, "Bank selection", &hbs);
+  }
+  bankfilter.Configure(hDB, hbs);
+  // Flight recorder: ring size per thread, and how far back a dump goes
+  INT trace_records = 65536;
+  double trace_seconds = 10.;
+  char trace_dir[256] = ".";
+  size = sizeof(trace_records);
+  db_get_value(hDB, hsf, "Trace/Records per thread", &trace_records, &size, TID_INT, TRUE);
+  size = sizeof(trace_seconds);
+  db_get_value(hDB, hsf, "Trace/Dump seconds", &trace_seconds, &size, TID_DOUBLE, TRUE);
+  size = sizeof(trace_dir);
+  db_get_value(hDB, hsf, "Trace/Dump directory", trace_dir, &size, TID_STRING, TRUE);
+  EBTrace::Init(ebfragment.size(), trace_records);
+  EBTrace::SetDumpSeconds(trace_seconds);
+  EBTrace::SetDumpDir(trace_dir);
+
+  nbuilt = 0;
+  perf_report_pending = false;
+  if (fPerfCounters && !perf_assembly.Open())
+    cm_msg(MINFO, "BOR", "Cannot open perf counters (check /proc/sys/kernel/perf_event_paranoid)");
+
+#if SIMULATION
+  // Event generator parameters, common to all the fragments
+  EBFragment::EBSIMULATION_SETTINGS sim;
+  sim.rate = 100.;
+  sim.nmodules = 8;
+  sim.npulses = 20;
+  sim.zlwords = 500;
+  sim.dtmtrigger = 0x4;
+  sim.swapped = 0.;
+  sim.lost = 0.;
+  size = sizeof(sim.rate);
+  db_get_value(hDB, hsf, "Simulation/Rate (Hz)", &sim.rate, &size, TID_FLOAT, TRUE);
+  size = sizeof(sim.nmodules);
+  db_get_value(hDB, hsf, "Simulation/V1720 modules per group", &sim.nmodules, &size, TID_INT, TRUE);
+  size = sizeof(sim.npulses);
+  db_get_value(hDB, hsf, "Simulation/QT pulses per module", &sim.npulses, &size, TID_INT, TRUE);
+  size = sizeof(sim.zlwords);
+  db_get_value(hDB, hsf, "Simulation/ZL words per module", &sim.zlwords, &size, TID_INT, TRUE);
+  size = sizeof(sim.dtmtrigger);
+  db_get_value(hDB, hsf, "Simulation/DTM trigger bits", &sim.dtmtrigger, &size, TID_INT, TRUE);
+  size = sizeof(sim.swapped);
+  db_get_value(hDB, hsf, "Simulation/Swapped fraction", &sim.swapped, &size, TID_FLOAT, TRUE);
+  size = sizeof(sim.lost);
+  db_get_value(hDB, hsf, "Simulation/Lost fraction", &sim.lost, &size, TID_FLOAT, TRUE);
+  // Bank names carry the module number on two digits
+  if (sim.nmodules > 99) {
+    cm_msg(MINFO, "BOR", "SIMULATION: %d V1720 modules per group, limited to 99", sim.nmodules);
+    sim.nmodules = 99;
+  }
+  cm_msg(MINFO, "BOR", "SIMULATION: generating %.1f Hz, %d modules/group, %d pulses/module, %d ZL words/module"
+         , sim.rate, sim.nmodules, sim.npulses, sim.zlwords);
+#endif
   
   
   /* local flag indicating that a run is in progress
@@ -563,6 +967,23 @@ INT begin_of_run(INT run_number, char *error) {
   
   timestampErrorWarning = false;
   
+  // Per-fragment thread bookkeeping; no fragment thread is running at this point
+  tid.resize(ebfragment.size());
+  thread_retval.assign(ebfragment.size(), 0);
+  perf_fragment.resize(ebfragment.size());
+  sg_ptr.reserve(ebfragment.size() + 1);
+  sg_len.reserve(ebfragment.size() + 1);
+  sg_frag.reserve(ebfragment.size());
+  ev_frag.reserve(ebfragment.size());
+  ev_sn.reserve(ebfragment.size());
+  npartial = nskipped = 0;
+  ndegraded = nquarantines = nstale = 0;
+  blocked_since.assign(ebfragment.size(), 0);
+  quarantined_mask = 0;
+  rb_is_above_threshold.assign(ebfragment.size(), 0);
+  required_mask = 0;
+  EBFragment::ResetReadyMask();
+
   // Per found fragment in the ODB equipment list
   for (itebfragment = ebfragment.begin(); itebfragment != ebfragment.end(); ++itebfragment) {
     
@@ -580,6 +1001,7 @@ INT begin_of_run(INT run_number, char *error) {
       continue;   // Skip disabled fragment
     }
     
+#if !SIMULATION
     int check_fragment_running = cm_exist(itebfragment->GetFrontEndName().c_str(), TRUE);
     if(check_fragment_running != CM_SUCCESS){
       cm_msg(MERROR, "feBuilder:BOR", "Event Builder Fragment %s (program %s) is not running. Not allowed: abort run. Disable this EB fragment or start front-end."
@@ -589,6 +1011,7 @@ INT begin_of_run(INT run_number, char *error) {
       return BM_CONFLICT;
       
     }
+#endif
     
     // Make sure the fragment buffer is not 'SYSTEM'.  That will presumably cause problems.
     if(strcmp (itebfragment->GetBufferName().c_str(),"SYSTEM") == 0){
@@ -601,7 +1024,23 @@ INT begin_of_run(INT run_number, char *error) {
     
     // Set the binning for the QT summary histogram
     itebfragment->SetRebinFactor(rebin_factor);
+    if (itebfragment->SetZeroSuppression(zs))
+      printf("Zero suppression of the W2 banks of %s\n", itebfragment->GetEqpName().c_str());
+    // QT summary (if used and not left to the assembly), its worker pool (V1720 groups only),
+    // then the bank decoder for this fragment type
+    itebfragment->SetQTSummary(qt_needed && !qt_lazy);
+    itebfragment->SetCompactQT(qt_compact);
+    if (itebfragment->StartQTPool(qt_workers, qt_min_banks))
+      printf("QT summary: %d helper threads for %s\n", qt_workers, itebfragment->GetEqpName().c_str());
+    itebfragment->SelectDecoder();
     
+#if SIMULATION
+    // Events are generated in the fragment thread, no buffer to connect to
+    itebfragment->SetSimulation(sim);
+    itebfragment->SetBufferHandle(-1);
+    itebfragment->SetRequestID(-1);
+    status1 = status2 = BM_SUCCESS;
+#else
     // Connect to fragment buffer
     int bh;
     status1 = bm_open_buffer((itebfragment->GetBufferName().c_str()), BM_BUFFER_SIZE, &bh);
@@ -638,6 +1077,7 @@ INT begin_of_run(INT run_number, char *error) {
       thread_cleanup();
       return BM_CONFLICT;
     }
+#endif // SIMULATION
     
     // Create ring buffer for fragment
     status = rb_create(event_buffer_size, max_event_size, &rb_handle);
@@ -656,6 +1096,10 @@ INT begin_of_run(INT run_number, char *error) {
     
     //Create one thread per fragment
     int fid = itebfragment - ebfragment.begin();
+    // Set the ID before the thread starts, it uses it right away
+    itebfragment->SetFragmentID(fid);
+    itebfragment->SetReorderWindow(reorder_window, reorder_timeout);
+    bankfilter.ConfigureFragment(hDB, hbs, fid, itebfragment->GetEqpName().c_str());
     status = pthread_create(&tid[fid], NULL, &fragment_thread, (void*)&*itebfragment);
     if(status) {
       cm_msg(MERROR,"feBuilder:BOR", "Couldn't create thread for fragment %d. Return code: %d"
@@ -666,8 +1110,8 @@ INT begin_of_run(INT run_number, char *error) {
     }
     
     // Register FragmentID for all the fragments -> make a thread even for the 1st one
-    itebfragment->SetFragmentID(fid);
     itebfragment->SetThreadStatus(1);
+    required_mask |= (1ULL << fid);
     
     // Register the correct DTM trigger mask id for this fragment.  
     int dtm_trigger_mask_id = -1;
@@ -692,6 +1136,9 @@ INT begin_of_run(INT run_number, char *error) {
       printf(" trigger mask:0x%4.4x\n", itebfragment->GetTmask());
     }
   }  // for fragment
+
+  if (fAssemblyMode == SLICE_MODE)
+    slicer.Start(required_mask, ss_millitime());
   
   // Done
   set_equipment_status(equipment[EBUILDER_EQUIPMENT].name, "Started run", "#00ff00");
@@ -714,13 +1161,14 @@ INT begin_of_run(INT run_number, char *error) {
  */
 void * fragment_thread(void * arg) {
 
-  std::cout << "Start a thread " << std::endl;
   EBFragment * pebfragment = (EBFragment *) arg;
   int rb_handle = pebfragment->GetRingBufferHandle();
   int fragment = pebfragment->GetFragmentID();
   void *wp;
   int status;
   int rb_level;
+  uint64_t nread = 0;
+  bool throttled = false;
 
   /* Fragments have been sorted to have the TimeStamp fragment "Trigger fragment" first
    * The "Trigger fragment" will be dealt in the main thread during the event assembly
@@ -749,11 +1197,15 @@ void * fragment_thread(void * arg) {
   
 #if 1
   if( sched_setaffinity(0, sizeof(mask), &mask) < 0 ) {
-    printf("ERROR setting cpu affinity for thread %d: %s\n", fragment, strerror(errno));
+    EB_POST(EBMessage::kAffinity, EBMSG_STDOUT, "fragment_thread", "ERROR setting cpu affinity for thread %d: %s", fragment, strerror(errno));
   }
 #endif
   
-  std::cout << "Started thread for "<< pebfragment->GetBufferName()<<"[" << fragment << "]" << std::endl;
+  EB_POST(EBMessage::kThreadStart, EBMSG_STDOUT, "fragment_thread", "Started thread for %s[%d]", pebfragment->GetBufferName().c_str(), fragment);
+
+  // Counters are per thread, so they have to be opened from here
+  if (fPerfCounters) perf_fragment[fragment].Open();
+
   // Get rb handle
   rb_handle = pebfragment->GetRingBufferHandle();
   
@@ -769,6 +1221,8 @@ void * fragment_thread(void * arg) {
 		 */		
 		rb_get_buffer_level(pebfragment->GetRingBufferHandle(), &rb_level);
 		if(rb_level > (int)(event_buffer_size*0.75)){			
+			if (!throttled) EBTrace::Record(fragment, EBTrace::kRingFull, rb_level/1024);
+			throttled = true;
 			usleep(1000);
 			// Allow to break out in case where the ring buffer is still fulled, but run is stopped.
 			if(!runInProgress)
@@ -776,13 +1230,16 @@ void * fragment_thread(void * arg) {
 
 			continue;
 		}
+		if (throttled) EBTrace::Record(fragment, EBTrace::kRingFull, 0);
+		throttled = false;
 
 		
 
     // Get wp for destination location
     status = rb_get_wp(rb_handle, &wp, 100);
     if (status == DB_TIMEOUT) {
-      cm_msg(MERROR,"fragment_thread", "Got wp timeout for fragment %s (ID = %d)", pebfragment->GetEqpName().c_str(), pebfragment->GetFragmentID());
+      EB_POST(EBMessage::kWpTimeout, MT_ERROR, "fragment_thread", "Got wp timeout for fragment %s (ID = %d)", pebfragment->GetEqpName().c_str(), pebfragment->GetFragmentID());
+      EBTrace::Dump("wp timeout");
       thread_retval[fragment] = -1;
       pthread_exit((void*)&thread_retval[fragment]);
     }
@@ -798,6 +1255,8 @@ void * fragment_thread(void * arg) {
 
 			// Successfully read and processed event, so incrememnt number of event in ring buffer.
 			pebfragment->IncrementNumEventsInRB(); //atomic
+			nread++;
+			EBTrace::Record(fragment, EBTrace::kPublish, pebfragment->GetNumEventsInRB());
 
 		} else {
 	/* Do timeout as no event were available yet
@@ -813,6 +1272,8 @@ void * fragment_thread(void * arg) {
 			break;
 	} // While forever
 	
+	if (fPerfCounters) perf_fragment[fragment].Stop(nread);
+
 	//cm_msg(MINFO,"fragment_thread", "Exiting thread (%d) %s", fragment, pebfragment->GetEqpName().c_str());
 	thread_retval[fragment] = 0;
 	pthread_exit((void*)&thread_retval[fragment]);
@@ -856,6 +1317,16 @@ INT end_of_run(INT run_number, char *error)
 
 			pthread_join(tid[itebfragment->GetFragmentID()],(void**)&status);
 			printf(">>> Thread %d joined, return code: %d\n", itebfragment->GetFragmentID(), *status);
+			itebfragment->StopQTPool();
+			const EBReorderWindow &reorder = itebfragment->GetReorderWindow();
+			if (reorder.GetReordered() || reorder.GetMissing() || reorder.GetDropped())
+				cm_msg(MINFO, "EOR", "Reorder window %s: %llu events put back in order, %llu missing, %llu late or duplicate"
+				       , itebfragment->GetEqpName().c_str(), (unsigned long long)reorder.GetReordered()
+				       , (unsigned long long)reorder.GetMissing(), (unsigned long long)reorder.GetDropped());
+			const EBZeroSuppressor &zsup = itebfragment->GetZeroSuppressor();
+			if (zsup.GetBytesIn())
+				cm_msg(MINFO, "EOR", "Zero suppression %s: %.1f MB of W2 banks, %.1f MB out"
+				       , itebfragment->GetEqpName().c_str(), zsup.GetBytesIn() / 1e6, zsup.GetBytesOut() / 1e6);
 
 			// Reset thread status
 			itebfragment->SetThreadStatus(0);
@@ -863,6 +1334,7 @@ INT end_of_run(INT run_number, char *error)
 			// Empty the remote BM buffers
 			//	bm_empty_buffers();
 
+#if !SIMULATION
 			// Remove event requestID
 			
 			status1 = bm_delete_request(itebfragment->GetRequestID());
@@ -879,6 +1351,13 @@ INT end_of_run(INT run_number, char *error)
 				return status1;
 			}
 			itebfragment->SetBufferHandle(-1);
+#else
+			UNUSED(status1);
+#endif
+
+			// Time slices: what is left in the ring buffer goes in the last slices
+			if (fAssemblyMode == SLICE_MODE)
+				SliceCollect(&*itebfragment, ss_millitime(), itebfragment->GetNumEventsInRB());
 
 			// Delete Ring Buffer
 			rb_delete(itebfragment->GetRingBufferHandle());
@@ -894,8 +1373,79 @@ INT end_of_run(INT run_number, char *error)
 
 			}
 		}
+
+		if (fAssemblyMode == SLICE_MODE)
+			FlushSlices();
+		if (fAssemblyMode == SLICE_MODE)
+			cm_msg(MINFO, "EOR", "Time slices: %llu built with %llu records; records dropped: %llu late, %llu without timestamp, %llu over the event size; %llu closed early, %d (%llu records) left open"
+			       , (unsigned long long)slicer.GetSlices(), (unsigned long long)slicer.GetRecords()
+			       , (unsigned long long)slicer.GetLate(), (unsigned long long)slicer.GetNoTimestamp()
+			       , (unsigned long long)slicer.GetOverflow(), (unsigned long long)slicer.GetForced()
+			       , slicer.GetOpen(), (unsigned long long)slicer.GetOpenRecords());
+		if (npartial || nskipped)
+			cm_msg(MINFO, "EOR", "Events missing in some fragments: %u built without them, %u skipped", npartial, nskipped);
+		if (nquarantines)
+			cm_msg(MINFO, "EOR", "Watchdog: %u fragments quarantined, %u events built without them, %u stale events dropped"
+			       , nquarantines, ndegraded, nstale);
+
+		if (shedder.IsEnabled())
+			cm_msg(MINFO, "EOR", "Load shedding: %llu events kept, %llu shed, %d prescale changes"
+			       , (unsigned long long)shedder.GetKept(), (unsigned long long)shedder.GetShed(), shedder.GetSteps());
+
+		if (l2filter)
+			cm_msg(MINFO, "EOR", "L2 filter %s: %llu accepted, %llu prescaled, %llu rejected", l2filter->GetType()
+			       , (unsigned long long)l2filter->GetAccepted(), (unsigned long long)l2filter->GetPrescaled()
+			       , (unsigned long long)l2filter->GetRejected());
+
+		// Events still in the output ring go out before the end-of-run transition
+		if (fAsyncOutput) {
+			EBSender::Stop();
+			cm_msg(MINFO, "EOR", "Output: %llu events queued, %llu sent in %llu batches (%llu containers), assembly waited %.3f s, sender waited %.3f s"
+			       , (unsigned long long)EBSender::GetQueued(), (unsigned long long)EBSender::GetSent()
+			       , (unsigned long long)EBSender::GetBatches(), (unsigned long long)EBSender::GetContainers()
+			       , EBSender::GetAssemblyWait(), EBSender::GetSenderWait());
+			if (EBSender::GetBytesIn())
+				cm_msg(MINFO, "EOR", "Compression: %.1f MB in, %.1f MB out (%.2f), %llu events too large sent uncompressed"
+				       , EBSender::GetBytesIn() / 1e6, EBSender::GetBytesOut() / 1e6
+				       , (double)EBSender::GetBytesOut() / EBSender::GetBytesIn()
+				       , (unsigned long long)EBSender::GetUncompressed());
+			if (writer.GetFiles())
+				cm_msg(MINFO, "EOR", "Disk writer: %.1f MB in %llu files, sender waited %.3f s for the disk, %llu events sampled to %s (%llu dropped)"
+				       , writer.GetBytes() / 1e6, (unsigned long long)writer.GetFiles(), writer.GetWaitTime()
+				       , (unsigned long long)EBSender::GetMonitorSent(), equipment[EBUILDER_EQUIPMENT].info.buffer
+				       , (unsigned long long)EBSender::GetMonitorDropped());
+			writer.Close(hDB);
+		}
+
+		// Other output buffers: what went where
+		for (int i = 0; i < router.GetNumRoutes(); i++)
+			cm_msg(MINFO, "EOR", "Route to %s: %llu events, %.1f MB, %llu dropped (buffer full)", router.GetBufferName(i)
+			       , (unsigned long long)router.GetEvents(i), router.GetBytes(i) / 1e6, (unsigned long long)router.GetDropped(i));
+		router.Close();
+
+		if (bankfilter.IsEnabled() && bankfilter.GetBanksDropped())
+			cm_msg(MINFO, "EOR", "Bank selection: %llu banks dropped, %.1f MB (%.1f%% of the fragments selected)"
+			       , (unsigned long long)bankfilter.GetBanksDropped(), bankfilter.GetBytesDropped() / 1e6
+			       , 100. * bankfilter.GetBytesDropped() / (bankfilter.GetBytesDropped() + bankfilter.GetBytesKept()));
   }
 
+	// Perf counter summary; the EBPC bank goes out with the EOR EBlvl event
+	if(fPerfCounters && !perf_report_pending){
+		perf_assembly.Stop(nbuilt);
+		for (unsigned int i = 0; i <= ebfragment.size(); i++) {
+			if (i < ebfragment.size() && !ebfragment[i].IsEnabled()) continue;   // counters of an earlier run
+			EBPerfCounters &pc = (i < ebfragment.size()) ? perf_fragment[i] : perf_assembly;
+			if (!pc.IsValid()) continue;
+			cm_msg(MINFO, "EOR", "perf %s: %llu events, per event: %.0f cycles, %.0f instructions, %.1f LLC-misses, %.1f branch-misses, %.3f context-switches"
+			       , (i < ebfragment.size()) ? ebfragment[i].GetEqpName().c_str() : "assembly"
+			       , (unsigned long long)pc.GetEvents()
+			       , pc.GetPerEvent(EBPerfCounters::kCycles), pc.GetPerEvent(EBPerfCounters::kInstructions)
+			       , pc.GetPerEvent(EBPerfCounters::kLLCMisses), pc.GetPerEvent(EBPerfCounters::kBranchMisses)
+			       , pc.GetPerEvent(EBPerfCounters::kContextSwitches));
+		}
+		perf_report_pending = true;
+	}
+
 	if(eor_transition_called){
 		cm_msg(MERROR, "EndOfRun", "This run was stopped automatically because of timestamp mismatches in event builder. See early messages.");
 	}else if(timestampErrorWarning){
@@ -1013,14 +1563,19 @@ DWORD acqStat;   //!< ACQUISITION STATUS reg, must be global because read by pol
  */
 extern "C" INT poll_event(INT source, INT count, BOOL test)
 {
-  register int i;
+  int i;
   
 #if 1  // Look for DTM fragment; figure out which fragments are needed;
   // then wait till we have those fragments.
   for (i = 0; i < count; i++) {
-    
-    
-    bool evtReady = true;
+
+    // Time slices: any record to sort in, or a slice to close; no DTM needed
+    if (fAssemblyMode == SLICE_MODE) {
+      if (!test && ((EBFragment::GetReadyMask() & required_mask) || slicer.IsDue(ss_millitime())))
+        return 1;
+      usleep(100);
+      continue;
+    }
     
      // Check for data in DTM fragment (first fragment)
     itebfragment = ebfragment.begin();
@@ -1042,28 +1597,19 @@ extern "C" INT poll_event(INT source, INT count, BOOL test)
                         }
     }			
     
-    // Check if we have DTM fragment; if not, keep looping.
-    if(itebfragment->GetNumEventsInRB() == 0){
-      usleep(100);
-      continue;
-    }
-    
-    // Loop over other fragments.
-    for(unsigned int ifrag = 1; ifrag < ebfragment.size(); ifrag++){
-      
-      // If the fragment is disabled, then ignore
-      if (!ebfragment[ifrag].GetEnable()){continue;}
-      
-      // Now check if this fragment has available events in ring buffer
-      if(ebfragment[ifrag].GetNumEventsInRB() == 0) {
-	evtReady = false;				
-      }
-    }
+    /* The DTM and all the other enabled fragments must have at least one event
+     * in their ring buffer.  One load of the readiness mask whatever the
+     * number of fragments.  Quarantined fragments are not waited for.
+     */
+    uint64_t needed = required_mask & ~quarantined_mask;
+    uint64_t ready = EBFragment::GetReadyMask();
+    bool evtReady = ((ready & needed) == needed);
     
     //If event not ready or we're in test phase, keep looping
     if (evtReady && !test){
       return 1;
     }
+    if (quarantine_timeout > 0 && !test) Watchdog(ready, needed);
     usleep(100);
   }
 #endif
@@ -1071,6 +1617,42 @@ extern "C" INT poll_event(INT source, INT count, BOOL test)
   return 0;
 }
 
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Quarantine the fragments holding up the assembly
+ *
+ * Called by poll_event() while an event is incomplete.  A fragment without
+ * any event while others have some, for more than "Quarantine timeout (s)",
+ * is taken out of the assembly: the events are built without it (EBMF
+ * bank) until it catches up again (SelectFragments()).  The DTM fragment is
+ * the trigger reference, never quarantined.
+ *
+ * \param   [in]  ready   readiness mask
+ * \param   [in]  needed  fragments waited for
+ */
+void Watchdog(uint64_t ready, uint64_t needed)
+{
+  DWORD now = ss_millitime() | 1;
+  for (unsigned int fid = 0; fid < blocked_since.size(); fid++) {
+    uint64_t bit = 1ULL << fid;
+    if (!(needed & bit) || (ready & bit) || !(ready & needed)) {
+      blocked_since[fid] = 0;
+      continue;
+    }
+    if (!blocked_since[fid]) {
+      blocked_since[fid] = now;
+    } else if (now - blocked_since[fid] > (DWORD)quarantine_timeout * 1000 && ebfragment[fid].GetTmask() != 0x1) {
+      quarantined_mask |= bit;
+      blocked_since[fid] = 0;
+      nquarantines++;
+      cm_msg(MERROR, "Watchdog", "No event from fragment %s (ID=%d) for %d s while the others have some: quarantined, events built without it"
+             , ebfragment[fid].GetEqpName().c_str(), fid, quarantine_timeout);
+      set_equipment_status(equipment[EBUILDER_EQUIPMENT].name, "Running degraded", "#FFFF00");
+      EBTrace::Dump("quarantine");
+    }
+  }
+}
+
 //---------------------------------------------------------------------------------
 INT SNAssembly(char *pevent, INT off)
 {
@@ -1078,52 +1660,532 @@ INT SNAssembly(char *pevent, INT off)
   
   if (!runInProgress) return 0;
   
+  EBTrace::Record(EBTrace::kAssembly, EBTrace::kAssemblyStart, sn);
+
+  // Fragments with this event; the others have lost it
+  if (!SelectFragments()) {
+    EBTrace::Record(EBTrace::kAssembly, EBTrace::kAssemblyEnd, 0);
+    return 0;
+  }
+
+  // Load shedding on the DTM trigger word, before any work on the records
+  bool need_trigger = shedder.IsEnabled() || router.IsEnabled() || (bankfilter.IsEnabled() && bankfilter.UsesTrigger());
+  DWORD trigger = need_trigger ? DTMTrigger() : 0xFFFFFFFF;
+  DWORD prescale = 1;
+  if (shedder.IsEnabled()) {
+    DWORD now = ss_millitime();
+    if (shedder.IsDue(now)) shedder.Update(now, MaxRingLevel());
+    if (!shedder.Keep(trigger, &prescale)) {
+      for (unsigned int i = 0; i < ev_frag.size(); i++)
+        ev_frag[i]->ReleaseRecord();
+      EBTrace::Record(EBTrace::kAssembly, EBTrace::kAssemblyEnd, 0);
+      return 0;
+    }
+  }
+
+  // Fragment records and their merged QT summary, for the L2 filter and the QTSM bank
+  bool have_records = (l2filter || fQTSummaryBank) && PeekRecords();
+
+  // Level-2 filter: decided on the ring buffer records, before any bank is merged
+  EBL2Filter::Decision l2 = EBL2Filter::kAccept;
+  if (l2filter && have_records) {
+    l2 = l2filter->Decide(qt_summary, &ev_records[0], ev_records.size());
+    if (l2 == EBL2Filter::kReject) {
+      for (unsigned int i = 0; i < ev_frag.size(); i++)
+        ev_frag[i]->ReleaseRecord();
+      EBTrace::Record(EBTrace::kAssembly, EBTrace::kAssemblyEnd, 0);
+      return 0;
+    }
+  }
+
+  // Output buffer of this trigger class, -1: the equipment buffer
+  int route = router.IsEnabled() ? router.Route(trigger) : -1;
+
+  // Async output: the event is built in the output ring, mfe gets nothing back
+  EVENT_HEADER *pout = NULL;
+  if (fAsyncOutput && route < 0) {
+    while (!(pout = EBSender::GetSlot(100)))
+      if (!runInProgress) return 0;
+    memcpy(pout, (EVENT_HEADER *)pevent - 1, sizeof(EVENT_HEADER));
+    pevent = (char *)(pout + 1);
+  }
+
   // Prepare event for MIDAS bank
   bk_init32(pevent);
   
+  // L2 decision and filter values, first bank of the event
+  if (l2filter) {
+    char l2name[5] = "L2DC";
+    float *pl2;
+    bk_create(pevent, l2name, TID_FLOAT, (void **)&pl2);
+    *pl2++ = (float)l2;
+    pl2 += l2filter->GetValues(pl2);
+    bk_close(pevent, pl2);
+  }
+
+  // Detector-wide QT summary and fragment timestamp spread
+  if (fQTSummaryBank && have_records) {
+    char qtname[5] = "QTSM";
+    DWORD *pqt;
+    bk_create(pevent, qtname, TID_DWORD, (void **)&pqt);
+    pqt += qt_summary.FillBank(pqt);
+    bk_close(pevent, pqt);
+  }
+
+  // Trigger bits and prescale applied, for the livetime correction
+  if (shedder.IsEnabled()) {
+    char lsname[5] = "EBLS";
+    DWORD *pls;
+    bk_create(pevent, lsname, TID_DWORD, (void **)&pls);
+    *pls++ = trigger;
+    *pls++ = prescale;
+    *pls++ = (DWORD)shedder.GetFill();
+    bk_close(pevent, pls);
+  }
+
+  // Partial event: fragment IDs without it (bits 0-31, 32-63)
+  if (ev_missing) {
+    char mfname[5] = "EBMF";
+    DWORD *pmf;
+    bk_create(pevent, mfname, TID_DWORD, (void **)&pmf);
+    *pmf++ = (DWORD)ev_missing;
+    *pmf++ = (DWORD)(ev_missing >> 32);
+    bk_close(pevent, pmf);
+  }
+
+  // Scatter-gather: event header first, filled in at the send
+  sg_ptr.assign(1, (const char *)NULL);
+  sg_len.assign(1, 0);
+  sg_frag.clear();
+
+  // Fragment index, ahead of the fragment banks so that its size is known; per fragment:
+  // [0] fragment ID, [1] event ID | trigger mask << 16 of the fragment event,
+  // [2] serial number, [3] timestamp (trailer ts_best, 16ns, 30 bits),
+  // [4] trailer flags (EB_TRAILER_TS_VALID: timestamp valid),
+  // [5] first byte of its banks and [6] byte past them, from the first bank of the event
+  DWORD *pfi = NULL;
+  if (fFragmentIndex) {
+    char finame[5] = "EBFI";
+    bk_create(pevent, finame, TID_DWORD, (void **)&pfi);
+    memset(pfi, 0, ev_frag.size() * EBFI_WORDS * sizeof(DWORD));
+    bk_close(pevent, pfi + ev_frag.size() * EBFI_WORDS);
+  }
+
+  // Bank selection of this trigger class, applied as the banks are merged
+  EBBankFilter *filter = bankfilter.IsEnabled() ? &bankfilter : NULL;
+  int cls = filter ? bankfilter.Class(trigger) : -1;
   
-  for (itebfragment = ebfragment.begin(); itebfragment != ebfragment.end(); ++itebfragment) {
+  for (unsigned int i = 0; i < ev_frag.size(); i++) {
+    EBFragment *frag = ev_frag[i];
     if (debug) {
-      printf("fragmentID:%d Enable:%d Name:%s\n", itebfragment->GetFragmentID()
-	     , itebfragment->GetEnable()
-	     , itebfragment->GetBufferName().c_str());
+      printf("fragmentID:%d Name:%s\n", frag->GetFragmentID()
+	     , frag->GetBufferName().c_str());
+    }
+
+    // Add some time stamp checks here too!!!
+
+    if (pfi) {
+      char *prec;
+      pfi[0] = frag->GetFragmentID();
+      if (frag->PeekRecord(&prec) && prec) {
+        EVENT_HEADER *pfh = (EVENT_HEADER *)prec;
+        EBRECORD_TRAILER *t = EBRecordTrailer(prec);
+        pfi[1] = pfh->event_id | ((DWORD)pfh->trigger_mask << 16);
+        pfi[2] = pfh->serial_number;
+        pfi[3] = t->ts_best;
+        pfi[4] = t->flags;
+      }
+      pfi[5] = BanksSize(pevent);
     }
-    if (itebfragment->GetEnable()) {
       
-      /*
-       * CHECK for S/N across all the fragments
-       */
-      DWORD snref, sn = itebfragment->GetSNFragment();
-      if (itebfragment->GetFragmentID() == 0) {
-	snref = sn;
-      } else {
-	if (snref != sn) {
-	  printf("SN mismatch!!!! (RefS/N:%d, S/N[%d]:%d)\n", snref, itebfragment->GetFragmentID(), sn);
-	  std::vector<EBFragment>::iterator iitebfragment;   //!< Main thread iterator
-	  for (iitebfragment = ebfragment.begin(); iitebfragment != ebfragment.end(); ++iitebfragment) {
-	    if (iitebfragment->GetEnable()) {
-	      iitebfragment->PrintSome();
-	      
-	      
-	    }
-	  }
-	}				
+    if (fScatterGather && filter) {
+      // Banks kept, as pieces left in the ring buffer
+      if (frag->PeekBanks(*filter, cls, sg_ptr, sg_len))
+	sg_frag.push_back(frag);
+    } else if (fScatterGather) {
+      // Leave the banks in the ring buffer, sent from there below
+      char *pbanks;
+      DWORD size;
+      if (frag->PeekBanks(&pbanks, &size)) {
+	sg_ptr.push_back(pbanks);
+	sg_len.push_back(size);
+	sg_frag.push_back(frag);
       }
+    } else {
+      frag->AddBanksToEvent(pevent, filter, cls);
+    }
 
-      // Add some time stamp checks here too!!!
-      
-      itebfragment->AddBanksToEvent(pevent);
+    if (pfi) {
+      pfi[6] = BanksSize(pevent);
+      pfi += EBFI_WORDS;
     }
   }
   
+  if (fScatterGather) return SendScatterGather(pevent, route);
+
   INT ev_size = bk_size(pevent);
   if(ev_size == 0) {
     cm_msg(MINFO,"read_trigger_event", "******** Event size is 0, SN: %d", sn);
   }
+  nbuilt++;
+  EBTrace::Record(EBTrace::kAssembly, EBTrace::kAssemblyEnd, ev_size);
   
+  if (route >= 0) {
+    // Routed away from the equipment buffer: sent here, mfe gets nothing back
+    EQUIPMENT *eq = &equipment[EBUILDER_EQUIPMENT];
+    EVENT_HEADER *pheader = (EVENT_HEADER *)pevent - 1;
+    pheader->data_size = ev_size;
+    if (router.Send(route, pheader)) {
+      eq->bytes_sent += sizeof(EVENT_HEADER) + ev_size;
+      eq->events_sent++;
+    }
+    eq->serial_number++;
+    return 0;
+  }
+
+  if (pout) {
+    // mfe sends nothing for a 0 return: serial number and statistics updated here
+    EQUIPMENT *eq = &equipment[EBUILDER_EQUIPMENT];
+    pout->data_size = ev_size;
+    EBSender::Commit(pout);
+    eq->serial_number++;
+    eq->bytes_sent += sizeof(EVENT_HEADER) + ev_size;
+    eq->events_sent++;
+    return 0;
+  }
+
+  return ev_size;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Time-slice assembly (SLICE_MODE)
+ *
+ * The records of all the fragments are taken out of the ring buffers into
+ * their slice (EBTimeSlicer::Add()), then the oldest slice is built if the
+ * watermark rule allows it.  No event otherwise: mfe polls again.
+ */
+INT SliceAssembly(char *pevent, INT off)
+{
+  if (!runInProgress) return 0;
+
+  DWORD now = ss_millitime();
+  // Bounded, so that a busy fragment doesn't keep the slices from closing
+  for (itebfragment = ebfragment.begin(); itebfragment != ebfragment.end(); ++itebfragment)
+    if (required_mask & (1ULL << itebfragment->GetFragmentID()))
+      SliceCollect(&*itebfragment, now, 1000);
+
+  if (!slicer.IsDue(now)) return 0;
+
+  sn = SERIAL_NUMBER(pevent);
+  EBTrace::Record(EBTrace::kAssembly, EBTrace::kAssemblyStart, sn);
+
+  // Async output: the event is built in the output ring, mfe gets nothing back
+  EVENT_HEADER *pout = NULL;
+  if (fAsyncOutput) {
+    while (!(pout = EBSender::GetSlot(100)))
+      if (!runInProgress) return 0;
+    memcpy(pout, (EVENT_HEADER *)pevent - 1, sizeof(EVENT_HEADER));
+    pevent = (char *)(pout + 1);
+  }
+
+  bk_init32(pevent);
+  slicer.Build(pevent, now);
+
+  INT ev_size = bk_size(pevent);
+  nbuilt++;
+  EBTrace::Record(EBTrace::kAssembly, EBTrace::kAssemblyEnd, ev_size);
+
+  if (pout) {
+    // mfe sends nothing for a 0 return: serial number and statistics updated here
+    EQUIPMENT *eq = &equipment[EBUILDER_EQUIPMENT];
+    pout->data_size = ev_size;
+    EBSender::Commit(pout);
+    eq->serial_number++;
+    eq->bytes_sent += sizeof(EVENT_HEADER) + ev_size;
+    eq->events_sent++;
+    return 0;
+  }
+
   return ev_size;
 }
 
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Records of a fragment ring buffer into their time slices
+ *
+ * \param   [in]  frag   fragment
+ * \param   [in]  now    ss_millitime()
+ * \param   [in]  max    records taken at most
+ */
+void SliceCollect(EBFragment *frag, DWORD now, int max)
+{
+  for (int n = 0; n < max && frag->GetNumEventsInRB() > 0; n++) {
+    char *prec;
+    if (!frag->PeekRecord(&prec)) break;
+    if (prec) slicer.Add(frag->GetFragmentID(), prec, now);
+    frag->ReleaseRecord();
+  }
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   EOR: the time slices still open, due or not
+ *
+ * Called once the fragment threads are joined and their records sorted in,
+ * before EBSender::Stop().  mfe doesn't poll any more: the event header,
+ * serial number and statistics are done here.  The slices go to the output
+ * stage, or straight to the equipment buffer without async output.
+ */
+void FlushSlices()
+{
+  EQUIPMENT *eq = &equipment[EBUILDER_EQUIPMENT];
+  std::vector<char> local;
+  if (!fAsyncOutput)
+    local.resize(sizeof(EVENT_HEADER) + max_event_size);
+  while (slicer.GetOpen()) {
+    EVENT_HEADER *pout;
+    if (fAsyncOutput) {
+      pout = EBSender::GetSlot(1000);
+      if (!pout) {
+        cm_msg(MERROR, "EOR", "Output ring full: %d time slices not flushed", slicer.GetOpen());
+        break;
+      }
+    } else {
+      pout = (EVENT_HEADER *)&local[0];
+    }
+    bm_compose_event(pout, eq->info.event_id, eq->info.trigger_mask, 0, eq->serial_number);
+    char *pevent = (char *)(pout + 1);
+    bk_init32(pevent);
+    slicer.Build(pevent, ss_millitime(), true);
+    INT ev_size = bk_size(pevent);
+    pout->data_size = ev_size;
+    nbuilt++;
+    eq->serial_number++;
+    if (fAsyncOutput) {
+      EBSender::Commit(pout);
+    } else {
+      int status = bm_send_event(eq->buffer_handle, pout, sizeof(EVENT_HEADER) + ev_size, BM_WAIT);
+      if (status != BM_SUCCESS) {
+        cm_msg(MERROR, "EOR", "bm_send_event error %d, time slice SN: %d", status, pout->serial_number);
+        continue;
+      }
+    }
+    eq->bytes_sent += sizeof(EVENT_HEADER) + ev_size;
+    eq->events_sent++;
+  }
+  if (!fAsyncOutput)
+    bm_flush_cache(eq->buffer_handle, BM_WAIT);
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Fill level (%) of the fullest fragment ring buffer (as in EBFR)
+ */
+double MaxRingLevel()
+{
+  double level = 0.;
+  for (itebfragment = ebfragment.begin(); itebfragment != ebfragment.end(); ++itebfragment) {
+    if (!itebfragment->IsEnabled() || itebfragment->GetRingBufferHandle() < 0) continue;
+    int rb_level;
+    rb_get_buffer_level(itebfragment->GetRingBufferHandle(), &rb_level);
+    double fill = 100.0 * rb_level / (double)event_buffer_size;
+    if (fill > level) level = fill;
+  }
+  return level;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   DTM trigger bits of the event being assembled
+ *
+ * \return  DTRG trigger word bits 16-23, 0xFFFFFFFF if the DTM record is missing
+ */
+DWORD DTMTrigger()
+{
+  for (unsigned int i = 0; i < ev_frag.size(); i++) {
+    if (ev_frag[i]->GetTmask() != 0x1) continue;
+    std::pair<unsigned int,unsigned int> used = ev_frag[i]->GetDTMTriggerMaskUsed();
+    return used.first;
+  }
+  return 0xFFFFFFFF;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Fragments with the next event
+ *
+ * Each ring buffer is in serial number order (ebReorder.hxx): the event
+ * to build is the lowest serial number at the head of the enabled
+ * fragments (ev_frag).  A fragment with a later one has lost this event
+ * (ev_missing); the event is built without it, or skipped if "Build
+ * partial events" is off.
+ *
+ * Quarantined fragments (Watchdog()) are always missing.  Their records
+ * older than the event are dropped; once one is not, the fragment has
+ * caught up and is back in the assembly.
+ *
+ * \return  false if the event is skipped (its records released)
+ */
+bool SelectFragments()
+{
+  ev_frag.clear();
+  ev_sn.clear();
+  ev_missing = 0;
+  DWORD target = 0;
+  for (itebfragment = ebfragment.begin(); itebfragment != ebfragment.end(); ++itebfragment) {
+    if (!itebfragment->GetEnable()) continue;
+    if (quarantined_mask & (1ULL << itebfragment->GetFragmentID())) continue;
+    DWORD fsn = itebfragment->GetSNFragment();
+    if (ev_frag.empty() || (int32_t)(fsn - target) < 0) target = fsn;
+    ev_frag.push_back(&*itebfragment);
+    ev_sn.push_back(fsn);
+  }
+
+  if (quarantined_mask) {
+    for (itebfragment = ebfragment.begin(); itebfragment != ebfragment.end(); ++itebfragment) {
+      int fid = itebfragment->GetFragmentID();
+      if (!itebfragment->GetEnable() || !(quarantined_mask & (1ULL << fid))) continue;
+      while (itebfragment->GetNumEventsInRB() > 0) {
+        DWORD fsn = itebfragment->GetSNFragment();
+        if ((int32_t)(fsn - target) < 0) {
+          itebfragment->ReleaseRecord();
+          nstale++;
+          continue;
+        }
+        quarantined_mask &= ~(1ULL << fid);
+        ev_frag.push_back(&*itebfragment);
+        ev_sn.push_back(fsn);
+        cm_msg(MINFO, "SNAssembly", "Fragment %s (ID=%d) caught up at S/N %u, back in the events"
+               , itebfragment->GetEqpName().c_str(), fid, fsn);
+        if (!quarantined_mask)
+          set_equipment_status(equipment[EBUILDER_EQUIPMENT].name, "Started run", "#00ff00");
+        break;
+      }
+    }
+  }
+
+  unsigned int n = 0;
+  for (unsigned int i = 0; i < ev_frag.size(); i++) {
+    if (ev_sn[i] == target) ev_frag[n++] = ev_frag[i];
+    else ev_missing |= (1ULL << ev_frag[i]->GetFragmentID());
+  }
+  ev_frag.resize(n);
+  if (quarantined_mask) {
+    ev_missing |= quarantined_mask;
+    ndegraded++;
+  }
+  if (!(ev_missing & ~quarantined_mask)) return true;
+
+  EB_POST(EBMessage::kSNMismatch, EBMSG_STDOUT, "SNAssembly", "S/N %u missing in fragments 0x%llx, %s"
+                  , target, (unsigned long long)(ev_missing & ~quarantined_mask), fBuildPartial ? "built without them" : "skipped");
+  EBTrace::Record(EBTrace::kAssembly, EBTrace::kSNMismatch, target);
+  EBTrace::Dump("SN mismatch");
+  // Raw ring dump only on request, the flight recorder has the history
+  if (debug) {
+    for (itebfragment = ebfragment.begin(); itebfragment != ebfragment.end(); ++itebfragment)
+      if (itebfragment->GetEnable()) itebfragment->PrintSome();
+  }
+
+  if (fBuildPartial) {
+    npartial++;
+    return true;
+  }
+  for (unsigned int i = 0; i < ev_frag.size(); i++)
+    ev_frag[i]->ReleaseRecord();
+  nskipped++;
+  return false;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Records of the next event, and their merged QT summary
+ *
+ * The records of the fragments with the event (ev_frag) are looked at in place
+ * (ev_records, qt_summary); a record that can't be trusted (bad control
+ * word) is left out.  On an rp timeout there is no summary: the event is
+ * built as usual and the assembly reports the problem.
+ *
+ * \return  true if ev_records and qt_summary can be used
+ */
+bool PeekRecords()
+{
+  ev_records.clear();
+  qt_summary.Clear();
+  for (unsigned int i = 0; i < ev_frag.size(); i++) {
+    char *rec;
+    if (!ev_frag[i]->PeekRecord(&rec)) return false;
+    if (rec) {
+      ev_records.push_back(rec);
+      qt_summary.Add(rec);
+    }
+  }
+  return !ev_records.empty();
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Bytes of banks in the event being built, the scatter-gather pieces
+ *          not sent yet included
+ */
+DWORD BanksSize(char *pevent)
+{
+  DWORD size = ((BANK_HEADER *)pevent)->data_size;
+  for (unsigned int i = 1; i < sg_len.size(); i++)
+    size += sg_len[i];
+  return size;
+}
+
+//---------------------------------------------------------------------------------
+/**
+ * \brief   Send the event with the fragment banks still in the ring buffers
+ *
+ * The event header and the banks composed in pevent go first, then the
+ * fragment banks (sg_ptr/sg_len/sg_frag, filled by SNAssembly) straight from the
+ * ring buffers: bm_send_event_sg() copies them once into the output buffer.
+ * The records are released after the send.  mfe sends nothing for a 0
+ * return, so the equipment serial number and statistics are updated here.
+ *
+ * \param   [in]  pevent  event being built (mfe buffer)
+ * \param   [in]  route   output buffer route (ebRouter.hxx), -1: equipment buffer
+ * \return  0, the event is already sent
+ */
+INT SendScatterGather(char *pevent, int route)
+{
+  EQUIPMENT *eq = &equipment[EBUILDER_EQUIPMENT];
+  EVENT_HEADER *pheader = (EVENT_HEADER *)pevent - 1;
+  BANK_HEADER *pbh = (BANK_HEADER *)pevent;
+
+  sg_ptr[0] = (const char *)pheader;
+  sg_len[0] = sizeof(EVENT_HEADER) + bk_size(pevent);
+  for (unsigned int i = 1; i < sg_len.size(); i++)
+    pbh->data_size += sg_len[i];
+  pheader->data_size = bk_size(pevent);
+
+  int status;
+  if (route >= 0) {
+    status = router.Send(route, sg_ptr.size(), &sg_ptr[0], &sg_len[0]) ? BM_SUCCESS : BM_ASYNC_RETURN;
+  } else {
+    status = bm_send_event_sg(eq->buffer_handle, sg_ptr.size(), &sg_ptr[0], &sg_len[0], BM_WAIT);
+    if (status != BM_SUCCESS)
+      EB_POST(EBMessage::kOther, MT_ERROR, "SNAssembly", "bm_send_event_sg error %d, SN: %d", status, sn);
+  }
+
+  for (unsigned int i = 0; i < sg_frag.size(); i++)
+    sg_frag[i]->ReleaseRecord();
+
+  if (status == BM_SUCCESS) {
+    eq->bytes_sent += sizeof(EVENT_HEADER) + pheader->data_size;
+    eq->events_sent++;
+  }
+  if (status == BM_SUCCESS || route >= 0) eq->serial_number++;
+
+  nbuilt++;
+  EBTrace::Record(EBTrace::kAssembly, EBTrace::kAssemblyEnd, pheader->data_size);
+
+  return 0;
+}
+
 //---------------------------------------------------------------------------------
 /**
  * \brief   Interrupt configuration (not implemented)
@@ -1155,10 +2217,6 @@ extern "C" INT interrupt_configure(INT cmd, INT source, POINTER_T adr)
 
 //---------------------------------------------------------------------------------
 
-// Variable to keep track of which ring buffers are above
-// 70% threshold.
-int rb_is_above_threshold[NBFRAGMENT] = {0};
-
 INT read_buffer_level(char *pevent, INT off) {
   
   bk_init32(pevent);
@@ -1169,8 +2227,9 @@ INT read_buffer_level(char *pevent, INT off) {
   char bankName[5] = "EBLV"; 
   bk_create(pevent, bankName, TID_DWORD, (void **) &pdata);
   
-  // Want a fixed length for the bank.  
-  for(unsigned int i = 0; i < 10; i++){
+  // Want a fixed length for the bank: one entry per fragment, at least NBFRAGMENT
+  unsigned int nbank = std::max((unsigned int)ebfragment.size(), (unsigned int)NBFRAGMENT);
+  for(unsigned int i = 0; i < nbank; i++){
     if(i < ebfragment.size() && ebfragment[i].IsEnabled())
       *pdata++ = ebfragment[i].GetNumEventsInRB();
     else
@@ -1185,8 +2244,9 @@ INT read_buffer_level(char *pevent, INT off) {
   bk_create(pevent, bankName2, TID_DOUBLE, (void **) &pdata2);
 
   // Want a fixed length for the bank.  
-  for(unsigned int i = 0; i < 10; i++){
-    if(i < ebfragment.size() && ebfragment[i].IsEnabled()){			
+  for(unsigned int i = 0; i < nbank; i++){
+    if(i < ebfragment.size() && ebfragment[i].IsEnabled() && ebfragment[i].GetRingBufferHandle() >= 0
+       && i < rb_is_above_threshold.size()){
 			rb_get_buffer_level(ebfragment[i].GetRingBufferHandle(), &rb_level);
 
 			double fill_frac = 100.0 * rb_level/(float)event_buffer_size;
@@ -1210,6 +2270,135 @@ INT read_buffer_level(char *pevent, INT off) {
   }
   bk_close(pevent, pdata2); 
 
+  // Messages suppressed by the rate limit, per message id, then lost on full queue
+  char bankName4[5] = "EBMS";
+  bk_create(pevent, bankName4, TID_DWORD, (void **) &pdata);
+  for(int i = 0; i < EBMessage::kNIds; i++)
+    *pdata++ = EBMessage::GetSuppressed(i);
+  *pdata++ = EBMessage::GetDropped();
+  bk_close(pevent, pdata);
+
+  // Output stage: events queued and sent, batches, output ring fill (%),
+  // time (s) the assembly waited for the ring and the sender for the output buffer,
+  // packed containers sent, bytes before and after compression, events too large for
+  // the compressor (sent uncompressed)
+  if (fAsyncOutput) {
+    char bankName4[5] = "EBOS";
+    bk_create(pevent, bankName4, TID_DOUBLE, (void **) &pdata2);
+    *pdata2++ = (double)EBSender::GetQueued();
+    *pdata2++ = (double)EBSender::GetSent();
+    *pdata2++ = (double)EBSender::GetBatches();
+    *pdata2++ = EBSender::GetFillLevel();
+    *pdata2++ = EBSender::GetAssemblyWait();
+    *pdata2++ = EBSender::GetSenderWait();
+    *pdata2++ = (double)EBSender::GetContainers();
+    *pdata2++ = (double)EBSender::GetBytesIn();
+    *pdata2++ = (double)EBSender::GetBytesOut();
+    *pdata2++ = (double)EBSender::GetUncompressed();
+    bk_close(pevent, pdata2);
+  }
+
+  // Disk writer: bytes written, files, time (s) the sender waited for the disk,
+  // events sampled to the equipment buffer, sampled events dropped (buffer full)
+  if (writer.GetFiles()) {
+    char bankName10[5] = "EBDW";
+    bk_create(pevent, bankName10, TID_DOUBLE, (void **) &pdata2);
+    *pdata2++ = (double)writer.GetBytes();
+    *pdata2++ = (double)writer.GetFiles();
+    *pdata2++ = writer.GetWaitTime();
+    *pdata2++ = (double)EBSender::GetMonitorSent();
+    *pdata2++ = (double)EBSender::GetMonitorDropped();
+    bk_close(pevent, pdata2);
+  }
+
+  // Time slices: built, records built into them, records late, without timestamp,
+  // over the event size, slices closed early, slices open now
+  if (fAssemblyMode == SLICE_MODE) {
+    char bankName11[5] = "EBTS";
+    bk_create(pevent, bankName11, TID_DOUBLE, (void **) &pdata2);
+    *pdata2++ = (double)slicer.GetSlices();
+    *pdata2++ = (double)slicer.GetRecords();
+    *pdata2++ = (double)slicer.GetLate();
+    *pdata2++ = (double)slicer.GetNoTimestamp();
+    *pdata2++ = (double)slicer.GetOverflow();
+    *pdata2++ = (double)slicer.GetForced();
+    *pdata2++ = (double)slicer.GetOpen();
+    bk_close(pevent, pdata2);
+  }
+
+  // Level-2 filter: events accepted, prescaled, rejected in this run
+  if (l2filter) {
+    char bankName5[5] = "EBL2";
+    bk_create(pevent, bankName5, TID_DOUBLE, (void **) &pdata2);
+    *pdata2++ = (double)l2filter->GetAccepted();
+    *pdata2++ = (double)l2filter->GetPrescaled();
+    *pdata2++ = (double)l2filter->GetRejected();
+    bk_close(pevent, pdata2);
+  }
+
+  // Events built without some fragments, events skipped for missing fragments,
+  // events built without the quarantined fragments, quarantines in this run,
+  // fragment IDs quarantined now (bits 0-31, 32-63)
+  char bankName6[5] = "EBPE";
+  bk_create(pevent, bankName6, TID_DWORD, (void **) &pdata);
+  *pdata++ = npartial;
+  *pdata++ = nskipped;
+  *pdata++ = ndegraded;
+  *pdata++ = nquarantines;
+  *pdata++ = (DWORD)quarantined_mask;
+  *pdata++ = (DWORD)(quarantined_mask >> 32);
+  bk_close(pevent, pdata);
+
+  // Routing: events, bytes and events dropped (buffer full) per route
+  if (router.IsEnabled()) {
+    char bankName8[5] = "EBRT";
+    bk_create(pevent, bankName8, TID_DOUBLE, (void **) &pdata2);
+    for (int i = 0; i < router.GetNumRoutes(); i++) {
+      *pdata2++ = (double)router.GetEvents(i);
+      *pdata2++ = (double)router.GetBytes(i);
+      *pdata2++ = (double)router.GetDropped(i);
+    }
+    bk_close(pevent, pdata2);
+  }
+
+  // Bank selection: banks dropped, bytes dropped, bytes kept of the fragments selected
+  if (bankfilter.IsEnabled()) {
+    char bankName9[5] = "EBBS";
+    bk_create(pevent, bankName9, TID_DOUBLE, (void **) &pdata2);
+    *pdata2++ = (double)bankfilter.GetBanksDropped();
+    *pdata2++ = (double)bankfilter.GetBytesDropped();
+    *pdata2++ = (double)bankfilter.GetBytesKept();
+    bk_close(pevent, pdata2);
+  }
+
+  // Load shedding: events kept, shed, fullest ring buffer (%), prescale per DTM trigger bit
+  if (shedder.IsEnabled()) {
+    char bankName7[5] = "EBSH";
+    bk_create(pevent, bankName7, TID_DOUBLE, (void **) &pdata2);
+    *pdata2++ = (double)shedder.GetKept();
+    *pdata2++ = (double)shedder.GetShed();
+    *pdata2++ = shedder.GetFill();
+    for (int i = 0; i < EBLS_NTRIGGERS; i++)
+      *pdata2++ = (double)shedder.GetPrescale(i);
+    bk_close(pevent, pdata2);
+  }
+
+  // Perf counters of the last run, once at EOR.
+  // Per thread (fragments in order, assembly last): events, then per event
+  // cycles, instructions, LLC misses, branch misses, context switches (-1: n/a)
+  if (perf_report_pending) {
+    char bankName3[5] = "EBPC";
+    bk_create(pevent, bankName3, TID_DOUBLE, (void **) &pdata2);
+    for (unsigned int i = 0; i <= ebfragment.size(); i++) {
+      EBPerfCounters &pc = (i < ebfragment.size()) ? perf_fragment[i] : perf_assembly;
+      bool off = i < ebfragment.size() && !ebfragment[i].IsEnabled();   // counters of an earlier run
+      *pdata2++ = off ? 0. : (double)pc.GetEvents();
+      for (int j = 0; j < EBPerfCounters::kNCounters; j++)
+        *pdata2++ = off ? -1. : pc.GetPerEvent(j);
+    }
+    bk_close(pevent, pdata2);
+    perf_report_pending = false;
+  }
 
   return bk_size(pevent);
 }